@@ -7,7 +7,11 @@
 Config::Config() :
     simulationFPS(60.0f), gravity(9.8f),
     defaultModelPosition(0.0f, 0.0f), defaultScale(1.0f),
-    defaultCameraPosition(0, 10, 50), defaultGazePosition(0, 10, 0)
+    defaultCameraPosition(0, 10, 50), defaultGazePosition(0, 10, 0),
+    ikIterationBudget(0), motionMemoryLimit(0), workerThreads(0), physicsBudget(0),
+    physicsLodSize(0), physicsPreroll(60), physicsThreads(1), physicsThread(false),
+    physicsSolver(PhysicsSolver::Bullet), physicsCache(true),
+    modelCache(true)
 {}
 
 Config Config::Parse(const std::filesystem::path& configFile) {
@@ -28,6 +32,8 @@ Config Config::Parse(const std::filesystem::path& configFile) {
             bool disabled = toml::find_or(motion, "disabled", false);
             auto weight = toml::find_or<decltype(
                     Motion::weight)>(motion, "weight", 1);
+            auto crossfade = toml::find_or<decltype(
+                    Motion::crossfade)>(motion, "crossfade", 1.0f);
             auto raw_path = toml::find<std::vector<std::string>>(motion, "path");
             std::vector<fs::path> path;
             for (const auto& p : raw_path) {
@@ -38,6 +44,7 @@ Config Config::Parse(const std::filesystem::path& configFile) {
             config.motions.push_back(Motion{
                 .disabled = disabled,
                 .weight = weight,
+                .crossfade = crossfade,
                 .paths = std::move(path),
             });
         }
@@ -70,6 +77,38 @@ Config Config::Parse(const std::filesystem::path& configFile) {
         config.simulationFPS = toml::find_or(
                 entire, "simulation-fps", config.simulationFPS);
         config.gravity = toml::find_or(entire, "gravity", config.gravity);
+        config.ikIterationBudget = toml::find_or(
+                entire, "ik-iteration-budget", config.ikIterationBudget);
+        config.motionMemoryLimit = toml::find_or(
+                entire, "motion-memory-limit", config.motionMemoryLimit);
+        config.workerThreads = toml::find_or(
+                entire, "worker-threads", config.workerThreads);
+        config.physicsBudget = toml::find_or(
+                entire, "physics-budget", config.physicsBudget);
+        config.physicsLowPriorityGroups = toml::find_or(
+                entire, "physics-low-priority-groups", config.physicsLowPriorityGroups);
+        config.physicsDisabledGroups = toml::find_or(
+                entire, "physics-disabled-groups", config.physicsDisabledGroups);
+        config.physicsDisabledBodies = toml::find_or(
+                entire, "physics-disabled-bodies", config.physicsDisabledBodies);
+        config.physicsLodSize = toml::find_or(
+                entire, "physics-lod-size", config.physicsLodSize);
+        config.physicsPreroll = toml::find_or(
+                entire, "physics-preroll", config.physicsPreroll);
+        config.physicsThreads = toml::find_or(
+                entire, "physics-threads", config.physicsThreads);
+        config.physicsThread = toml::find_or(
+                entire, "physics-thread", config.physicsThread);
+        config.physicsCache = toml::find_or(
+                entire, "physics-cache", config.physicsCache);
+        config.modelCache = toml::find_or(
+                entire, "model-cache", config.modelCache);
+
+        const auto solver = toml::find_or<std::string>(entire, "physics-solver", "bullet");
+        if (solver == "spring-bone")
+            config.physicsSolver = PhysicsSolver::SpringBone;
+        else if (solver != "bullet")
+            Err::Log("Unknown physics solver:", solver, "(Use \"bullet\")");
     } catch (std::runtime_error& e) {
         // File open error, file read error, etc...
         Err::Exit(e.what());
@@ -0,0 +1,94 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDMorph.h"
+#include "Saba/Model/MMD/MMDNode.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include "simd.hpp"
+#include "yommd.hpp"
+
+void Crossfade::Pose::Resize(size_t nodeCount, size_t morphCount) {
+    const size_t n = Simd::padded(nodeCount);
+    for (auto& t : translates)
+        t.assign(n, 0.0f);
+    for (auto& r : rotates)
+        r.assign(n, 0.0f);
+    rotates[3].assign(n, 1.0f);  // Identity in padding.
+    weights.assign(Simd::padded(morphCount), 0.0f);
+}
+
+Crossfade::Crossfade() :
+    active_(false)
+{}
+
+void Crossfade::Create(const std::shared_ptr<saba::MMDModel>& model) {
+    auto nodeManager = model->GetNodeManager();
+    auto morphManager = model->GetMorphManager();
+    nodes_.clear();
+    for (size_t i = 0; i < nodeManager->GetNodeCount(); ++i)
+        nodes_.push_back(nodeManager->GetMMDNode(i));
+    morphs_.clear();
+    for (size_t i = 0; i < morphManager->GetMorphCount(); ++i)
+        morphs_.push_back(morphManager->GetMorph(i));
+    from_.Resize(nodes_.size(), morphs_.size());
+    to_.Resize(nodes_.size(), morphs_.size());
+    active_ = false;
+}
+
+void Crossfade::Begin() {
+    capture(from_);
+    active_ = true;
+}
+
+bool Crossfade::IsActive() const {
+    return active_;
+}
+
+void Crossfade::Apply(float weight) {
+    if (!active_)
+        return;
+    if (weight >= 1.0f) {
+        // Leave the incoming pose as is.
+        active_ = false;
+        return;
+    }
+
+    capture(to_);
+    const float w = std::max(weight, 0.0f);
+    const size_t nodeCount = Simd::padded(nodes_.size());
+    for (int c = 0; c < 3; ++c)
+        Simd::lerpArray(from_.translates[c].data(), to_.translates[c].data(), nodeCount, w);
+    Simd::nlerpArray(from_.rotates, to_.rotates, nodeCount, w);
+    Simd::lerpArray(from_.weights.data(), to_.weights.data(), Simd::padded(morphs_.size()), w);
+    restore(to_);
+}
+
+void Crossfade::capture(Pose& pose) const {
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+        const auto& t = nodes_[i]->GetAnimationTranslate();
+        const auto& r = nodes_[i]->GetAnimationRotate();
+        for (int c = 0; c < 3; ++c)
+            pose.translates[c][i] = t[c];
+        pose.rotates[0][i] = r.x;
+        pose.rotates[1][i] = r.y;
+        pose.rotates[2][i] = r.z;
+        pose.rotates[3][i] = r.w;
+    }
+    for (size_t i = 0; i < morphs_.size(); ++i)
+        pose.weights[i] = morphs_[i]->GetWeight();
+}
+
+void Crossfade::restore(const Pose& pose) {
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+        nodes_[i]->SetAnimationTranslate(glm::vec3(
+                    pose.translates[0][i], pose.translates[1][i], pose.translates[2][i]));
+        nodes_[i]->SetAnimationRotate(glm::quat(
+                    pose.rotates[3][i], pose.rotates[0][i], pose.rotates[1][i], pose.rotates[2][i]));
+    }
+    for (size_t i = 0; i < morphs_.size(); ++i)
+        morphs_[i]->SetWeight(pose.weights[i]);
+}
@@ -0,0 +1,330 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <vector>
+#include "Saba/Model/MMD/MMDIkSolver.h"
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDNode.h"
+#include "Saba/Model/MMD/PMXFile.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include "yommd.hpp"
+
+namespace {
+// A chain is regarded as converged when the target is closer to the IK bone
+// than this.
+constexpr float ConvergenceTolerance = 1e-3f;
+// Inputs of a chain are regarded as unchanged when they move less than this.
+constexpr float MovementTolerance = 1e-5f;
+
+bool hasFlag(const saba::PMXBone& bone, saba::PMXBoneFlags flag) {
+    return (static_cast<uint16_t>(bone.m_boneFlag) & static_cast<uint16_t>(flag)) != 0;
+}
+
+glm::vec3 getPosition(const Skeleton& skeleton, size_t bone) {
+    return glm::vec3(skeleton.GetGlobalTransform(bone)[3]);
+}
+
+// Decompose R into Rx(x) * Ry(y) * Rz(z).
+glm::vec3 decomposeXYZ(const glm::mat3& m) {
+    const float y = std::asin(std::clamp(m[2][0], -1.0f, 1.0f));
+    const float x = std::atan2(-m[2][1], m[2][2]);
+    const float z = std::atan2(-m[1][0], m[0][0]);
+    return {x, y, z};
+}
+
+glm::quat composeXYZ(const glm::vec3& angles) {
+    return glm::angleAxis(angles.x, glm::vec3(1, 0, 0)) *
+        glm::angleAxis(angles.y, glm::vec3(0, 1, 0)) *
+        glm::angleAxis(angles.z, glm::vec3(0, 0, 1));
+}
+}
+
+IkStage::IkStage() :
+    enabled_(false), iterationBudget_(0), remaining_(0)
+{}
+
+bool IkStage::Create(
+        const saba::PMXFile& pmx,
+        const std::shared_ptr<saba::MMDModel>& model,
+        const Skeleton& skeleton) {
+    auto nodeManager = model->GetNodeManager();
+    auto ikManager = model->GetIKManager();
+    const size_t boneCount = pmx.m_bones.size();
+    if (!skeleton.IsEnabled() || skeleton.GetBoneCount() != boneCount)
+        return false;
+
+    const auto isValidBone = [boneCount](int32_t index) {
+        return index >= 0 && static_cast<size_t>(index) < boneCount;
+    };
+
+    // Order chains as Skeleton visits them: bones before physics first, then
+    // by deform depth, so that chains depending on others (e.g. toe IK
+    // following leg IK) are solved after them.
+    const auto afterPhysics = [&pmx](size_t i) {
+        return hasFlag(pmx.m_bones[i], saba::PMXBoneFlags::DeformAfterPhysics);
+    };
+    std::vector<size_t> order(boneCount);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&pmx, &afterPhysics](size_t a, size_t b) {
+        if (afterPhysics(a) != afterPhysics(b))
+            return afterPhysics(b);
+        return pmx.m_bones[a].m_deformDepth < pmx.m_bones[b].m_deformDepth;
+    });
+
+    chains_.clear();
+    for (const size_t i : order) {
+        const auto& bone = pmx.m_bones[i];
+        if (!hasFlag(bone, saba::PMXBoneFlags::IK) ||
+                !isValidBone(bone.m_ikTargetBoneIndex) || bone.m_ikLinks.empty())
+            continue;
+
+        const auto solverIndex = ikManager->FindIKSolverIndex(nodeManager->GetMMDNode(i)->GetName());
+        if (solverIndex == saba::MMDIKManager::NPos)
+            continue;
+
+        Chain chain = {
+            .name = nodeManager->GetMMDNode(i)->GetName(),
+            .solver = ikManager->GetMMDIKSolver(solverIndex),
+            .ikBone = skeleton.FindIndex(i),
+            .targetBone = skeleton.FindIndex(bone.m_ikTargetBoneIndex),
+            .rootParent = -1,
+            .maxIterations = static_cast<uint32_t>(std::max(bone.m_ikIterationCount, 1)),
+            .limitAngle = bone.m_ikLimit,
+            .links = {},
+            .lastIkPosition = glm::vec3(0.0f),
+            .lastRootTransform = glm::mat4(0.0f),
+            .solved = false,
+        };
+        for (const auto& l : bone.m_ikLinks) {
+            if (!isValidBone(l.m_ikBoneIndex))
+                continue;
+
+            Link link = {
+                .bone = skeleton.FindIndex(l.m_ikBoneIndex),
+                .enableLimit = l.m_enableLimit != 0,
+                .singleAxis = -1,
+                .limitMin = glm::vec3(0.0f),
+                .limitMax = glm::vec3(0.0f),
+                .ikRotate = glm::quat(1, 0, 0, 0),
+                .bestIkRotate = glm::quat(1, 0, 0, 0),
+                .lastAnimateRotate = glm::quat(0, 0, 0, 0),
+            };
+            if (link.enableLimit) {
+                // Flipping the Z axis flips the rotation about X and Y axes.
+                link.limitMin = glm::vec3(-l.m_limitMax.x, -l.m_limitMax.y, l.m_limitMin.z);
+                link.limitMax = glm::vec3(-l.m_limitMin.x, -l.m_limitMin.y, l.m_limitMax.z);
+                int freeAxes = 0;
+                for (int axis = 0; axis < 3; ++axis) {
+                    if (link.limitMin[axis] != 0.0f || link.limitMax[axis] != 0.0f) {
+                        link.singleAxis = axis;
+                        ++freeAxes;
+                    }
+                }
+                if (freeAxes != 1)
+                    link.singleAxis = -1;
+            }
+            chain.links.push_back(link);
+        }
+        if (chain.links.empty())
+            continue;
+        chain.rootParent = skeleton.GetParent(chain.links.back().bone);
+        chains_.push_back(std::move(chain));
+    }
+
+    stats_.assign(chains_.size(), ChainStats());
+    for (size_t i = 0; i < chains_.size(); ++i)
+        stats_[i].name = chains_[i].name;
+
+    enabled_ = !chains_.empty();
+    return enabled_;
+}
+
+void IkStage::SetIterationBudget(uint32_t budget) {
+    iterationBudget_ = budget;
+}
+
+bool IkStage::IsEnabled() const {
+    return enabled_;
+}
+
+size_t IkStage::GetChainCount() const {
+    return chains_.size();
+}
+
+uint32_t IkStage::GetIkBone(size_t chain) const {
+    return chains_[chain].ikBone;
+}
+
+std::vector<uint32_t> IkStage::GetLinkBones(size_t chain) const {
+    std::vector<uint32_t> bones;
+    for (const auto& link : chains_[chain].links)
+        bones.push_back(link.bone);
+    return bones;
+}
+
+void IkStage::BeginFrame() {
+    remaining_ = iterationBudget_;
+}
+
+void IkStage::SolveChain(Skeleton& skeleton, size_t index) {
+    auto& chain = chains_[index];
+    auto& stats = stats_[index];
+    stats.lastIterations = 0;
+    ++stats.frames;
+
+    // Saba's solver is not run, but its enabled state is still used as the
+    // switch from motions.
+    if (!chain.solver->Enabled()) {
+        chain.solved = false;
+        return;
+    }
+
+    // Warm start from the previous solution.
+    for (const auto& link : chain.links) {
+        skeleton.SetIkRotate(link.bone, link.ikRotate);
+        skeleton.UpdateLocalTransform(link.bone);
+    }
+    skeleton.UpdateGlobalTransform(chain.links.back().bone);
+
+    if (chain.solved && !hasMoved(skeleton, chain)) {
+        ++stats.skippedFrames;
+        return;
+    }
+
+    uint32_t allowance = chain.maxIterations;
+    if (iterationBudget_ != 0) {
+        const auto chainsLeft = static_cast<uint32_t>(chains_.size() - index);
+        allowance = std::min(allowance, std::max(remaining_ / chainsLeft, 1u));
+    }
+    const uint32_t iterations = solveChain(skeleton, chain, allowance);
+    remaining_ -= std::min(remaining_, iterations);
+
+    for (auto& link : chain.links)
+        link.ikRotate = skeleton.GetIkRotate(link.bone);
+    saveInputs(skeleton, chain);
+    chain.solved = true;
+
+    stats.lastIterations = iterations;
+    stats.totalIterations += iterations;
+    stats.maxIterations = std::max(stats.maxIterations, iterations);
+}
+
+const std::vector<IkStage::ChainStats>& IkStage::GetStats() const {
+    return stats_;
+}
+
+void IkStage::LogStats() const {
+    for (const auto& s : stats_) {
+        if (s.frames == 0)
+            continue;
+        Info::Log("IK:", s.name,
+                "avg-iterations:", static_cast<double>(s.totalIterations) / s.frames,
+                "max-iterations:", s.maxIterations,
+                "skipped-frames:", s.skippedFrames, '/', s.frames);
+    }
+}
+
+bool IkStage::hasMoved(const Skeleton& skeleton, const Chain& chain) const {
+    if (glm::length(getPosition(skeleton, chain.ikBone) - chain.lastIkPosition) > MovementTolerance)
+        return true;
+    if (chain.rootParent >= 0) {
+        const auto& m = skeleton.GetGlobalTransform(chain.rootParent);
+        for (int c = 0; c < 4; ++c) {
+            if (glm::length(m[c] - chain.lastRootTransform[c]) > MovementTolerance)
+                return true;
+        }
+    }
+    for (const auto& link : chain.links) {
+        const auto animateRotate = skeleton.GetAnimateRotate(link.bone);
+        if (1.0f - std::abs(glm::dot(animateRotate, link.lastAnimateRotate)) > MovementTolerance)
+            return true;
+    }
+    return false;
+}
+
+void IkStage::saveInputs(const Skeleton& skeleton, Chain& chain) const {
+    chain.lastIkPosition = getPosition(skeleton, chain.ikBone);
+    if (chain.rootParent >= 0)
+        chain.lastRootTransform = skeleton.GetGlobalTransform(chain.rootParent);
+    for (auto& link : chain.links)
+        link.lastAnimateRotate = skeleton.GetAnimateRotate(link.bone);
+}
+
+uint32_t IkStage::solveChain(Skeleton& skeleton, Chain& chain, uint32_t maxIterations) {
+    const auto ikPos = getPosition(skeleton, chain.ikBone);
+    if (glm::length(getPosition(skeleton, chain.targetBone) - ikPos) < ConvergenceTolerance)
+        return 0;
+    float bestDistance = std::numeric_limits<float>::max();
+    uint32_t iteration = 0;
+    while (iteration < maxIterations && bestDistance >= ConvergenceTolerance) {
+        ++iteration;
+
+        for (auto& link : chain.links) {
+            const auto invChain = glm::inverse(skeleton.GetGlobalTransform(link.bone));
+            const auto chainIkVec = glm::vec3(invChain * glm::vec4(ikPos, 1.0f));
+            const auto chainTargetVec =
+                glm::vec3(invChain * glm::vec4(getPosition(skeleton, chain.targetBone), 1.0f));
+            if (glm::length(chainIkVec) < 1e-6f || glm::length(chainTargetVec) < 1e-6f)
+                continue;
+
+            glm::quat rot;
+            if (link.singleAxis >= 0) {
+                // Rotate only about the free axis (e.g. knees).
+                glm::vec3 axis(0.0f);
+                axis[link.singleAxis] = 1.0f;
+                const auto ikVec = chainIkVec - axis * glm::dot(chainIkVec, axis);
+                const auto targetVec = chainTargetVec - axis * glm::dot(chainTargetVec, axis);
+                if (glm::length(ikVec) < 1e-6f || glm::length(targetVec) < 1e-6f)
+                    continue;
+                const auto a = glm::normalize(targetVec);
+                const auto b = glm::normalize(ikVec);
+                float angle = std::acos(std::clamp(glm::dot(a, b), -1.0f, 1.0f));
+                if (glm::dot(glm::cross(a, b), axis) < 0.0f)
+                    angle = -angle;
+                angle = std::clamp(angle, -chain.limitAngle, chain.limitAngle);
+                rot = glm::angleAxis(angle, axis);
+            } else {
+                const auto a = glm::normalize(chainTargetVec);
+                const auto b = glm::normalize(chainIkVec);
+                const float angle = std::min(
+                        std::acos(std::clamp(glm::dot(a, b), -1.0f, 1.0f)), chain.limitAngle);
+                const auto cross = glm::cross(a, b);
+                if (angle < 1e-4f || glm::length(cross) < 1e-6f)
+                    continue;
+                rot = glm::angleAxis(angle, glm::normalize(cross));
+            }
+
+            const auto animateRotate = skeleton.GetAnimateRotate(link.bone);
+            auto chainRotate = skeleton.GetIkRotate(link.bone) * animateRotate * rot;
+            if (link.enableLimit) {
+                const auto angles = glm::clamp(
+                        decomposeXYZ(glm::mat3_cast(chainRotate)), link.limitMin, link.limitMax);
+                chainRotate = composeXYZ(angles);
+            }
+            skeleton.SetIkRotate(link.bone, chainRotate * glm::inverse(animateRotate));
+            skeleton.UpdateLocalTransform(link.bone);
+            skeleton.UpdateGlobalTransform(link.bone);
+        }
+
+        // Limits can make iterations oscillate or move away, so the closest
+        // pose is kept and iterating stops once it's not improved, as Saba's
+        // MMDIkSolver::Solve() does.
+        const float distance = glm::length(getPosition(skeleton, chain.targetBone) - ikPos);
+        if (distance < bestDistance) {
+            bestDistance = distance;
+            for (auto& link : chain.links)
+                link.bestIkRotate = skeleton.GetIkRotate(link.bone);
+        } else {
+            for (const auto& link : chain.links) {
+                skeleton.SetIkRotate(link.bone, link.bestIkRotate);
+                skeleton.UpdateLocalTransform(link.bone);
+            }
+            skeleton.UpdateGlobalTransform(chain.links.back().bone);
+            break;
+        }
+    }
+    return iteration;
+}
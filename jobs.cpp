@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "yommd.hpp"
+
+JobSystem::JobSystem() :
+    remaining_(0), generation_(0), quit_(false), runs_(0)
+{}
+
+JobSystem::~JobSystem() {
+    {
+        std::lock_guard lock(mutex_);
+        quit_ = true;
+    }
+    cv_.notify_all();
+    for (auto& worker : workers_)
+        worker.join();
+}
+
+void JobSystem::Init(unsigned int threadCount) {
+    // The frame has only a few independent chains, so more threads rarely
+    // help.
+    if (threadCount == 0)
+        threadCount = std::clamp(std::thread::hardware_concurrency(), 1u, 4u);
+
+    // The calling thread works as queues_[0].
+    queues_.clear();
+    for (unsigned int i = 0; i < threadCount; ++i)
+        queues_.push_back(std::make_unique<Queue>());
+    for (unsigned int i = 1; i < threadCount; ++i)
+        workers_.emplace_back(&JobSystem::workerMain, this, i);
+    Info::Log("Job threads:", threadCount);
+}
+
+JobSystem::TaskID JobSystem::Add(
+        const std::string& name, std::function<void()> func, const std::vector<TaskID>& deps) {
+    const auto id = static_cast<TaskID>(tasks_.size());
+    for (const auto dep : deps) {
+        if (dep >= id)
+            Err::Exit("Internal error: invalid task dependency:", name);
+        tasks_[dep].successors.push_back(id);
+    }
+
+    const auto stat = std::find_if(stats_.cbegin(), stats_.cend(),
+            [&name](const Stat& s) { return s.name == name; });
+    tasks_.push_back(Task{
+        .func = std::move(func),
+        .successors = {},
+        .depCount = static_cast<uint32_t>(deps.size()),
+        .statIndex = static_cast<uint32_t>(stat - stats_.cbegin()),
+    });
+    if (stat == stats_.cend())
+        stats_.push_back(Stat{.name = name, .seconds = 0.0});
+    if (deps.empty())
+        roots_.push_back(id);
+
+    pending_ = std::make_unique<std::atomic<uint32_t>[]>(tasks_.size());
+    taskSeconds_.resize(tasks_.size());
+    return id;
+}
+
+JobSystem::TaskID JobSystem::ParallelFor(
+        const std::string& name, size_t count, size_t grain,
+        std::function<void(size_t, size_t)> func, const std::vector<TaskID>& deps) {
+    // Split into chunks of at least "grain" items, at most a few per
+    // thread, and join them with an empty task.
+    grain = std::max(grain, count / (queues_.size() * 4) + 1);
+    const auto shared = std::make_shared<std::function<void(size_t, size_t)>>(std::move(func));
+    std::vector<TaskID> chunks;
+    for (size_t begin = 0; begin < count; begin += grain) {
+        const size_t end = std::min(begin + grain, count);
+        chunks.push_back(Add(name, [shared, begin, end]() { (*shared)(begin, end); }, deps));
+    }
+    if (chunks.empty())
+        return Add(name, []() {}, deps);
+    return Add(name + " (join)", []() {}, chunks);
+}
+
+void JobSystem::Run() {
+    for (size_t i = 0; i < tasks_.size(); ++i)
+        pending_[i].store(tasks_[i].depCount, std::memory_order_relaxed);
+    remaining_.store(static_cast<uint32_t>(tasks_.size()));
+
+    if (workers_.empty()) {
+        // Serial path.  Tasks are added after their dependencies, so the
+        // insertion order is a valid order.
+        for (TaskID id = 0; id < tasks_.size(); ++id)
+            runTask(id);
+    } else {
+        {
+            std::lock_guard lock(queues_[0]->mutex);
+            queues_[0]->tasks.insert(queues_[0]->tasks.end(), roots_.cbegin(), roots_.cend());
+        }
+        {
+            std::lock_guard lock(mutex_);
+            ++generation_;
+        }
+        cv_.notify_all();
+        while (remaining_.load() != 0) {
+            if (!runOne(0))
+                std::this_thread::yield();
+        }
+    }
+
+    for (size_t i = 0; i < tasks_.size(); ++i)
+        stats_[tasks_[i].statIndex].seconds += taskSeconds_[i];
+    ++runs_;
+}
+
+void JobSystem::LogStats() const {
+    if (runs_ == 0)
+        return;
+    for (const auto& stat : stats_)
+        Info::Log("Task", stat.name + ':', stat.seconds * 1000.0 / runs_, "ms/frame");
+}
+
+void JobSystem::workerMain(size_t index) {
+    uint64_t seen = 0;
+    for (;;) {
+        {
+            std::unique_lock lock(mutex_);
+            cv_.wait(lock, [this, seen]() { return quit_ || generation_ != seen; });
+            if (quit_)
+                return;
+            seen = generation_;
+        }
+        while (remaining_.load() != 0) {
+            if (!runOne(index))
+                std::this_thread::yield();
+        }
+    }
+}
+
+bool JobSystem::runOne(size_t index) {
+    // Take the newest task of the own queue, or steal the oldest one of
+    // another queue.
+    std::optional<TaskID> id;
+    {
+        auto& own = *queues_[index];
+        std::lock_guard lock(own.mutex);
+        if (!own.tasks.empty()) {
+            id = own.tasks.back();
+            own.tasks.pop_back();
+        }
+    }
+    for (size_t i = 1; !id && i < queues_.size(); ++i) {
+        auto& victim = *queues_[(index + i) % queues_.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            id = victim.tasks.front();
+            victim.tasks.pop_front();
+        }
+    }
+    if (!id)
+        return false;
+
+    runTask(*id);
+    std::vector<TaskID> ready;
+    for (const auto s : tasks_[*id].successors) {
+        if (pending_[s].fetch_sub(1) == 1)
+            ready.push_back(s);
+    }
+    if (!ready.empty()) {
+        auto& own = *queues_[index];
+        std::lock_guard lock(own.mutex);
+        own.tasks.insert(own.tasks.end(), ready.cbegin(), ready.cend());
+    }
+    remaining_.fetch_sub(1);
+    return true;
+}
+
+void JobSystem::runTask(TaskID id) {
+    const auto begin = std::chrono::steady_clock::now();
+    tasks_[id].func();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    taskSeconds_[id] = elapsed.count();
+}
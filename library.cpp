@@ -0,0 +1,384 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/VMDCameraAnimation.h"
+#include "Saba/Model/MMD/VMDFile.h"
+#include "yommd.hpp"
+
+namespace {
+// Whether any channel is keyed by more than one of the files.  Each list has
+// the names of all the files, and names of a file are unique.
+bool hasSharedNames(const std::vector<std::vector<std::string>>& lists) {
+    for (const auto& names : lists) {
+        if (std::set<std::string>(names.cbegin(), names.cend()).size() != names.size())
+            return true;
+    }
+    return false;
+}
+}
+
+MotionLibrary::MotionLibrary() :
+    memoryLimit_(0), current_(NoMotion), next_(NoMotion), useCount_(0), quit_(false)
+{}
+
+MotionLibrary::~MotionLibrary() {
+    {
+        std::lock_guard lock(mutex_);
+        quit_ = true;
+    }
+    cv_.notify_all();
+    if (worker_.joinable())
+        worker_.join();
+}
+
+void MotionLibrary::Init(const std::shared_ptr<saba::MMDModel>& model) {
+    model_ = model;
+}
+
+void MotionLibrary::SetMemoryLimit(size_t bytes) {
+    std::lock_guard lock(mutex_);
+    memoryLimit_ = bytes;
+}
+
+void MotionLibrary::AddMotion(const std::vector<Path>& paths) {
+    Entry entry = {
+        .paths = paths,
+        .duration = 0,
+        .boneNames = {},
+        .morphNames = {},
+        .mergeFiles = false,
+        .state = State::Unloaded,
+        .motion = nullptr,
+        .bytes = 0,
+        .lastUsed = 0,
+    };
+    std::vector<std::string> ikNames;
+    for (const auto& p : paths) {
+        const auto summary = VmdSummary::Scan(p);
+        if (!summary)
+            Err::Exit("Failed to read VMD file:", p);
+        entry.duration = std::max(entry.duration, summary->maxFrame);
+        entry.boneNames.insert(entry.boneNames.end(),
+                summary->boneNames.cbegin(), summary->boneNames.cend());
+        entry.morphNames.insert(entry.morphNames.end(),
+                summary->morphNames.cbegin(), summary->morphNames.cend());
+        ikNames.insert(ikNames.end(), summary->ikNames.cbegin(), summary->ikNames.cend());
+    }
+    entry.mergeFiles = paths.size() > 1 &&
+        hasSharedNames({entry.boneNames, entry.morphNames, ikNames});
+    std::lock_guard lock(mutex_);
+    entries_.push_back(std::move(entry));
+}
+
+size_t MotionLibrary::GetMotionCount() const {
+    return entries_.size();
+}
+
+int32_t MotionLibrary::GetDuration(size_t index) const {
+    return entries_[index].duration;
+}
+
+const std::vector<std::string>& MotionLibrary::GetBoneNames(size_t index) const {
+    return entries_[index].boneNames;
+}
+
+const std::vector<std::string>& MotionLibrary::GetMorphNames(size_t index) const {
+    return entries_[index].morphNames;
+}
+
+const std::vector<MotionLibrary::Path>& MotionLibrary::GetPaths(size_t index) const {
+    return entries_[index].paths;
+}
+
+std::optional<uint64_t> MotionLibrary::GetHash(const Path& path) const {
+    std::lock_guard lock(mutex_);
+    if (const auto itr = hashes_.find(path); itr != hashes_.cend())
+        return itr->second;
+    return std::nullopt;
+}
+
+const MotionLibrary::Motion *MotionLibrary::Load(size_t index) {
+    std::unique_lock lock(mutex_);
+    current_ = index;
+    auto& entry = entries_[index];
+    if (entry.state == State::Unloaded) {
+        entry.state = State::Loading;
+        lock.unlock();
+        size_t bytes = 0;
+        auto motion = loadMotion(entry.paths, entry.mergeFiles, bytes);
+        lock.lock();
+        entry.motion = std::move(motion);
+        entry.bytes = bytes;
+        entry.state = State::Loaded;
+        cv_.notify_all();
+    }
+    cv_.wait(lock, [&entry]() { return entry.state == State::Loaded; });
+    entry.lastUsed = ++useCount_;
+    return entry.motion.get();
+}
+
+const MotionLibrary::Motion *MotionLibrary::Get(size_t index) {
+    std::lock_guard lock(mutex_);
+    auto& entry = entries_[index];
+    if (entry.state != State::Loaded)
+        return nullptr;
+    entry.lastUsed = ++useCount_;
+    return entry.motion.get();
+}
+
+void MotionLibrary::SetPlaying(size_t current, size_t next) {
+    {
+        std::lock_guard lock(mutex_);
+        current_ = current;
+        next_ = next;
+        if (entries_[current].state == State::Loaded)
+            entries_[current].lastUsed = ++useCount_;
+        if (auto& entry = entries_[next]; entry.state == State::Unloaded) {
+            entry.state = State::Loading;
+            queue_.push_back(next);
+            if (!worker_.joinable())
+                worker_ = std::thread(&MotionLibrary::workerMain, this);
+        }
+        evict();
+    }
+    cv_.notify_all();
+}
+
+size_t MotionLibrary::GetResidentBytes() const {
+    std::lock_guard lock(mutex_);
+    size_t total = 0;
+    for (const auto& entry : entries_) {
+        if (entry.state == State::Loaded)
+            total += entry.bytes;
+    }
+    return total;
+}
+
+void MotionLibrary::workerMain() {
+    std::unique_lock lock(mutex_);
+    for (;;) {
+        cv_.wait(lock, [this]() { return quit_ || !queue_.empty(); });
+        if (quit_)
+            return;
+        const size_t index = queue_.front();
+        queue_.pop_front();
+
+        const auto paths = entries_[index].paths;
+        const bool mergeFiles = entries_[index].mergeFiles;
+        lock.unlock();
+        size_t bytes = 0;
+        auto motion = loadMotion(paths, mergeFiles, bytes);
+        lock.lock();
+
+        auto& entry = entries_[index];
+        entry.motion = std::move(motion);
+        entry.bytes = bytes;
+        entry.state = State::Loaded;
+        entry.lastUsed = ++useCount_;
+        evict();
+        cv_.notify_all();
+    }
+}
+
+std::unique_ptr<MotionLibrary::Motion> MotionLibrary::loadMotion(
+        const std::vector<Path>& paths, bool mergeFiles, size_t& bytes) {
+    auto motion = std::make_unique<Motion>();
+    std::vector<std::shared_ptr<const MotionClip>> clips;
+    bytes = 0;
+    const auto add = [&](const CachedVmd& vmd) {
+        clips.push_back(vmd.clip);
+        if (vmd.camera)
+            motion->camera = vmd.camera;
+        bytes += vmd.bytes;
+    };
+    // Keys of a channel in several files interleave by time, as Saba's
+    // VMDAnimation::Add() did, so such files are played as one clip.
+    // Files keying separate channels keep sharing their clips.
+    if (mergeFiles) {
+        add(loadMergedVmd(paths));
+    } else {
+        for (const auto& p : paths)
+            add(loadVmd(p));
+    }
+
+    motion->evaluator = std::make_unique<MotionEvaluator>();
+    if (!motion->evaluator->Create(clips)) {
+        Err::Exit("Failed to create MotionEvaluator");
+    }
+    return motion;
+}
+
+uint64_t MotionLibrary::hashVmd(const Path& path, const MappedFile& file) {
+    {
+        std::lock_guard lock(mutex_);
+        if (const auto itr = hashes_.find(path); itr != hashes_.cend())
+            return itr->second;
+    }
+    const uint64_t hash = Yommd::hashBytes(file.Data(), file.Size());
+    std::lock_guard lock(mutex_);
+    hashes_.emplace(path, hash);
+    return hash;
+}
+
+MotionLibrary::CachedVmd MotionLibrary::loadVmd(const Path& path) {
+    // The same file is often used by several motions, so files are cached
+    // by content and parsed only once while any motion holds them.
+    MappedFile file;
+    if (!file.Open(path))
+        Err::Exit("Failed to read VMD file:", path);
+    const uint64_t hash = hashVmd(path, file);
+    {
+        std::lock_guard lock(mutex_);
+        if (const auto itr = cache_.find(hash); itr != cache_.cend()) {
+            CachedVmd cached = {
+                .clip = itr->second.clip.lock(),
+                .camera = itr->second.camera.lock(),
+                .bytes = itr->second.bytes,
+            };
+            if (cached.clip)
+                return cached;
+        }
+    }
+
+    saba::VMDFile vmdFile;
+    if (!VmdReader::Read(vmdFile, file)) {
+        Err::Exit("Failed to read VMD file:", path);
+    }
+    file.Close();
+
+    auto clip = std::make_shared<MotionClip>();
+    if (!clip->Create(model_, vmdFile)) {
+        Err::Exit("Failed to create MotionClip:", path);
+    }
+    const auto usage = clip->GetMemoryUsage();
+    Info::Log("Motion keyframes:", path, usage.raw, "bytes ->", usage.compressed, "bytes");
+
+    CachedVmd cached = {
+        .clip = std::move(clip),
+        .camera = nullptr,
+        .bytes = usage.compressed,
+    };
+    if (!vmdFile.m_cameras.empty()) {
+        auto cameraAnim = std::make_shared<saba::VMDCameraAnimation>();
+        if (cameraAnim->Create(vmdFile))
+            cached.camera = std::move(cameraAnim);
+        else
+            Err::Log("Failed to create VMDCameraAnimation:", path);
+    }
+
+    std::lock_guard lock(mutex_);
+    cache_[hash] = WeakCachedVmd{
+        .clip = cached.clip,
+        .camera = cached.camera,
+        .bytes = cached.bytes,
+    };
+    return cached;
+}
+
+MotionLibrary::CachedVmd MotionLibrary::loadMergedVmd(const std::vector<Path>& paths) {
+    // Each file is mapped once, for both the hash and the keys.
+    std::deque<MappedFile> files;
+    std::vector<uint64_t> hashes;
+    for (const auto& path : paths) {
+        auto& file = files.emplace_back();
+        if (!file.Open(path))
+            Err::Exit("Failed to read VMD file:", path);
+        hashes.push_back(hashVmd(path, file));
+    }
+    {
+        std::lock_guard lock(mutex_);
+        if (const auto itr = mergedCache_.find(hashes); itr != mergedCache_.cend()) {
+            CachedVmd cached = {
+                .clip = itr->second.clip.lock(),
+                .camera = itr->second.camera.lock(),
+                .bytes = itr->second.bytes,
+            };
+            if (cached.clip)
+                return cached;
+        }
+    }
+
+    // The camera is the one of the last file with camera keys, as it was
+    // with per-file clips.
+    saba::VMDFile merged;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        saba::VMDFile vmdFile;
+        if (!VmdReader::Read(vmdFile, files[i])) {
+            Err::Exit("Failed to read VMD file:", paths[i]);
+        }
+        files[i].Close();
+        merged.m_motions.insert(merged.m_motions.end(),
+                vmdFile.m_motions.cbegin(), vmdFile.m_motions.cend());
+        merged.m_morphs.insert(merged.m_morphs.end(),
+                vmdFile.m_morphs.cbegin(), vmdFile.m_morphs.cend());
+        merged.m_iks.insert(merged.m_iks.end(), vmdFile.m_iks.cbegin(), vmdFile.m_iks.cend());
+        if (!vmdFile.m_cameras.empty())
+            merged.m_cameras = std::move(vmdFile.m_cameras);
+    }
+
+    auto clip = std::make_shared<MotionClip>();
+    if (!clip->Create(model_, merged)) {
+        Err::Exit("Failed to create MotionClip:", paths.front());
+    }
+    const auto usage = clip->GetMemoryUsage();
+    Info::Log("Motion keyframes, merged from", paths.size(), "files:",
+            usage.raw, "bytes ->", usage.compressed, "bytes");
+
+    CachedVmd cached = {
+        .clip = std::move(clip),
+        .camera = nullptr,
+        .bytes = usage.compressed,
+    };
+    if (!merged.m_cameras.empty()) {
+        auto cameraAnim = std::make_shared<saba::VMDCameraAnimation>();
+        if (cameraAnim->Create(merged))
+            cached.camera = std::move(cameraAnim);
+        else
+            Err::Log("Failed to create VMDCameraAnimation:", paths.front());
+    }
+
+    std::lock_guard lock(mutex_);
+    mergedCache_[hashes] = WeakCachedVmd{
+        .clip = cached.clip,
+        .camera = cached.camera,
+        .bytes = cached.bytes,
+    };
+    return cached;
+}
+
+void MotionLibrary::evict() {
+    // Called with the lock held.  Drops the least recently played motions
+    // until the memory limit is met, except the playing and the next one.
+    if (memoryLimit_ == 0)
+        return;
+
+    size_t total = 0;
+    for (const auto& entry : entries_) {
+        if (entry.state == State::Loaded)
+            total += entry.bytes;
+    }
+    while (total > memoryLimit_) {
+        Entry *victim = nullptr;
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            auto& entry = entries_[i];
+            if (entry.state != State::Loaded || i == current_ || i == next_)
+                continue;
+            if (!victim || entry.lastUsed < victim->lastUsed)
+                victim = &entry;
+        }
+        if (!victim)
+            break;
+        total -= victim->bytes;
+        victim->motion.reset();
+        victim->bytes = 0;
+        victim->state = State::Unloaded;
+    }
+}
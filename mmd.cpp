@@ -0,0 +1,376 @@
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDPhysics.h"
+#include "Saba/Model/MMD/PMDModel.h"
+#include "Saba/Model/MMD/PMXFile.h"
+#include "Saba/Model/MMD/PMXModel.h"
+#include "btBulletDynamicsCommon.h"
+#include "yommd.hpp"
+
+Material::Material(const saba::MMDMaterial& mat) :
+    material(mat),
+    textureHasAlpha(false),
+    texturesLoaded(false)
+{}
+
+void MMD::LoadModel(
+        const std::filesystem::path& modelPath,
+        const std::filesystem::path& resourcePath,
+        const std::filesystem::path& cacheDir) {
+    // Identifies the model for caches.  Hashed once here for all of them.
+    modelHash_ = Yommd::hashFile(modelPath);
+    const auto ext = std::filesystem::path(modelPath).extension();
+    if (ext == ".pmx") {
+        auto pmx = std::make_unique<saba::PMXModel>();
+        if (!pmx->Load(modelPath.string(), resourcePath.string())) {
+            Err::Exit("Failed to load PMX:", modelPath);
+        }
+        model_ = std::move(pmx);
+
+        // Morphs, bone updates and skinning are done by yoMMD for PMX
+        // models.  Saba doesn't expose its model data, so read the file again,
+        // or the cache of it.  The cache saves only this second parse;
+        // Saba's own parse in Load() above still runs on every launch.
+        saba::PMXFile pmxFile;
+        if (!ModelCache::ReadPMXFile(pmxFile, modelPath, modelHash_, cacheDir)) {
+            Err::Log("Failed to read PMX file:", modelPath);
+        } else if (skeleton_.Create(pmxFile, model_)) {
+            if (ik_.Create(pmxFile, model_, skeleton_))
+                skeleton_.SetIkStage(&ik_);
+            if (morph_.Create(pmxFile, model_))
+                skinning_.Create(pmxFile, model_, skeleton_);
+            physics_.Create(pmxFile, model_);
+            springBones_.Create(pmxFile, model_);
+        }
+    } else if (ext == ".pmd") {
+        auto pmd = std::make_unique<saba::PMDModel>();
+        if (!pmd->Load(modelPath.string(), resourcePath.string())) {
+            Err::Exit("Failed to load PMD:", modelPath);
+        }
+        model_ = std::move(pmd);
+    } else {
+        Err::Exit("Unsupported MMD file:", modelPath);
+    }
+
+    model_->InitializeAnimation();
+    motions_.Init(model_);
+}
+
+void MMD::AddMotion(const std::vector<std::filesystem::path>& paths) {
+    motions_.AddMotion(paths);
+}
+
+bool MMD::IsModelLoaded() const {
+    return static_cast<bool>(model_);
+}
+
+const std::shared_ptr<saba::MMDModel> MMD::GetModel() const {
+    return model_;
+}
+
+std::optional<uint64_t> MMD::GetModelHash() const {
+    return modelHash_;
+}
+
+MotionLibrary& MMD::GetMotions() {
+    return motions_;
+}
+
+const saba::MMDMaterial& MMD::GetMaterial(size_t index) const {
+    if (skinning_.IsEnabled())
+        return morph_.GetMaterial(index);
+    return model_->GetMaterials()[index];
+}
+
+void MMD::BeginAnimation() {
+    if (!skinning_.IsEnabled()) {
+        model_->BeginAnimation();
+        return;
+    }
+
+    // saba::PMXModel::BeginAnimation() also clears its morph buffers, which
+    // aren't used here.  Only reset nodes.
+    auto nodeManager = model_->GetNodeManager();
+    const size_t nodeCount = nodeManager->GetNodeCount();
+    for (size_t i = 0; i < nodeCount; ++i)
+        nodeManager->GetMMDNode(i)->BeginUpdateTransform();
+}
+
+void MMD::UpdateMorphAnimation() {
+    if (skinning_.IsEnabled())
+        morph_.UpdateWeights();
+    else
+        model_->UpdateMorphAnimation();
+}
+
+void MMD::UpdateMorphOffsets() {
+    if (skinning_.IsEnabled()) {
+        morph_.UpdateOffsets();
+        skinning_.UpdateVisibility(morph_);
+    }
+}
+
+void MMD::UpdateNodeAnimation(bool afterPhysicsAnim) {
+    if (skeleton_.IsEnabled())
+        skeleton_.UpdateNodeAnimation(afterPhysicsAnim);
+    else
+        model_->UpdateNodeAnimation(afterPhysicsAnim);
+}
+
+void MMD::UpdatePhysicsAnimation(double elapsed) {
+    if (useSpringBones_)
+        springBones_.Update(elapsed);
+    else if (physics_.IsEnabled() && skeleton_.IsEnabled())
+        physics_.Update(elapsed);
+    else
+        model_->UpdatePhysicsAnimation(static_cast<float>(elapsed));
+}
+
+void MMD::EndAnimation() {
+    model_->EndAnimation();
+}
+
+void MMD::UpdateVertices() {
+    if (skinning_.IsEnabled())
+        skinning_.Update(skeleton_, morph_.GetPositionOffsets(), morph_.GetUVOffsets());
+    else
+        model_->Update();
+}
+
+bool MMD::CanUpdateVerticesInParallel() const {
+    return skinning_.IsEnabled();
+}
+
+void MMD::UpdateVertices(size_t begin, size_t end) {
+    skinning_.Update(skeleton_, morph_.GetPositionOffsets(), morph_.GetUVOffsets(), begin, end);
+}
+
+void MMD::SetIkIterationBudget(uint32_t budget) {
+    ik_.SetIterationBudget(budget);
+}
+
+void MMD::SetupPhysics(const Config& config, bool reproducible) {
+    auto physics = model_->GetMMDPhysics();
+    physics->GetDynamicsWorld()->setGravity(btVector3(0, -config.gravity * 5.0f, 0));
+    physics->SetMaxSubStepCount(INT_MAX);
+    physics->SetFPS(config.simulationFPS);
+    physics_.SetFPS(config.simulationFPS);
+    // The governor picks tiers by the measured cost, and the multithreaded
+    // solver depends on thread timing.
+    if (reproducible && (config.physicsBudget > 0.0f || config.physicsThreads != 1))
+        Info::Log("Physics budget and threads are ignored for reproducibility.");
+    physics_.SetBudget(reproducible ? 0.0f : config.physicsBudget);
+    physics_.SetLowPriorityGroups(config.physicsLowPriorityGroups);
+    physics_.SetDisabledBodies(config.physicsDisabledGroups, config.physicsDisabledBodies);
+    physics_.SetLodSize(config.physicsLodSize);
+    springBones_.SetGravity(config.gravity);
+
+    if (config.physicsSolver == Config::PhysicsSolver::SpringBone) {
+        springBones_.SetDisabledBodies(config.physicsDisabledGroups, config.physicsDisabledBodies);
+        useSpringBones_ = springBones_.IsEnabled() && skeleton_.IsEnabled();
+        if (useSpringBones_)
+            Info::Log("Spring bones:", springBones_.GetParticleCount());
+        else
+            Err::Log("Spring bones are unavailable for this model.  Fallback to Bullet.");
+    }
+    // Saba's own physics update steps its world, so bodies can be moved
+    // only when yoMMD steps physics.
+    if (!reproducible && !useSpringBones_ && physics_.IsEnabled() && skeleton_.IsEnabled())
+        physics_.SetThreads(config.physicsThreads);
+}
+
+void MMD::SetPhysicsView(const glm::mat4& viewProjection, const glm::vec2& viewportSize) {
+    physics_.SetView(viewProjection, viewportSize);
+}
+
+void MMD::WakePhysics() {
+    physics_.Wake();
+}
+
+void MMD::StartPhysicsThread() {
+    if (!useSpringBones_ && physics_.IsEnabled() && skeleton_.IsEnabled())
+        physics_.StartThread();
+}
+
+void MMD::StopPhysicsThread() {
+    physics_.StopThread();
+}
+
+void MMD::PrerollPhysics(MotionEvaluator& evaluator, unsigned int steps, double step) {
+    evaluator.Evaluate(0.0f);
+    for (unsigned int i = 0; i < steps; ++i) {
+        BeginAnimation();
+        UpdateNodeAnimation(false);
+        if (useSpringBones_)
+            springBones_.Update(step);
+        else if (physics_.IsEnabled() && skeleton_.IsEnabled())
+            physics_.Step(step);
+        else
+            model_->UpdatePhysicsAnimation(static_cast<float>(step));
+        UpdateNodeAnimation(true);
+        EndAnimation();
+    }
+}
+
+bool MMD::SavePhysicsSnapshot(const Path& file, uint64_t key) const {
+    if (useSpringBones_ || !physics_.IsEnabled() || !skeleton_.IsEnabled())
+        return false;
+    return physics_.SaveSnapshot(file, key);
+}
+
+bool MMD::LoadPhysicsSnapshot(MotionEvaluator& evaluator, const Path& file, uint64_t key) {
+    if (useSpringBones_ || !physics_.IsEnabled() || !skeleton_.IsEnabled())
+        return false;
+    evaluator.Evaluate(0.0f);
+    BeginAnimation();
+    UpdateNodeAnimation(false);
+    const bool loaded = physics_.LoadSnapshot(file, key);
+    UpdateNodeAnimation(true);
+    EndAnimation();
+    return loaded;
+}
+
+void MMD::BenchmarkPhysics(MotionEvaluator& evaluator, unsigned int preroll, unsigned int steps,
+        double step, unsigned int threads) {
+    if (!physics_.IsEnabled() || !skeleton_.IsEnabled()) {
+        Err::Log("Physics benchmark is unavailable for this model.");
+        return;
+    }
+    // Without a configured thread count, benchmark as many as auto would use
+    // for a large model.
+    if (threads <= 1)
+        threads = std::clamp(std::thread::hardware_concurrency(), 2u, 4u);
+    physics_.SetThreads(threads);
+    Info::Log("Physics benchmark:", model_->GetPhysicsManager()->GetRigidBodys()->size(),
+            "rigid bodies,", steps, "steps");
+
+    const auto settle = [&](const std::function<void()>& stepFunc) {
+        evaluator.Reset();
+        evaluator.Evaluate(0.0f);
+        for (unsigned int i = 0; i < preroll; ++i) {
+            BeginAnimation();
+            UpdateNodeAnimation(false);
+            stepFunc();
+            UpdateNodeAnimation(true);
+            EndAnimation();
+        }
+    };
+    const auto run = [&](const char *label, const std::function<void()>& stepFunc) {
+        evaluator.Reset();
+        double total = 0.0;
+        double worst = 0.0;
+        for (unsigned int i = 0; i < steps; ++i) {
+            evaluator.Evaluate(static_cast<float>(i * step * Constant::VmdFPS));
+            BeginAnimation();
+            UpdateNodeAnimation(false);
+            const auto begin = std::chrono::steady_clock::now();
+            stepFunc();
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+            UpdateNodeAnimation(true);
+            EndAnimation();
+            total += elapsed.count();
+            worst = std::max(worst, elapsed.count());
+        }
+        Info::Log(label, total * 1000.0 / steps, "ms/step on average,",
+                worst * 1000.0, "ms at worst");
+    };
+
+    // Bullet settles once, and each world restarts from there.
+    const auto bulletStep = [this, step]() { physics_.Step(step); };
+    settle(bulletStep);
+    const auto settled = physics_.GetSnapshot(0);
+    for (const bool multithreaded : {false, true}) {
+        if (!physics_.UseMultithreadedWorld(multithreaded)) {
+            Err::Log("Multithreaded physics is unavailable.");
+            continue;
+        }
+        evaluator.Reset();
+        evaluator.Evaluate(0.0f);
+        BeginAnimation();
+        UpdateNodeAnimation(false);
+        physics_.RestoreSnapshot(settled, 0);
+        UpdateNodeAnimation(true);
+        EndAnimation();
+        run(multithreaded ? "Multithreaded:" : "Single-threaded:", bulletStep);
+    }
+    if (springBones_.IsEnabled()) {
+        const auto springStep = [this, step]() { springBones_.Update(step); };
+        springBones_.Reset();
+        settle(springStep);
+        run("Spring bones:", springStep);
+    }
+}
+
+void MMD::PruneUnused() {
+    // Bones and morphs that no motion touches.
+    auto nodeManager = model_->GetNodeManager();
+    auto morphManager = model_->GetMorphManager();
+    std::vector<bool> animatedBones(nodeManager->GetNodeCount(), false);
+    std::vector<bool> animatedMorphs(morphManager->GetMorphCount(), false);
+    // Motions aren't loaded yet, so refer names in the index.
+    for (size_t i = 0; i < motions_.GetMotionCount(); ++i) {
+        for (const auto& name : motions_.GetBoneNames(i)) {
+            const auto index = nodeManager->FindNodeIndex(name);
+            if (index != saba::MMDNodeManager::NPos)
+                animatedBones[index] = true;
+        }
+        for (const auto& name : motions_.GetMorphNames(i)) {
+            const auto index = morphManager->FindMorphIndex(name);
+            if (index != saba::MMDMorphManager::NPos)
+                animatedMorphs[index] = true;
+        }
+    }
+
+    if (skeleton_.IsEnabled()) {
+        const auto pruned = skeleton_.Prune(animatedBones);
+        Info::Log("Pruned bones:", pruned, '/', skeleton_.GetBoneCount());
+    }
+    if (morph_.IsEnabled()) {
+        const auto pruned = morph_.Prune(animatedMorphs);
+        Info::Log("Pruned morphs:", pruned, '/', animatedMorphs.size());
+    }
+}
+
+const PhysicsController *MMD::GetPhysics() const {
+    if (useSpringBones_ || !physics_.IsEnabled() || !skeleton_.IsEnabled())
+        return nullptr;
+    return &physics_;
+}
+
+void MMD::LogStats() const {
+    ik_.LogStats();
+    physics_.LogStats();
+    Info::Log("Resident motion keyframes:", motions_.GetResidentBytes(), "bytes");
+}
+
+const glm::vec3 *MMD::GetUpdatePositions() const {
+    if (skinning_.IsEnabled())
+        return skinning_.GetPositions();
+    return model_->GetUpdatePositions();
+}
+
+const glm::vec3 *MMD::GetUpdateNormals() const {
+    if (skinning_.IsEnabled())
+        return skinning_.GetNormals();
+    return model_->GetUpdateNormals();
+}
+
+const glm::vec2 *MMD::GetUpdateUVs() const {
+    if (skinning_.IsEnabled())
+        return skinning_.GetUVs();
+    return model_->GetUpdateUVs();
+}
+
+size_t MMD::GetUpdateVertexCount() const {
+    if (skinning_.IsEnabled())
+        return skinning_.GetActiveVertexCount();
+    return model_->GetVertexCount();
+}
@@ -0,0 +1,279 @@
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "Saba/Model/MMD/PMXFile.h"
+#include "yommd.hpp"
+
+namespace {
+// Layout of cache files.  Bump the version when the layout changes or
+// yoMMD reads more fields of PMX files.
+constexpr char Magic[8] = {'y', 'o', 'M', 'M', 'D', 'P', 'm', 'x'};
+constexpr uint32_t Version = 1;
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t hash;  // Of the PMX file.
+    uint64_t size;
+};
+
+class Writer {
+public:
+    template <typename T> void Put(const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        append(&value, sizeof(T));
+    }
+    void Put(const std::string& str) {
+        Put<uint64_t>(str.size());
+        append(str.data(), str.size());
+    }
+    template <typename T> void PutArray(const std::vector<T>& array) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        Put<uint64_t>(array.size());
+        append(array.data(), array.size() * sizeof(T));
+    }
+    const std::vector<char>& GetData() const {
+        return data_;
+    }
+private:
+    void append(const void *data, size_t size) {
+        const auto p = static_cast<const char *>(data);
+        data_.insert(data_.end(), p, p + size);
+    }
+    std::vector<char> data_;
+};
+
+// Reads from the mapped file.  Every read fails once the data runs short.
+class Reader {
+public:
+    Reader(const uint8_t *data, size_t size) :
+        p_(data), end_(data + size)
+    {}
+    template <typename T> bool Get(T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        return take(&value, sizeof(T));
+    }
+    bool Get(std::string& str) {
+        uint64_t size;
+        if (!Get(size) || size > remaining())
+            return false;
+        str.assign(reinterpret_cast<const char *>(p_), size);
+        p_ += size;
+        return true;
+    }
+    template <typename T> bool GetArray(std::vector<T>& array) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        uint64_t count;
+        if (!Get(count) || count > remaining() / sizeof(T))
+            return false;
+        array.resize(count);
+        return take(array.data(), count * sizeof(T));
+    }
+    // Resizes "array" for the count read.
+    template <typename T> bool GetCount(std::vector<T>& array) {
+        uint64_t count;
+        if (!Get(count) || count > remaining())
+            return false;
+        array.resize(count);
+        return true;
+    }
+    bool AtEnd() const {
+        return p_ == end_;
+    }
+private:
+    size_t remaining() const {
+        return static_cast<size_t>(end_ - p_);
+    }
+    bool take(void *dst, size_t size) {
+        if (size > remaining())
+            return false;
+        std::memcpy(dst, p_, size);
+        p_ += size;
+        return true;
+    }
+    const uint8_t *p_;
+    const uint8_t *end_;
+};
+
+// Only the fields yoMMD reads.  Keep in sync with read().
+void write(Writer& w, const saba::PMXFile& pmx) {
+    w.PutArray(pmx.m_vertices);
+    w.PutArray(pmx.m_faces);
+
+    w.Put<uint64_t>(pmx.m_materials.size());
+    for (const auto& material : pmx.m_materials)
+        w.Put(material.m_numFaceVertices);
+
+    w.Put<uint64_t>(pmx.m_bones.size());
+    for (const auto& bone : pmx.m_bones) {
+        w.Put(bone.m_name);
+        w.Put(bone.m_position);
+        w.Put(bone.m_parentBoneIndex);
+        w.Put(bone.m_deformDepth);
+        w.Put(bone.m_boneFlag);
+        w.Put(bone.m_appendBoneIndex);
+        w.Put(bone.m_appendWeight);
+        w.Put(bone.m_ikTargetBoneIndex);
+        w.Put(bone.m_ikIterationCount);
+        w.Put(bone.m_ikLimit);
+        w.PutArray(bone.m_ikLinks);
+    }
+
+    w.Put<uint64_t>(pmx.m_morphs.size());
+    for (const auto& morph : pmx.m_morphs) {
+        w.Put(morph.m_name);
+        w.Put(morph.m_morphType);
+        w.PutArray(morph.m_positionMorph);
+        w.PutArray(morph.m_uvMorph);
+        w.PutArray(morph.m_boneMorph);
+        w.PutArray(morph.m_materialMorph);
+        w.PutArray(morph.m_groupMorph);
+    }
+
+    w.Put<uint64_t>(pmx.m_rigidbodies.size());
+    for (const auto& rb : pmx.m_rigidbodies) {
+        w.Put(rb.m_name);
+        w.Put(rb.m_boneIndex);
+        w.Put(rb.m_group);
+        w.Put(rb.m_collisionGroup);
+        w.Put(rb.m_shape);
+        w.Put(rb.m_shapeSize);
+        w.Put(rb.m_op);
+        w.Put(rb.m_translateDimmer);
+    }
+
+    w.Put<uint64_t>(pmx.m_joints.size());
+    for (const auto& joint : pmx.m_joints) {
+        w.Put(joint.m_rigidbodyAIndex);
+        w.Put(joint.m_rigidbodyBIndex);
+    }
+}
+
+bool read(Reader& r, saba::PMXFile& pmx) {
+    if (!r.GetArray(pmx.m_vertices) || !r.GetArray(pmx.m_faces))
+        return false;
+
+    if (!r.GetCount(pmx.m_materials))
+        return false;
+    for (auto& material : pmx.m_materials) {
+        if (!r.Get(material.m_numFaceVertices))
+            return false;
+    }
+
+    if (!r.GetCount(pmx.m_bones))
+        return false;
+    for (auto& bone : pmx.m_bones) {
+        if (!(r.Get(bone.m_name) &&
+                    r.Get(bone.m_position) &&
+                    r.Get(bone.m_parentBoneIndex) &&
+                    r.Get(bone.m_deformDepth) &&
+                    r.Get(bone.m_boneFlag) &&
+                    r.Get(bone.m_appendBoneIndex) &&
+                    r.Get(bone.m_appendWeight) &&
+                    r.Get(bone.m_ikTargetBoneIndex) &&
+                    r.Get(bone.m_ikIterationCount) &&
+                    r.Get(bone.m_ikLimit) &&
+                    r.GetArray(bone.m_ikLinks)))
+            return false;
+    }
+
+    if (!r.GetCount(pmx.m_morphs))
+        return false;
+    for (auto& morph : pmx.m_morphs) {
+        if (!(r.Get(morph.m_name) &&
+                    r.Get(morph.m_morphType) &&
+                    r.GetArray(morph.m_positionMorph) &&
+                    r.GetArray(morph.m_uvMorph) &&
+                    r.GetArray(morph.m_boneMorph) &&
+                    r.GetArray(morph.m_materialMorph) &&
+                    r.GetArray(morph.m_groupMorph)))
+            return false;
+    }
+
+    if (!r.GetCount(pmx.m_rigidbodies))
+        return false;
+    for (auto& rb : pmx.m_rigidbodies) {
+        if (!(r.Get(rb.m_name) &&
+                    r.Get(rb.m_boneIndex) &&
+                    r.Get(rb.m_group) &&
+                    r.Get(rb.m_collisionGroup) &&
+                    r.Get(rb.m_shape) &&
+                    r.Get(rb.m_shapeSize) &&
+                    r.Get(rb.m_op) &&
+                    r.Get(rb.m_translateDimmer)))
+            return false;
+    }
+
+    if (!r.GetCount(pmx.m_joints))
+        return false;
+    for (auto& joint : pmx.m_joints) {
+        if (!(r.Get(joint.m_rigidbodyAIndex) && r.Get(joint.m_rigidbodyBIndex)))
+            return false;
+    }
+    return r.AtEnd();
+}
+
+bool load(const std::filesystem::path& cacheFile, uint64_t hash, uint64_t size,
+        saba::PMXFile& pmx) {
+    MappedFile mapped;
+    if (!mapped.Open(cacheFile))
+        return false;
+    Reader r(mapped.Data(), mapped.Size());
+    Header header;
+    if (!r.Get(header) || std::memcmp(header.magic, Magic, sizeof(Magic)) != 0 ||
+            header.version != Version || header.hash != hash || header.size != size)
+        return false;
+    if (!read(r, pmx)) {
+        pmx = saba::PMXFile();
+        return false;
+    }
+    return true;
+}
+
+void save(const std::filesystem::path& cacheFile, uint64_t hash, uint64_t size,
+        const saba::PMXFile& pmx) {
+    Writer w;
+    Header header = {
+        .magic = {},
+        .version = Version,
+        .reserved = 0,
+        .hash = hash,
+        .size = size,
+    };
+    std::memcpy(header.magic, Magic, sizeof(Magic));
+    w.Put(header);
+    write(w, pmx);
+    if (!Yommd::writeFile(cacheFile, w.GetData().data(), w.GetData().size()))
+        Err::Log("Failed to write model cache:", cacheFile);
+}
+}
+
+namespace ModelCache {
+bool ReadPMXFile(saba::PMXFile& pmx, const std::filesystem::path& file,
+        std::optional<uint64_t> hash, const std::filesystem::path& cacheDir) {
+    std::error_code ec;
+    const auto size = std::filesystem::file_size(file, ec);
+    if (cacheDir.empty() || ec)
+        hash = std::nullopt;
+
+    std::filesystem::path cacheFile;
+    if (hash) {
+        std::stringstream name;
+        name << std::hex << std::setw(16) << std::setfill('0') << *hash << ".bin";
+        cacheFile = cacheDir / name.str();
+        if (load(cacheFile, *hash, size, pmx))
+            return true;
+    }
+
+    if (!saba::ReadPMXFile(&pmx, file.string().c_str()))
+        return false;
+    if (hash)
+        save(cacheFile, *hash, size, pmx);
+    return true;
+}
+}
@@ -0,0 +1,376 @@
+#include <algorithm>
+#include <memory>
+#include <numeric>
+#include <vector>
+#include "Saba/Model/MMD/MMDMaterial.h"
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDMorph.h"
+#include "Saba/Model/MMD/MMDNode.h"
+#include "Saba/Model/MMD/PMXFile.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include "simd.hpp"
+#include "yommd.hpp"
+
+namespace {
+// Group morphs may refer other group morphs.  Deeper nesting than this is
+// regarded as a cycle.
+constexpr size_t MaxGroupDepth = 16;
+
+// dst[indices[i]] += deltas[i] * weight
+void accumulateSparse(glm::vec4 *dst, const uint32_t *indices,
+        const glm::vec4 *deltas, size_t count, float weight) {
+#if defined(SIMD_NEON)
+    const float32x4_t w = vdupq_n_f32(weight);
+    for (size_t i = 0; i < count; ++i) {
+        float *p = &dst[indices[i]].x;
+        vst1q_f32(p, vmlaq_f32(vld1q_f32(p), vld1q_f32(&deltas[i].x), w));
+    }
+#elif defined(SIMD_SSE2)
+    const __m128 w = _mm_set1_ps(weight);
+    for (size_t i = 0; i < count; ++i) {
+        float *p = &dst[indices[i]].x;
+        _mm_storeu_ps(p, _mm_add_ps(_mm_loadu_ps(p), _mm_mul_ps(_mm_loadu_ps(&deltas[i].x), w)));
+    }
+#else
+    for (size_t i = 0; i < count; ++i)
+        dst[indices[i]] += deltas[i] * weight;
+#endif
+}
+
+void clearSparse(glm::vec4 *dst, const uint32_t *indices, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        dst[indices[i]] = glm::vec4(0.0f);
+}
+}
+
+MorphEngine::MorphEngine() :
+    enabled_(false)
+{}
+
+bool MorphEngine::Create(const saba::PMXFile& pmx, const std::shared_ptr<saba::MMDModel>& model) {
+    using MorphType = saba::PMXMorphType;
+
+    auto morphManager = model->GetMorphManager();
+    auto nodeManager = model->GetNodeManager();
+    const size_t morphCount = pmx.m_morphs.size();
+    const size_t vertexCount = pmx.m_vertices.size();
+    const size_t nodeCount = nodeManager->GetNodeCount();
+    const size_t materialCount = model->GetMaterialCount();
+
+    if (morphManager->GetMorphCount() != morphCount ||
+            model->GetVertexCount() != vertexCount) {
+        Err::Log("Morph data mismatch.  Fallback to Saba's morph.");
+        return false;
+    }
+
+    morphs_.clear();
+    leaves_.assign(morphCount, Leaf());
+    for (size_t i = 0; i < morphCount; ++i) {
+        morphs_.push_back(morphManager->GetMorph(i));
+
+        const auto& morph = pmx.m_morphs[i];
+        auto& leaf = leaves_[i];
+        switch (morph.m_morphType) {
+        case MorphType::Position:
+            for (const auto& p : morph.m_positionMorph) {
+                if (p.m_vertexIndex < 0 || static_cast<size_t>(p.m_vertexIndex) >= vertexCount)
+                    continue;
+                leaf.positions.indices.push_back(p.m_vertexIndex);
+                leaf.positions.deltas.emplace_back(Yommd::toRightHanded(p.m_position), 0.0f);
+            }
+            break;
+        case MorphType::UV:
+            for (const auto& uv : morph.m_uvMorph) {
+                if (uv.m_vertexIndex < 0 || static_cast<size_t>(uv.m_vertexIndex) >= vertexCount)
+                    continue;
+                // V axis is flipped at load.  See Skinning::Create().
+                leaf.uvs.indices.push_back(uv.m_vertexIndex);
+                leaf.uvs.deltas.emplace_back(uv.m_uv.x, -uv.m_uv.y, uv.m_uv.z, uv.m_uv.w);
+            }
+            break;
+        case MorphType::Bone:
+            for (const auto& b : morph.m_boneMorph) {
+                if (b.m_boneIndex < 0 || static_cast<size_t>(b.m_boneIndex) >= nodeCount)
+                    continue;
+                leaf.bones.push_back(BoneOffset{
+                    .node = nodeManager->GetMMDNode(b.m_boneIndex),
+                    .translate = Yommd::toRightHanded(b.m_position),
+                    .rotate = Yommd::toRightHanded(b.m_quaternion),
+                });
+            }
+            break;
+        case MorphType::Material:
+            for (const auto& m : morph.m_materialMorph) {
+                if (m.m_materialIndex >= static_cast<int32_t>(materialCount))
+                    continue;
+                leaf.materials.push_back(MaterialOffset{
+                    .materialIndex = m.m_materialIndex,
+                    .multiply = m.m_opType == saba::PMXMorph::MaterialMorph::OpType::Mul,
+                    .diffuse = m.m_diffuse,
+                    .specular = m.m_specular,
+                    .specularPower = m.m_specularPower,
+                    .ambient = m.m_ambient,
+                    .textureFactor = m.m_textureFactor,
+                    .sphereTextureFactor = m.m_sphereTextureFactor,
+                    .toonTextureFactor = m.m_toonTextureFactor,
+                });
+            }
+            break;
+        default:
+            // Group morphs are flattened below.  Other morphs are not
+            // supported by Saba either.
+            break;
+        }
+    }
+
+    // Flatten group morphs so that the per-frame update never recurses.
+    expansions_.assign(morphCount, ActiveList());
+    std::vector<float> factors(morphCount);
+    for (size_t i = 0; i < morphCount; ++i) {
+        std::fill(factors.begin(), factors.end(), 0.0f);
+        flatten(pmx, i, 1.0f, 0, factors);
+        for (size_t j = 0; j < morphCount; ++j) {
+            if (factors[j] != 0.0f)
+                expansions_[i].emplace_back(static_cast<uint32_t>(j), factors[j]);
+        }
+    }
+
+    liveMorphs_.resize(morphCount);
+    std::iota(liveMorphs_.begin(), liveMorphs_.end(), 0);
+
+    leafWeights_.assign(morphCount, 0.0f);
+    positionOffsets_.assign(vertexCount, glm::vec4(0.0f));
+    uvOffsets_.assign(vertexCount, glm::vec4(0.0f));
+
+    initialMaterials_.assign(model->GetMaterials(), model->GetMaterials() + materialCount);
+    materials_ = initialMaterials_;
+
+    active_.clear();
+    lastVertexActive_.clear();
+    lastMaterialActive_.clear();
+
+    enabled_ = true;
+    return true;
+}
+
+size_t MorphEngine::Prune(const std::vector<bool>& animated) {
+    // Morphs are driven only by motions.  Also drop ones that change nothing.
+    const auto isEmpty = [this](uint32_t leaf) {
+        const auto& l = leaves_[leaf];
+        return l.positions.indices.empty() && l.uvs.indices.empty() &&
+            l.bones.empty() && l.materials.empty();
+    };
+    const size_t morphCount = morphs_.size();
+    liveMorphs_.clear();
+    for (size_t i = 0; i < morphCount; ++i) {
+        if (i >= animated.size() || !animated[i])
+            continue;
+        const auto& e = expansions_[i];
+        if (std::all_of(e.cbegin(), e.cend(), [&isEmpty](const auto& a) { return isEmpty(a.first); }))
+            continue;
+        liveMorphs_.push_back(static_cast<uint32_t>(i));
+    }
+    return morphCount - liveMorphs_.size();
+}
+
+void MorphEngine::Update() {
+    UpdateWeights();
+    UpdateOffsets();
+}
+
+void MorphEngine::UpdateWeights() {
+    // Gather effective weights of non-group morphs.
+    active_.clear();
+    for (const auto i : liveMorphs_) {
+        const float weight = morphs_[i]->GetWeight();
+        if (weight == 0.0f)
+            continue;
+        for (const auto& [leaf, factor] : expansions_[i]) {
+            active_.emplace_back(leaf, 0.0f);
+            leafWeights_[leaf] += weight * factor;
+        }
+    }
+    std::sort(active_.begin(), active_.end());
+    active_.erase(std::unique(active_.begin(), active_.end()), active_.end());
+    for (auto& [leaf, weight] : active_) {
+        weight = leafWeights_[leaf];
+        leafWeights_[leaf] = 0.0f;
+    }
+    std::erase_if(active_, [](const auto& a) { return a.second == 0.0f; });
+
+    // Bone morphs.  Nodes' TRS are reset every frame so these are always
+    // applied.
+    for (const auto& [leaf, weight] : active_) {
+        for (const auto& bone : leaves_[leaf].bones) {
+            auto node = bone.node;
+            node->SetTranslate(node->GetTranslate() + bone.translate * weight);
+            node->SetRotate(glm::slerp(node->GetRotate(), bone.rotate, weight));
+        }
+    }
+}
+
+void MorphEngine::UpdateOffsets() {
+    updateVertexOffsets();
+    updateMaterials();
+}
+
+bool MorphEngine::IsEnabled() const {
+    return enabled_;
+}
+
+const std::vector<glm::vec4>& MorphEngine::GetPositionOffsets() const {
+    return positionOffsets_;
+}
+
+const std::vector<glm::vec4>& MorphEngine::GetUVOffsets() const {
+    return uvOffsets_;
+}
+
+const saba::MMDMaterial& MorphEngine::GetMaterial(size_t index) const {
+    return materials_[index];
+}
+
+void MorphEngine::flatten(const saba::PMXFile& pmx, size_t morph, float factor,
+        size_t depth, std::vector<float>& out) const {
+    if (depth > MaxGroupDepth) {
+        Err::Log("Too deep or cyclic group morph:", pmx.m_morphs[morph].m_name);
+        return;
+    }
+
+    const auto& m = pmx.m_morphs[morph];
+    if (m.m_morphType != saba::PMXMorphType::Group) {
+        out[morph] += factor;
+        return;
+    }
+    for (const auto& child : m.m_groupMorph) {
+        if (child.m_morphIndex < 0 || static_cast<size_t>(child.m_morphIndex) >= out.size())
+            continue;
+        flatten(pmx, child.m_morphIndex, factor * child.m_weight, depth + 1, out);
+    }
+}
+
+void MorphEngine::updateVertexOffsets() {
+    const auto hasVertexStream = [this](const auto& a) {
+        const auto& leaf = leaves_[a.first];
+        return !leaf.positions.indices.empty() || !leaf.uvs.indices.empty();
+    };
+
+    // Skip the whole stage when the weights of vertex morphs are unchanged.
+    auto itr = lastVertexActive_.cbegin();
+    bool changed = false;
+    for (const auto& a : active_) {
+        if (!hasVertexStream(a))
+            continue;
+        if (itr == lastVertexActive_.cend() || *itr != a) {
+            changed = true;
+            break;
+        }
+        ++itr;
+    }
+    if (!changed && itr == lastVertexActive_.cend())
+        return;
+
+    // Clear only the vertices touched in the last update.
+    for (const auto& [leaf, weight] : lastVertexActive_) {
+        const auto& pos = leaves_[leaf].positions;
+        const auto& uv = leaves_[leaf].uvs;
+        clearSparse(positionOffsets_.data(), pos.indices.data(), pos.indices.size());
+        clearSparse(uvOffsets_.data(), uv.indices.data(), uv.indices.size());
+    }
+
+    lastVertexActive_.clear();
+    for (const auto& a : active_) {
+        if (!hasVertexStream(a))
+            continue;
+        const auto& [leaf, weight] = a;
+        const auto& pos = leaves_[leaf].positions;
+        const auto& uv = leaves_[leaf].uvs;
+        accumulateSparse(positionOffsets_.data(), pos.indices.data(),
+                pos.deltas.data(), pos.indices.size(), weight);
+        accumulateSparse(uvOffsets_.data(), uv.indices.data(),
+                uv.deltas.data(), uv.indices.size(), weight);
+        lastVertexActive_.push_back(a);
+    }
+}
+
+void MorphEngine::updateMaterials() {
+    ActiveList materialActive;
+    for (const auto& a : active_) {
+        if (!leaves_[a.first].materials.empty())
+            materialActive.push_back(a);
+    }
+    if (materialActive == lastMaterialActive_)
+        return;
+    lastMaterialActive_ = std::move(materialActive);
+
+    struct Factor {
+        glm::vec4 diffuse;
+        glm::vec3 specular;
+        float specularPower;
+        glm::vec3 ambient;
+        glm::vec4 textureFactor;
+        glm::vec4 sphereTextureFactor;
+        glm::vec4 toonTextureFactor;
+    };
+    const Factor identityMul = {
+        glm::vec4(1.0f), glm::vec3(1.0f), 1.0f, glm::vec3(1.0f),
+        glm::vec4(1.0f), glm::vec4(1.0f), glm::vec4(1.0f),
+    };
+    const Factor identityAdd = {
+        glm::vec4(0.0f), glm::vec3(0.0f), 0.0f, glm::vec3(0.0f),
+        glm::vec4(0.0f), glm::vec4(0.0f), glm::vec4(0.0f),
+    };
+    std::vector<Factor> mul(materials_.size(), identityMul);
+    std::vector<Factor> add(materials_.size(), identityAdd);
+
+    const auto apply = [&](size_t index, const MaterialOffset& m, float w) {
+        if (m.multiply) {
+            auto& f = mul[index];
+            f.diffuse = glm::mix(f.diffuse, f.diffuse * m.diffuse, w);
+            f.specular = glm::mix(f.specular, f.specular * m.specular, w);
+            f.specularPower = glm::mix(f.specularPower, f.specularPower * m.specularPower, w);
+            f.ambient = glm::mix(f.ambient, f.ambient * m.ambient, w);
+            f.textureFactor = glm::mix(f.textureFactor, f.textureFactor * m.textureFactor, w);
+            f.sphereTextureFactor = glm::mix(f.sphereTextureFactor, f.sphereTextureFactor * m.sphereTextureFactor, w);
+            f.toonTextureFactor = glm::mix(f.toonTextureFactor, f.toonTextureFactor * m.toonTextureFactor, w);
+        } else {
+            auto& f = add[index];
+            f.diffuse += m.diffuse * w;
+            f.specular += m.specular * w;
+            f.specularPower += m.specularPower * w;
+            f.ambient += m.ambient * w;
+            f.textureFactor += m.textureFactor * w;
+            f.sphereTextureFactor += m.sphereTextureFactor * w;
+            f.toonTextureFactor += m.toonTextureFactor * w;
+        }
+    };
+    for (const auto& [leaf, weight] : lastMaterialActive_) {
+        for (const auto& m : leaves_[leaf].materials) {
+            if (m.materialIndex < 0) {
+                for (size_t i = 0; i < materials_.size(); ++i)
+                    apply(i, m, weight);
+            } else {
+                apply(m.materialIndex, m, weight);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < materials_.size(); ++i) {
+        const auto& init = initialMaterials_[i];
+        const auto& m = mul[i];
+        const auto& a = add[i];
+        auto& mat = materials_[i];
+        mat.m_diffuse = init.m_diffuse * glm::vec3(m.diffuse) + glm::vec3(a.diffuse);
+        mat.m_alpha = init.m_alpha * m.diffuse.a + a.diffuse.a;
+        mat.m_specular = init.m_specular * m.specular + a.specular;
+        mat.m_specularPower = init.m_specularPower * m.specularPower + a.specularPower;
+        mat.m_ambient = init.m_ambient * m.ambient + a.ambient;
+        mat.m_textureMulFactor = init.m_textureMulFactor * m.textureFactor;
+        mat.m_textureAddFactor = init.m_textureAddFactor + a.textureFactor;
+        mat.m_spTextureMulFactor = init.m_spTextureMulFactor * m.sphereTextureFactor;
+        mat.m_spTextureAddFactor = init.m_spTextureAddFactor + a.sphereTextureFactor;
+        mat.m_toonTextureMulFactor = init.m_toonTextureMulFactor * m.toonTextureFactor;
+        mat.m_toonTextureAddFactor = init.m_toonTextureAddFactor + a.toonTextureFactor;
+    }
+}
@@ -0,0 +1,914 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "Saba/Model/MMD/MMDIkSolver.h"
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDMorph.h"
+#include "Saba/Model/MMD/MMDNode.h"
+#include "Saba/Model/MMD/VMDFile.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include "simd.hpp"
+#include "yommd.hpp"
+
+namespace {
+// Frame deltas which don't fit in 16 bits are stored as this value, and the
+// actual ones are looked up in "longDeltas" of the channels.  Gaps that long
+// are rare (over 18 minutes at 60 fps), so the lookup is a binary search.
+constexpr uint16_t LongDeltaMark = UINT16_MAX;
+
+using LongDeltas = std::vector<std::pair<uint32_t, int32_t>>;
+
+int32_t frameDelta(const uint16_t *deltas, const LongDeltas& longDeltas, uint32_t index) {
+    if (deltas[index] != LongDeltaMark)
+        return deltas[index];
+    const auto it = std::lower_bound(longDeltas.cbegin(), longDeltas.cend(), index,
+            [](const auto& entry, uint32_t i) { return entry.first < i; });
+    return it->second;
+}
+
+// Keys of a channel are stored as frame deltas from the previous key.  The
+// cursor points the first key whose time is greater than "frame" ("end" if
+// there's no such key) and remembers its time.  The search starts from the
+// previous result, so it's O(1) while frames go forward.
+uint32_t advanceCursor(const uint16_t *deltas, const LongDeltas& longDeltas,
+        uint32_t begin, uint32_t end, int32_t startTime, int32_t endTime,
+        MotionClip::KeyCursor& cursor, int32_t frame) {
+    if (cursor.index > begin) {
+        const int32_t prevTime = cursor.index == end ?
+            endTime : cursor.time - frameDelta(deltas, longDeltas, cursor.index);
+        if (prevTime > frame) {
+            // Time went backward (e.g. the motion is restarted).
+            cursor.index = begin;
+            cursor.time = startTime;
+        }
+    }
+    while (cursor.index < end && cursor.time <= frame) {
+        ++cursor.index;
+        if (cursor.index < end)
+            cursor.time += frameDelta(deltas, longDeltas, cursor.index);
+    }
+    return cursor.index;
+}
+
+// Finds the pair of keys to interpolate between and the progress.
+void findKeys(const uint16_t *deltas, const LongDeltas& longDeltas,
+        uint32_t begin, uint32_t end, int32_t startTime, int32_t endTime,
+        MotionClip::KeyCursor& cursor, float frame,
+        uint32_t& key0, uint32_t& key1, float& progress) {
+    const uint32_t bound = advanceCursor(deltas, longDeltas,
+            begin, end, startTime, endTime, cursor, static_cast<int32_t>(frame));
+    if (bound == end) {
+        key0 = key1 = end - 1;
+        progress = 0.0f;
+    } else if (bound == begin) {
+        key0 = key1 = begin;
+        progress = 0.0f;
+    } else {
+        const float t1 = static_cast<float>(cursor.time);
+        const float t0 = t1 - static_cast<float>(frameDelta(deltas, longDeltas, bound));
+        key0 = bound - 1;
+        key1 = bound;
+        progress = (frame - t0) / (t1 - t0);
+    }
+}
+
+// Appends frame deltas of keys whose times are sorted.  The key indices of
+// long gaps are appended in order, so "longDeltas" stays sorted.
+void appendFrameDeltas(const std::vector<int32_t>& times,
+        std::vector<uint16_t>& out, LongDeltas& longDeltas) {
+    int32_t prev = times.front();
+    for (const int32_t t : times) {
+        const int32_t delta = t - prev;
+        if (delta >= LongDeltaMark) {
+            longDeltas.emplace_back(static_cast<uint32_t>(out.size()), delta);
+            out.push_back(LongDeltaMark);
+        } else {
+            out.push_back(static_cast<uint16_t>(delta));
+        }
+        prev = t;
+    }
+}
+
+uint16_t quantize(float v, float min, float range) {
+    if (range <= 0.0f)
+        return 0;
+    return static_cast<uint16_t>(std::lround(std::clamp((v - min) / range, 0.0f, 1.0f) * UINT16_MAX));
+}
+
+float dequantize(uint16_t q, float min, float range) {
+    return min + range * (static_cast<float>(q) / UINT16_MAX);
+}
+
+// Keys rotating less than about 16 degrees apart are nlerped, which is off
+// by 0.02 degrees at most there.  Others are slerped.
+constexpr float NlerpMinCos = 0.99f;  // Of the half angle.
+
+// Smallest-three quaternion compression.  The largest component is dropped
+// and restored from the unit length, and the others are stored as 15 bits
+// each.  Layout: [1:0] index of the dropped component, [16:2], [31:17] and
+// [46:32] the other components in order.
+constexpr float QuatComponentMax = 0.70710678f;  // 1 / sqrt(2)
+constexpr uint32_t QuatComponentBits = 15;
+constexpr uint32_t QuatComponentMask = (1u << QuatComponentBits) - 1;
+
+MotionClip::PackedQuat packQuat(glm::quat q) {
+    q = glm::normalize(q);
+    int largest = 0;
+    for (int i = 1; i < 4; ++i) {
+        if (std::abs(q[i]) > std::abs(q[largest]))
+            largest = i;
+    }
+    if (q[largest] < 0.0f)
+        q = -q;
+
+    uint64_t bits = static_cast<uint64_t>(largest);
+    uint32_t shift = 2;
+    for (int i = 0; i < 4; ++i) {
+        if (i == largest)
+            continue;
+        const float n = std::clamp((q[i] / QuatComponentMax + 1.0f) * 0.5f, 0.0f, 1.0f);
+        bits |= static_cast<uint64_t>(std::lround(n * QuatComponentMask)) << shift;
+        shift += QuatComponentBits;
+    }
+    return {
+        static_cast<uint16_t>(bits),
+        static_cast<uint16_t>(bits >> 16),
+        static_cast<uint16_t>(bits >> 32),
+    };
+}
+
+glm::quat unpackQuat(const MotionClip::PackedQuat& p) {
+    const uint64_t bits = static_cast<uint64_t>(p[0]) |
+        (static_cast<uint64_t>(p[1]) << 16) | (static_cast<uint64_t>(p[2]) << 32);
+    const int largest = static_cast<int>(bits & 3);
+    glm::quat q;
+    float sum = 0.0f;
+    uint32_t shift = 2;
+    for (int i = 0; i < 4; ++i) {
+        if (i == largest)
+            continue;
+        const float n = static_cast<float>((bits >> shift) & QuatComponentMask) / QuatComponentMask;
+        q[i] = (n * 2.0f - 1.0f) * QuatComponentMax;
+        sum += q[i] * q[i];
+        shift += QuatComponentBits;
+    }
+    q[largest] = std::sqrt(std::max(0.0f, 1.0f - sum));
+    return q;
+}
+
+// Cubic bezier curve whose end points are (0, 0) and (1, 1).  The same as
+// what saba::VMDAnimation does.
+float bezierEval(float t, float p1, float p2) {
+    const float it = 1.0f - t;
+    return 3.0f * it * it * t * p1 + 3.0f * it * t * t * p2 + t * t * t;
+}
+
+// Solve x(t) == x by bisection.
+float bezierFindT(float x, float x1, float x2) {
+    constexpr float epsilon = 0.00001f;
+    float start = 0.0f;
+    float stop = 1.0f;
+    float t = 0.5f;
+    float bx = bezierEval(t, x1, x2);
+    for (int i = 0; i < 32 && std::abs(x - bx) > epsilon; ++i) {
+        if (x < bx)
+            stop = t;
+        else
+            start = t;
+        t = (start + stop) * 0.5f;
+        bx = bezierEval(t, x1, x2);
+    }
+    return t;
+}
+
+BezierTable::Param getBezierParam(const std::array<uint8_t, 64>& interp, int channel) {
+    return {interp[channel], interp[channel + 4], interp[channel + 8], interp[channel + 12]};
+}
+
+template <typename T>
+void sortByFrame(std::vector<const T *>& keys) {
+    std::stable_sort(keys.begin(), keys.end(),
+            [](const T *a, const T *b) { return a->m_frame < b->m_frame; });
+}
+
+// Names in VMD files aren't always terminated.
+template <size_t Size>
+void setVmdString(saba::MMDFileString<Size>& str, const uint8_t *p, size_t size) {
+    char buf[Size + 1] = {};
+    std::memcpy(buf, p, std::min(size, Size));
+    str.Set(buf);
+}
+
+std::string vmdName(const uint8_t *p, size_t size) {
+    const auto name = reinterpret_cast<const char *>(p);
+    return std::string(name, std::find(name, name + size, '\0'));
+}
+
+template <typename T>
+void copyField(T& field, const uint8_t *p) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    std::memcpy(&field, p, sizeof(T));
+}
+
+// Sizes of VMD records in the file.
+constexpr size_t VmdBoneKeySize = 15 + 4 + 12 + 16 + 64;
+constexpr size_t VmdMorphKeySize = 15 + 4 + 4;
+constexpr size_t VmdCameraKeySize = 4 + 4 + 12 + 12 + 24 + 4 + 1;
+constexpr size_t VmdLightKeySize = 4 + 12 + 12;
+constexpr size_t VmdShadowKeySize = 4 + 1 + 4;
+constexpr size_t VmdIkInfoSize = 20 + 1;
+
+// Walks the bytes of a mapped VMD file.
+class VmdCursor {
+public:
+    VmdCursor(const uint8_t *data, size_t size) :
+        p_(data), end_(data + size)
+    {}
+    bool Has(size_t size) const {
+        return size <= static_cast<size_t>(end_ - p_);
+    }
+    const uint8_t *Take(size_t size) {  // Requires Has(size).
+        const auto p = p_;
+        p_ += size;
+        return p;
+    }
+    uint32_t ReadU32() {  // Requires Has(4).
+        uint32_t v;
+        std::memcpy(&v, Take(sizeof(v)), sizeof(v));
+        return v;
+    }
+    // Count of records of "size" bytes following, or nullopt if the file
+    // is truncated.  Old files may lack trailing sections, which count 0.
+    std::optional<uint32_t> ReadCount(size_t size) {
+        if (!Has(4))
+            return 0;
+        const uint32_t count = ReadU32();
+        if (!Has(static_cast<size_t>(count) * size))
+            return std::nullopt;
+        return count;
+    }
+private:
+    const uint8_t *p_;
+    const uint8_t *end_;
+};
+
+// Checks the header, and skips it and the model name.
+bool skipVmdHeader(VmdCursor& cursor, saba::VMDHeader *header) {
+    if (!cursor.Has(30))
+        return false;
+    const std::string_view magic(reinterpret_cast<const char *>(cursor.Take(30)), 30);
+    if (!magic.starts_with("Vocaloid Motion Data"))
+        return false;
+    // The old format has a 10 bytes model name.
+    const size_t nameSize = magic.starts_with("Vocaloid Motion Data file") ? 10 : 20;
+    if (!cursor.Has(nameSize))
+        return false;
+    const auto name = cursor.Take(nameSize);
+    if (header) {
+        setVmdString(header->m_header, reinterpret_cast<const uint8_t *>(magic.data()), magic.size());
+        setVmdString(header->m_modelName, name, nameSize);
+    }
+    return true;
+}
+}
+
+BezierTable::BezierTable() {
+    // Index 0 is always the linear curve.
+    auto& linear = samples_.emplace_back();
+    for (size_t i = 0; i <= SampleCount; ++i)
+        linear[i] = static_cast<float>(i) / SampleCount;
+}
+
+uint16_t BezierTable::Intern(const Param& param) {
+    if (param[0] == param[1] && param[2] == param[3])
+        return LinearCurve;
+    if (const auto itr = indices_.find(param); itr != indices_.cend())
+        return itr->second;
+
+    // 127^4 curves can't be represented in 16 bits, but a motion never has
+    // that many distinct curves in practice.
+    if (samples_.size() > UINT16_MAX) {
+        Err::Log("Too many interpolation curves.  Fallback to linear.");
+        return LinearCurve;
+    }
+
+    const float x1 = param[0] / 127.0f;
+    const float y1 = param[1] / 127.0f;
+    const float x2 = param[2] / 127.0f;
+    const float y2 = param[3] / 127.0f;
+    auto& lut = samples_.emplace_back();
+    for (size_t i = 0; i <= SampleCount; ++i) {
+        const float x = static_cast<float>(i) / SampleCount;
+        lut[i] = bezierEval(bezierFindT(x, x1, x2), y1, y2);
+    }
+
+    const auto index = static_cast<uint16_t>(samples_.size() - 1);
+    indices_.emplace(param, index);
+    return index;
+}
+
+float BezierTable::Eval(uint16_t curve, float x) const {
+    const float pos = std::clamp(x, 0.0f, 1.0f) * SampleCount;
+    const size_t i = std::min(static_cast<size_t>(pos), SampleCount - 1);
+    const auto& lut = samples_[curve];
+    return glm::mix(lut[i], lut[i + 1], pos - static_cast<float>(i));
+}
+
+size_t BezierTable::GetCurveCount() const {
+    return samples_.size();
+}
+
+std::optional<VmdSummary> VmdSummary::Scan(const std::filesystem::path& path) {
+    // Walks the records of a VMD file, reading only names and frames.
+    MappedFile file;
+    if (!file.Open(path))
+        return std::nullopt;
+    VmdCursor cursor(file.Data(), file.Size());
+    if (!skipVmdHeader(cursor, nullptr))
+        return std::nullopt;
+
+    const auto utf8 = [](const std::string& sjis) {
+        saba::MMDFileString<20> s;
+        s.Set(sjis.c_str());
+        return s.ToUtf8String();
+    };
+    const auto frameAt = [](const uint8_t *p) {
+        uint32_t frame;
+        std::memcpy(&frame, p, sizeof(frame));
+        return static_cast<int32_t>(frame);
+    };
+
+    VmdSummary summary = {
+        .maxFrame = 0,
+        .boneNames = {},
+        .morphNames = {},
+        .ikNames = {},
+        .hasCamera = false,
+    };
+    std::set<std::string> names;
+
+    // Bone: name[15], frame, translate, quaternion, interpolation[64]
+    const auto boneCount = cursor.ReadCount(VmdBoneKeySize);
+    if (!boneCount)
+        return std::nullopt;
+    for (uint32_t i = 0; i < *boneCount; ++i) {
+        const auto p = cursor.Take(VmdBoneKeySize);
+        names.insert(vmdName(p, 15));
+        summary.maxFrame = std::max(summary.maxFrame, frameAt(p + 15));
+    }
+    for (const auto& n : names)
+        summary.boneNames.push_back(utf8(n));
+    names.clear();
+
+    // Morph: name[15], frame, weight
+    const auto morphCount = cursor.ReadCount(VmdMorphKeySize);
+    if (!morphCount)
+        return std::nullopt;
+    for (uint32_t i = 0; i < *morphCount; ++i) {
+        const auto p = cursor.Take(VmdMorphKeySize);
+        names.insert(vmdName(p, 15));
+        summary.maxFrame = std::max(summary.maxFrame, frameAt(p + 15));
+    }
+    for (const auto& n : names)
+        summary.morphNames.push_back(utf8(n));
+    names.clear();
+
+    // Camera: frame, distance, interest, rotate, interpolation[24], angle, perspective
+    const auto cameraCount = cursor.ReadCount(VmdCameraKeySize);
+    if (!cameraCount)
+        return summary;
+    summary.hasCamera = *cameraCount != 0;
+    for (uint32_t i = 0; i < *cameraCount; ++i)
+        summary.maxFrame = std::max(summary.maxFrame, frameAt(cursor.Take(VmdCameraKeySize)));
+
+    // Light and shadow have no effect here.  IK keys still count for the
+    // duration and the channels.
+    const auto lightCount = cursor.ReadCount(VmdLightKeySize);
+    if (!lightCount)
+        return summary;
+    cursor.Take(*lightCount * VmdLightKeySize);
+    const auto shadowCount = cursor.ReadCount(VmdShadowKeySize);
+    if (!shadowCount)
+        return summary;
+    cursor.Take(*shadowCount * VmdShadowKeySize);
+    const auto ikCount = cursor.ReadCount(4 + 1 + 4);
+    for (uint32_t i = 0; ikCount && i < *ikCount && cursor.Has(4 + 1 + 4); ++i) {
+        summary.maxFrame = std::max(summary.maxFrame, frameAt(cursor.Take(4 + 1)));
+        const auto infoCount = cursor.ReadCount(VmdIkInfoSize);
+        if (!infoCount)
+            break;
+        for (uint32_t j = 0; j < *infoCount; ++j)
+            names.insert(vmdName(cursor.Take(VmdIkInfoSize), 20));
+    }
+    for (const auto& n : names)
+        summary.ikNames.push_back(utf8(n));
+    return summary;
+}
+
+bool VmdReader::Read(saba::VMDFile& vmd, const std::filesystem::path& path) {
+    MappedFile file;
+    if (!file.Open(path))
+        return false;
+    return Read(vmd, file);
+}
+
+bool VmdReader::Read(saba::VMDFile& vmd, const MappedFile& file) {
+    static_assert(sizeof(saba::VMDMotion::m_translate) == 12 &&
+            sizeof(saba::VMDMotion::m_quaternion) == 16 &&
+            sizeof(saba::VMDMotion::m_interpolation) == 64 &&
+            sizeof(saba::VMDCamera::m_interest) == 12 &&
+            sizeof(saba::VMDCamera::m_rotate) == 12 &&
+            sizeof(saba::VMDCamera::m_interpolation) == 24,
+            "VMD records don't match Saba's structures.");
+
+    VmdCursor cursor(file.Data(), file.Size());
+    vmd = saba::VMDFile();
+    if (!skipVmdHeader(cursor, &vmd.m_header))
+        return false;
+
+    const auto boneCount = cursor.ReadCount(VmdBoneKeySize);
+    if (!boneCount)
+        return false;
+    vmd.m_motions.resize(*boneCount);
+    for (auto& key : vmd.m_motions) {
+        const auto p = cursor.Take(VmdBoneKeySize);
+        setVmdString(key.m_boneName, p, 15);
+        copyField(key.m_frame, p + 15);
+        copyField(key.m_translate, p + 19);
+        copyField(key.m_quaternion, p + 31);
+        copyField(key.m_interpolation, p + 47);
+    }
+
+    const auto morphCount = cursor.ReadCount(VmdMorphKeySize);
+    if (!morphCount)
+        return false;
+    vmd.m_morphs.resize(*morphCount);
+    for (auto& key : vmd.m_morphs) {
+        const auto p = cursor.Take(VmdMorphKeySize);
+        setVmdString(key.m_blendShapeName, p, 15);
+        copyField(key.m_frame, p + 15);
+        copyField(key.m_weight, p + 19);
+    }
+
+    const auto cameraCount = cursor.ReadCount(VmdCameraKeySize);
+    if (!cameraCount)
+        return false;
+    vmd.m_cameras.resize(*cameraCount);
+    for (auto& key : vmd.m_cameras) {
+        const auto p = cursor.Take(VmdCameraKeySize);
+        copyField(key.m_frame, p);
+        copyField(key.m_distance, p + 4);
+        copyField(key.m_interest, p + 8);
+        copyField(key.m_rotate, p + 20);
+        copyField(key.m_interpolation, p + 32);
+        copyField(key.m_viewAngle, p + 56);
+        copyField(key.m_isPerspective, p + 60);
+    }
+
+    // Nothing uses light and shadow keys.
+    const auto lightCount = cursor.ReadCount(VmdLightKeySize);
+    if (!lightCount)
+        return false;
+    cursor.Take(*lightCount * VmdLightKeySize);
+    const auto shadowCount = cursor.ReadCount(VmdShadowKeySize);
+    if (!shadowCount)
+        return false;
+    cursor.Take(*shadowCount * VmdShadowKeySize);
+
+    const auto ikCount = cursor.ReadCount(4 + 1 + 4);
+    if (!ikCount)
+        return false;
+    vmd.m_iks.resize(*ikCount);
+    for (auto& key : vmd.m_iks) {
+        // The info count is required here, unlike counts of sections.
+        if (!cursor.Has(4 + 1 + 4))
+            return false;
+        const auto p = cursor.Take(4 + 1);
+        copyField(key.m_frame, p);
+        copyField(key.m_show, p + 4);
+        const auto infoCount = cursor.ReadCount(VmdIkInfoSize);
+        if (!infoCount)
+            return false;
+        key.m_ikInfos.resize(*infoCount);
+        for (auto& info : key.m_ikInfos) {
+            const auto q = cursor.Take(VmdIkInfoSize);
+            setVmdString(info.m_name, q, 20);
+            copyField(info.m_enable, q + 20);
+        }
+    }
+    return true;
+}
+
+MotionClip::MotionClip() :
+    maxKeyTime_(0), rawKeyBytes_(0)
+{}
+
+bool MotionClip::Create(const std::shared_ptr<saba::MMDModel>& model, const saba::VMDFile& vmd) {
+    if (!model)
+        return false;
+
+    auto nodeManager = model->GetNodeManager();
+    auto morphManager = model->GetMorphManager();
+    auto ikManager = model->GetIKManager();
+
+    // Gather keys for each channel.  Channels are ordered by model index so
+    // that the per-frame update touches nodes in memory order.
+    std::map<size_t, std::vector<const saba::VMDMotion *>> boneKeys;
+    std::map<size_t, std::vector<const saba::VMDMorph *>> morphKeys;
+    std::map<size_t, std::vector<std::pair<uint32_t, bool>>> ikKeys;
+    for (const auto& motion : vmd.m_motions) {
+        const auto index = nodeManager->FindNodeIndex(motion.m_boneName.ToUtf8String());
+        if (index != saba::MMDNodeManager::NPos)
+            boneKeys[index].push_back(&motion);
+    }
+    for (const auto& morph : vmd.m_morphs) {
+        const auto index = morphManager->FindMorphIndex(morph.m_blendShapeName.ToUtf8String());
+        if (index != saba::MMDMorphManager::NPos)
+            morphKeys[index].push_back(&morph);
+    }
+    for (const auto& ik : vmd.m_iks) {
+        for (const auto& info : ik.m_ikInfos) {
+            const auto index = ikManager->FindIKSolverIndex(info.m_name.ToUtf8String());
+            if (index != saba::MMDIKManager::NPos)
+                ikKeys[index].emplace_back(ik.m_frame, info.m_enable != 0);
+        }
+    }
+
+    maxKeyTime_ = 0;
+    rawKeyBytes_ = 0;
+    std::map<CurveSet, uint16_t> curveSetIndices;
+    const auto internCurveSet = [this, &curveSetIndices](const CurveSet& set) {
+        if (const auto itr = curveSetIndices.find(set); itr != curveSetIndices.cend())
+            return itr->second;
+        if (curveSets_.size() > UINT16_MAX) {
+            Err::Log("Too many interpolation curves.  Fallback to linear.");
+            return static_cast<uint16_t>(0);
+        }
+        const auto index = static_cast<uint16_t>(curveSets_.size());
+        curveSets_.push_back(set);
+        curveSetIndices.emplace(set, index);
+        return index;
+    };
+    curveSets_.clear();
+    internCurveSet({BezierTable::LinearCurve, BezierTable::LinearCurve,
+            BezierTable::LinearCurve, BezierTable::LinearCurve});
+
+    // Channels whose keys all hold the same value are applied only once.
+    // Channels without keys are absent from here.
+    constants_ = ConstantChannels();
+    bones_.keyBegin.push_back(0);
+    for (auto& [index, keys] : boneKeys) {
+        sortByFrame(keys);
+        maxKeyTime_ = std::max(maxKeyTime_, static_cast<int32_t>(keys.back()->m_frame));
+        const auto isConstant = std::all_of(keys.cbegin(), keys.cend(), [&keys](const auto key) {
+            return key->m_translate == keys.front()->m_translate &&
+                key->m_quaternion == keys.front()->m_quaternion;
+        });
+        if (isConstant) {
+            constants_.nodes.push_back(nodeManager->GetMMDNode(index));
+            constants_.translates.push_back(Yommd::toRightHanded(keys.front()->m_translate));
+            constants_.rotates.push_back(Yommd::toRightHanded(keys.front()->m_quaternion));
+            continue;
+        }
+
+        // Translations are quantized in the bounding box of the channel.
+        glm::vec3 tmin(std::numeric_limits<float>::max());
+        glm::vec3 tmax(std::numeric_limits<float>::lowest());
+        std::vector<int32_t> times;
+        for (const auto key : keys) {
+            const auto t = Yommd::toRightHanded(key->m_translate);
+            tmin = glm::min(tmin, t);
+            tmax = glm::max(tmax, t);
+            times.push_back(static_cast<int32_t>(key->m_frame));
+        }
+        const glm::vec3 trange = tmax - tmin;
+
+        bones_.nodes.push_back(nodeManager->GetMMDNode(index));
+        bones_.startTimes.push_back(times.front());
+        bones_.endTimes.push_back(times.back());
+        bones_.translateMins.push_back(tmin);
+        bones_.translateRanges.push_back(trange);
+        appendFrameDeltas(times, bones_.frameDeltas, bones_.longDeltas);
+        for (const auto key : keys) {
+            const auto t = Yommd::toRightHanded(key->m_translate);
+            bones_.translates.push_back({
+                quantize(t.x, tmin.x, trange.x),
+                quantize(t.y, tmin.y, trange.y),
+                quantize(t.z, tmin.z, trange.z),
+            });
+            bones_.rotates.push_back(packQuat(Yommd::toRightHanded(key->m_quaternion)));
+            bones_.curveSets.push_back(internCurveSet({
+                curves_.Intern(getBezierParam(key->m_interpolation, 0)),
+                curves_.Intern(getBezierParam(key->m_interpolation, 1)),
+                curves_.Intern(getBezierParam(key->m_interpolation, 2)),
+                curves_.Intern(getBezierParam(key->m_interpolation, 3)),
+            }));
+        }
+        bones_.keyBegin.push_back(static_cast<uint32_t>(bones_.frameDeltas.size()));
+    }
+    // time, translate, rotate and 4 curves per key.
+    rawKeyBytes_ += bones_.frameDeltas.size() *
+        (sizeof(int32_t) + sizeof(glm::vec3) + sizeof(glm::quat) + 4 * sizeof(uint16_t));
+
+    morphs_.keyBegin.push_back(0);
+    for (auto& [index, keys] : morphKeys) {
+        sortByFrame(keys);
+        maxKeyTime_ = std::max(maxKeyTime_, static_cast<int32_t>(keys.back()->m_frame));
+        const auto isConstant = std::all_of(keys.cbegin(), keys.cend(), [&keys](const auto key) {
+            return key->m_weight == keys.front()->m_weight;
+        });
+        if (isConstant) {
+            constants_.morphs.push_back(morphManager->GetMorph(index));
+            constants_.weights.push_back(keys.front()->m_weight);
+            continue;
+        }
+
+        float wmin = std::numeric_limits<float>::max();
+        float wmax = std::numeric_limits<float>::lowest();
+        std::vector<int32_t> times;
+        for (const auto key : keys) {
+            wmin = std::min(wmin, key->m_weight);
+            wmax = std::max(wmax, key->m_weight);
+            times.push_back(static_cast<int32_t>(key->m_frame));
+        }
+
+        morphs_.morphs.push_back(morphManager->GetMorph(index));
+        morphs_.startTimes.push_back(times.front());
+        morphs_.endTimes.push_back(times.back());
+        morphs_.weightMins.push_back(wmin);
+        morphs_.weightRanges.push_back(wmax - wmin);
+        appendFrameDeltas(times, morphs_.frameDeltas, morphs_.longDeltas);
+        for (const auto key : keys)
+            morphs_.weights.push_back(quantize(key->m_weight, wmin, wmax - wmin));
+        morphs_.keyBegin.push_back(static_cast<uint32_t>(morphs_.frameDeltas.size()));
+    }
+    rawKeyBytes_ += morphs_.frameDeltas.size() * (sizeof(int32_t) + sizeof(float));
+
+    iks_.keyBegin.push_back(0);
+    for (auto& [index, keys] : ikKeys) {
+        std::stable_sort(keys.begin(), keys.end(),
+                [](const auto& a, const auto& b) { return a.first < b.first; });
+        maxKeyTime_ = std::max(maxKeyTime_, static_cast<int32_t>(keys.back().first));
+        const auto isConstant = std::all_of(keys.cbegin(), keys.cend(), [&keys](const auto& key) {
+            return key.second == keys.front().second;
+        });
+        if (isConstant) {
+            constants_.solvers.push_back(ikManager->GetMMDIKSolver(index));
+            constants_.enables.push_back(keys.front().second);
+            continue;
+        }
+
+        std::vector<int32_t> times;
+        for (const auto& [frame, enable] : keys) {
+            times.push_back(static_cast<int32_t>(frame));
+            iks_.enables.push_back(enable);
+        }
+        iks_.solvers.push_back(ikManager->GetMMDIKSolver(index));
+        iks_.startTimes.push_back(times.front());
+        iks_.endTimes.push_back(times.back());
+        appendFrameDeltas(times, iks_.frameDeltas, iks_.longDeltas);
+        iks_.keyBegin.push_back(static_cast<uint32_t>(iks_.frameDeltas.size()));
+    }
+    rawKeyBytes_ += iks_.frameDeltas.size() * (sizeof(int32_t) + sizeof(uint8_t));
+
+    return true;
+}
+
+MotionClip::State MotionClip::CreateState() const {
+    State state;
+    for (size_t i = 0; i < bones_.nodes.size(); ++i)
+        state.boneCursors.push_back({bones_.keyBegin[i], bones_.startTimes[i]});
+    for (size_t i = 0; i < morphs_.morphs.size(); ++i)
+        state.morphCursors.push_back({morphs_.keyBegin[i], morphs_.startTimes[i]});
+    for (size_t i = 0; i < iks_.solvers.size(); ++i)
+        state.ikCursors.push_back({iks_.keyBegin[i], iks_.startTimes[i]});
+
+    const size_t boneCount = bones_.nodes.size();
+    state.key0.resize(boneCount);
+    state.key1.resize(boneCount);
+    state.progress.resize(boneCount);
+    state.slerpChannels.reserve(boneCount);
+    const size_t n = Simd::padded(boneCount);
+    for (int c = 0; c < 3; ++c) {
+        state.translates0[c].assign(n, 0.0f);
+        state.translates1[c].assign(n, 0.0f);
+    }
+    for (int c = 0; c < 4; ++c) {
+        state.rotates0[c].assign(n, 0.0f);
+        state.rotates1[c].assign(n, 0.0f);
+        state.curveValues[c].assign(n, 0.0f);
+    }
+    state.rotates0[3].assign(n, 1.0f);  // Identity in padding.
+    state.rotates1[3].assign(n, 1.0f);
+    state.constantsApplied = false;
+    return state;
+}
+
+void MotionClip::Evaluate(State& state, float frame) const {
+    applyConstants(state);
+    evaluateBones(state, frame);
+    evaluateMorphs(state, frame);
+    evaluateIks(state, frame);
+}
+
+int32_t MotionClip::GetMaxKeyTime() const {
+    return maxKeyTime_;
+}
+
+std::vector<saba::MMDNode *> MotionClip::GetBoneTargets() const {
+    auto targets = bones_.nodes;
+    targets.insert(targets.end(), constants_.nodes.cbegin(), constants_.nodes.cend());
+    return targets;
+}
+
+std::vector<saba::MMDMorph *> MotionClip::GetMorphTargets() const {
+    auto targets = morphs_.morphs;
+    targets.insert(targets.end(), constants_.morphs.cbegin(), constants_.morphs.cend());
+    return targets;
+}
+
+MotionClip::MemoryUsage MotionClip::GetMemoryUsage() const {
+    const auto bytes = [](const auto& v) {
+        return v.size() * sizeof(typename std::decay_t<decltype(v)>::value_type);
+    };
+    size_t keyBytes = 0;
+    keyBytes += bytes(bones_.frameDeltas) + bytes(bones_.translates) +
+        bytes(bones_.rotates) + bytes(bones_.curveSets);
+    keyBytes += bytes(morphs_.frameDeltas) + bytes(morphs_.weights);
+    keyBytes += bytes(iks_.frameDeltas) + bytes(iks_.enables);
+    keyBytes += bytes(bones_.longDeltas) + bytes(morphs_.longDeltas) + bytes(iks_.longDeltas);
+    keyBytes += bytes(curveSets_);
+    return {.raw = rawKeyBytes_, .compressed = keyBytes};
+}
+
+void MotionClip::applyConstants(State& state) const {
+    // Nodes' animation TRS, morph weights and IK switches persist across
+    // frames, so constant channels need to be written only once, unless
+    // something else, e.g. a crossfade, overwrites them.  See
+    // MotionEvaluator::Reset().
+    if (state.constantsApplied)
+        return;
+    state.constantsApplied = true;
+
+    const auto& c = constants_;
+    for (size_t i = 0; i < c.nodes.size(); ++i) {
+        c.nodes[i]->SetAnimationTranslate(c.translates[i]);
+        c.nodes[i]->SetAnimationRotate(c.rotates[i]);
+    }
+    for (size_t i = 0; i < c.morphs.size(); ++i)
+        c.morphs[i]->SetWeight(c.weights[i]);
+    for (size_t i = 0; i < c.solvers.size(); ++i)
+        c.solvers[i]->Enable(c.enables[i] != 0);
+}
+
+void MotionClip::evaluateBones(State& state, float frame) const {
+    const size_t channelCount = bones_.nodes.size();
+
+    // Pass 1: Find the pair of keys to interpolate for each channel.
+    for (size_t i = 0; i < channelCount; ++i) {
+        findKeys(bones_.frameDeltas.data(), bones_.longDeltas,
+                bones_.keyBegin[i], bones_.keyBegin[i + 1], bones_.startTimes[i], bones_.endTimes[i],
+                state.boneCursors[i], frame, state.key0[i], state.key1[i], state.progress[i]);
+    }
+
+    // Pass 2: Decompress the keys and evaluate the interpolation curves,
+    // which are stored in the latter key.
+    state.slerpChannels.clear();
+    for (size_t i = 0; i < channelCount; ++i) {
+        const uint32_t k0 = state.key0[i];
+        const uint32_t k1 = state.key1[i];
+        const float x = state.progress[i];
+        const auto& curves = curveSets_[bones_.curveSets[k1]];
+        const auto& tmin = bones_.translateMins[i];
+        const auto& trange = bones_.translateRanges[i];
+        const auto& t0 = bones_.translates[k0];
+        const auto& t1 = bones_.translates[k1];
+        for (int c = 0; c < 3; ++c) {
+            state.translates0[c][i] = dequantize(t0[c], tmin[c], trange[c]);
+            state.translates1[c][i] = dequantize(t1[c], tmin[c], trange[c]);
+        }
+        const auto r0 = unpackQuat(bones_.rotates[k0]);
+        const auto r1 = unpackQuat(bones_.rotates[k1]);
+        if (std::abs(glm::dot(r0, r1)) < NlerpMinCos)
+            state.slerpChannels.push_back(static_cast<uint32_t>(i));
+        for (int c = 0; c < 4; ++c) {
+            state.rotates0[c][i] = r0[c];
+            state.rotates1[c][i] = r1[c];
+            state.curveValues[c][i] = curves_.Eval(curves[c], x);
+        }
+    }
+
+    // Pass 3: Interpolate all channels, Simd::Lanes at a time.  Rotations
+    // are nlerped, and then slerped again where keys are far apart.
+    const size_t count = Simd::padded(channelCount);
+    for (int c = 0; c < 3; ++c) {
+        Simd::lerpArray(state.translates0[c].data(), state.translates1[c].data(), count,
+                state.curveValues[c].data());
+    }
+    Simd::nlerpArray(state.rotates0, state.rotates1, count, state.curveValues[3].data());
+    for (const auto i : state.slerpChannels) {
+        const auto r = glm::slerp(unpackQuat(bones_.rotates[state.key0[i]]),
+                unpackQuat(bones_.rotates[state.key1[i]]), state.curveValues[3][i]);
+        for (int c = 0; c < 4; ++c)
+            state.rotates1[c][i] = r[c];
+    }
+
+    // Pass 4: Write back to nodes.
+    for (size_t i = 0; i < channelCount; ++i) {
+        glm::quat r;
+        for (int c = 0; c < 4; ++c)
+            r[c] = state.rotates1[c][i];
+        bones_.nodes[i]->SetAnimationTranslate(glm::vec3(
+                    state.translates1[0][i], state.translates1[1][i], state.translates1[2][i]));
+        bones_.nodes[i]->SetAnimationRotate(r);
+    }
+}
+
+void MotionClip::evaluateMorphs(State& state, float frame) const {
+    const size_t channelCount = morphs_.morphs.size();
+    for (size_t i = 0; i < channelCount; ++i) {
+        uint32_t k0, k1;
+        float x;
+        findKeys(morphs_.frameDeltas.data(), morphs_.longDeltas,
+                morphs_.keyBegin[i], morphs_.keyBegin[i + 1], morphs_.startTimes[i], morphs_.endTimes[i],
+                state.morphCursors[i], frame, k0, k1, x);
+        const float wmin = morphs_.weightMins[i];
+        const float wrange = morphs_.weightRanges[i];
+        morphs_.morphs[i]->SetWeight(glm::mix(
+                dequantize(morphs_.weights[k0], wmin, wrange),
+                dequantize(morphs_.weights[k1], wmin, wrange), x));
+    }
+}
+
+void MotionClip::evaluateIks(State& state, float frame) const {
+    const size_t channelCount = iks_.solvers.size();
+    for (size_t i = 0; i < channelCount; ++i) {
+        // The switch follows the last passed key.
+        uint32_t k0, k1;
+        float x;
+        findKeys(iks_.frameDeltas.data(), iks_.longDeltas,
+                iks_.keyBegin[i], iks_.keyBegin[i + 1], iks_.startTimes[i], iks_.endTimes[i],
+                state.ikCursors[i], frame, k0, k1, x);
+        iks_.solvers[i]->Enable(iks_.enables[k0] != 0);
+    }
+}
+
+MotionEvaluator::MotionEvaluator() :
+    maxKeyTime_(0)
+{}
+
+bool MotionEvaluator::Create(const std::vector<std::shared_ptr<const MotionClip>>& clips) {
+    clips_.clear();
+    maxKeyTime_ = 0;
+    for (const auto& clip : clips) {
+        if (!clip)
+            return false;
+        clips_.emplace_back(clip, clip->CreateState());
+        maxKeyTime_ = std::max(maxKeyTime_, clip->GetMaxKeyTime());
+    }
+    return true;
+}
+
+void MotionEvaluator::Evaluate(float frame) {
+    for (auto& [clip, state] : clips_)
+        clip->Evaluate(state, frame);
+}
+
+void MotionEvaluator::Reset() {
+    for (auto& [clip, state] : clips_)
+        state.constantsApplied = false;
+}
+
+int32_t MotionEvaluator::GetMaxKeyTime() const {
+    return maxKeyTime_;
+}
+
+std::vector<saba::MMDNode *> MotionEvaluator::GetBoneTargets() const {
+    std::vector<saba::MMDNode *> targets;
+    for (const auto& [clip, state] : clips_) {
+        const auto t = clip->GetBoneTargets();
+        targets.insert(targets.end(), t.cbegin(), t.cend());
+    }
+    return targets;
+}
+
+std::vector<saba::MMDMorph *> MotionEvaluator::GetMorphTargets() const {
+    std::vector<saba::MMDMorph *> targets;
+    for (const auto& [clip, state] : clips_) {
+        const auto t = clip->GetMorphTargets();
+        targets.insert(targets.end(), t.cbegin(), t.cend());
+    }
+    return targets;
+}
@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDPhysics.h"
+#include "Saba/Model/MMD/VMDFile.h"
+#include "yommd.hpp"
+
+// Steps animation and physics of a model without a window or GPU, and
+// reports how long physics takes.  Time advances exactly one frame per step,
+// so results are comparable across runs and machines.
+
+namespace {
+constexpr std::string_view usage =
+R"(Usage: yoMMD-physbench [options] [<model>] [<motion.vmd>...]
+
+Options:
+  --config <toml>   Read the model, motions and physics settings from the config.
+                    The model and motions given after options take precedence.
+  --frames <n>      Frames to step after settling.  Default: 600
+  --bench-vmd <n>   Instead, compare reading the motions <n> times with
+                    Saba's reader and yoMMD's.
+  -h, --help        Show this message.)";
+
+constexpr unsigned int DefaultFrames = 600;
+
+struct Args {
+    std::filesystem::path configFile;
+    unsigned int frames = DefaultFrames;
+    unsigned int vmdReads = 0;
+    std::vector<std::filesystem::path> paths;  // The model, then motions.
+};
+
+Args parseArgs(int argc, char *argv[]) {
+    Args args;
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            Info::Log(usage);
+            std::exit(0);
+        } else if (arg == "--config") {
+            if (++i == argc)
+                Err::Exit("No toml file name specified after \"--config\"\n", usage);
+            args.configFile = String::tou8(std::string_view(argv[i]));
+        } else if (arg == "--frames") {
+            if (++i == argc)
+                Err::Exit("No number specified after \"--frames\"\n", usage);
+            try {
+                args.frames = static_cast<unsigned int>(std::stoul(argv[i]));
+            } catch (const std::exception&) {
+                Err::Exit("Invalid frame count:", argv[i], '\n', usage);
+            }
+        } else if (arg == "--bench-vmd") {
+            if (++i == argc)
+                Err::Exit("No number specified after \"--bench-vmd\"\n", usage);
+            try {
+                args.vmdReads = static_cast<unsigned int>(std::stoul(argv[i]));
+            } catch (const std::exception&) {
+                Err::Exit("Invalid read count:", argv[i], '\n', usage);
+            }
+        } else if (arg.starts_with("-")) {
+            Err::Exit("Unknown option:", arg, '\n', usage);
+        } else {
+            args.paths.push_back(String::tou8(arg));
+        }
+    }
+    return args;
+}
+
+// Reads each file "count" times with each reader, and logs the average.
+void benchmarkVmd(const std::vector<std::filesystem::path>& paths, unsigned int count) {
+    using ReadFunc = std::function<bool(saba::VMDFile&, const std::filesystem::path&)>;
+    const std::pair<const char *, ReadFunc> readers[] = {
+        {"saba::ReadVMDFile:", [](saba::VMDFile& vmd, const std::filesystem::path& path) {
+            return saba::ReadVMDFile(&vmd, path.string().c_str());
+        }},
+        {"VmdReader:", [](saba::VMDFile& vmd, const std::filesystem::path& path) {
+            return VmdReader::Read(vmd, path);
+        }},
+    };
+    for (const auto& path : paths) {
+        Info::Log("Motion:", path, std::filesystem::file_size(path), "bytes");
+        for (const auto& [label, read] : readers) {
+            double total = 0.0;
+            size_t keys = 0;
+            for (unsigned int i = 0; i < count; ++i) {
+                saba::VMDFile vmd;
+                const auto begin = std::chrono::steady_clock::now();
+                if (!read(vmd, path))
+                    Err::Exit("Failed to read VMD file:", path);
+                const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+                total += elapsed.count();
+                keys = vmd.m_motions.size() + vmd.m_morphs.size() + vmd.m_cameras.size();
+            }
+            Info::Log(label, total * 1000.0 / count, "ms/read on average,", keys, "keys");
+        }
+    }
+}
+
+// Nearest-rank percentile of sorted samples.
+double percentile(const std::vector<double>& sorted, double p) {
+    const auto rank = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+}
+
+namespace Dialog {
+void messageBox(std::string_view msg) {
+    std::cerr << msg << std::flush;
+}
+}
+
+int main(int argc, char *argv[]) {
+    const Args args = parseArgs(argc, argv);
+
+    Config config;
+    if (!args.configFile.empty())
+        config = Config::Parse(args.configFile);
+    std::vector<std::filesystem::path> motionPaths;
+    if (!args.paths.empty()) {
+        config.model = args.paths.front();
+        motionPaths.assign(args.paths.cbegin() + 1, args.paths.cend());
+    }
+    if (motionPaths.empty()) {
+        const auto motion = std::find_if(config.motions.cbegin(), config.motions.cend(),
+                [](const Config::Motion& m) { return !m.disabled; });
+        if (motion != config.motions.cend())
+            motionPaths = motion->paths;
+    }
+    if (config.model.empty())
+        Err::Exit("No model specified.\n", usage);
+    if (motionPaths.empty())
+        Err::Exit("No motion specified.\n", usage);
+
+    if (args.vmdReads != 0) {
+        benchmarkVmd(motionPaths, args.vmdReads);
+        return 0;
+    }
+
+    MMD mmd;
+    mmd.LoadModel(config.model, "<embedded-toons>",
+            config.modelCache ? Yommd::getCachePath() / "models" : std::filesystem::path());
+    mmd.SetIkIterationBudget(config.ikIterationBudget);
+    mmd.AddMotion(motionPaths);
+    mmd.PruneUnused();
+    mmd.SetupPhysics(config, false);
+
+    auto& evaluator = *mmd.GetMotions().Load(0)->evaluator;
+    const int32_t duration = std::max(mmd.GetMotions().GetDuration(0), 1);
+    mmd.PrerollPhysics(evaluator, config.physicsPreroll, 1.0 / config.simulationFPS);
+
+    const auto physics = mmd.GetPhysics();
+    const double step = 1.0 / Constant::FPS;
+    std::vector<double> times;
+    times.reserve(args.frames);
+    uint64_t subSteps = 0, contacts = 0, activeBodies = 0;
+    int maxSubSteps = 0;
+    size_t maxContacts = 0;
+    evaluator.Reset();
+    for (unsigned int i = 0; i < args.frames; ++i) {
+        const auto vmdFrame = std::fmod(i * step * Constant::VmdFPS, static_cast<double>(duration));
+        mmd.BeginAnimation();
+        evaluator.Evaluate(static_cast<float>(vmdFrame));
+        mmd.UpdateMorphAnimation();
+        mmd.UpdateNodeAnimation(false);
+        const auto begin = std::chrono::steady_clock::now();
+        mmd.UpdatePhysicsAnimation(step);
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+        mmd.UpdateNodeAnimation(true);
+        mmd.EndAnimation();
+
+        times.push_back(elapsed.count() * 1000.0);
+        if (physics) {
+            subSteps += physics->GetSubStepCount();
+            maxSubSteps = std::max(maxSubSteps, physics->GetSubStepCount());
+            const auto c = physics->GetContactCount();
+            contacts += c;
+            maxContacts = std::max(maxContacts, c);
+            activeBodies += physics->GetActiveBodyCount();
+        }
+    }
+    if (times.empty())
+        return 0;
+
+    const double mean = std::reduce(times.cbegin(), times.cend()) / times.size();
+    std::sort(times.begin(), times.end());
+    Info::Log("Model:", config.model);
+    Info::Log("Rigid bodies:", mmd.GetModel()->GetPhysicsManager()->GetRigidBodys()->size());
+    Info::Log("Frames:", args.frames, "at", Constant::FPS, "fps, simulated at",
+            config.simulationFPS, "fps");
+    Info::Log("Step time (ms): mean", mean, "p50", percentile(times, 50.0),
+            "p90", percentile(times, 90.0), "p99", percentile(times, 99.0),
+            "max", times.back());
+    if (physics) {
+        const double frames = args.frames;
+        Info::Log("Substeps per frame: mean", subSteps / frames, "max", maxSubSteps);
+        Info::Log("Contact points: mean", contacts / frames, "max", maxContacts);
+        Info::Log("Active bodies: mean", activeBodies / frames);
+    }
+    mmd.LogStats();
+    return 0;
+}
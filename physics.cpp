@@ -0,0 +1,1124 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <regex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDNode.h"
+#include "Saba/Model/MMD/MMDPhysics.h"
+#include "Saba/Model/MMD/PMXFile.h"
+#include "btBulletDynamicsCommon.h"
+#include "BulletCollision/CollisionDispatch/btCollisionDispatcherMt.h"
+#include "BulletDynamics/ConstraintSolver/btSequentialImpulseConstraintSolverMt.h"
+#include "BulletDynamics/Dynamics/btDiscreteDynamicsWorldMt.h"
+#include "LinearMath/btThreads.h"
+#include "glm/gtc/quaternion.hpp"
+#include "glm/gtc/type_ptr.hpp"
+#include "yommd.hpp"
+
+namespace {
+// Frames the physics cost must stay over budget before stepping down.
+constexpr uint32_t DownFrames = 30;
+// Frames with enough headroom before stepping up, doubled each time a step
+// up turns out to be too expensive.
+constexpr uint32_t UpFrames = 120;
+constexpr uint32_t MaxUpFrames = UpFrames * 16;
+// Step up only when the cost is below this fraction of the budget.
+constexpr double Headroom = 0.5;
+constexpr double SmoothingFactor = 0.1;
+// Frames to blend bones from the last simulated pose into the animation
+// when their bodies stop being simulated.
+constexpr int FadeFrames = 15;
+// Chains are simulated again when larger than the LOD size by this factor.
+constexpr float LodHysteresis = 1.25f;
+// Physics sleeps after dynamic bodies and the bones driving bodies stay
+// slower than these for a while, and wakes up as soon as a driving bone
+// gets faster.  A unit is about 8 cm.
+constexpr float SleepLinearSpeed = 0.5f;  // In units per second.
+constexpr float SleepAngularSpeed = 0.2f;  // In radians per second.
+constexpr uint32_t SleepFrames = 60;
+// Sleeping physics also wakes up once a driving bone has moved this much in
+// total since it fell asleep, e.g. in a slow walk or turn.
+constexpr float SleepLinearDrift = 0.1f;  // In units.
+constexpr float SleepAngularDrift = 0.05f;  // In radians.
+// Steps the physics thread may fall behind before dropping them.
+constexpr double MaxThreadLag = 4.0;
+// Models with fewer bodies don't gain from the multithreaded world.
+constexpr size_t MtBodyThreshold = 100;
+constexpr unsigned int MaxAutoThreads = 4;
+
+// Layout of snapshot files.  Bump the version on changes.
+constexpr char SnapshotMagic[8] = {'y', 'o', 'M', 'M', 'D', 'P', 'h', 'y'};
+constexpr uint32_t SnapshotVersion = 1;
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t bodyCount;
+    uint64_t key;
+};
+struct SnapshotBody {
+    float transform[16];  // Column major.
+    float linearVelocity[3];
+    float angularVelocity[3];
+};
+
+const char *tierName(PhysicsController::Tier tier) {
+    using Tier = PhysicsController::Tier;
+    switch (tier) {
+    case Tier::Full:
+        return "full";
+    case Tier::FewerIterations:
+        return "fewer solver iterations";
+    case Tier::LowerRate:
+        return "lower simulation rate";
+    case Tier::NoLowPriority:
+        return "low priority bodies disabled";
+    case Tier::Frozen:
+        return "frozen";
+    }
+    return "unknown";
+}
+
+// Runs Bullet's parallel loops on threads owned by yoMMD.  Bullet indexes
+// per-thread data with btGetCurrentThreadIndex(), which numbers threads in
+// the order they first call it, so only the main thread and the workers
+// started here run loop bodies.  Other callers, e.g. job threads stepping
+// physics, just wait for the workers.
+class TaskScheduler : public btITaskScheduler {
+public:
+    TaskScheduler() :
+        btITaskScheduler("yoMMD"), numThreads_(1), registered_(0), func_(nullptr),
+        end_(0), grain_(1), next_(0), generation_(0), active_(0), sum_(0), quit_(false)
+    {}
+    ~TaskScheduler() override {
+        {
+            std::lock_guard lock(mutex_);
+            quit_ = true;
+        }
+        cv_.notify_all();
+        for (auto& worker : workers_)
+            worker.join();
+    }
+    // Call after btSetTaskScheduler(), which restarts thread numbering.
+    void Start(unsigned int workerCount) {
+        std::unique_lock lock(mutex_);
+        for (unsigned int i = 0; i < workerCount; ++i)
+            workers_.emplace_back(&TaskScheduler::workerMain, this);
+        doneCv_.wait(lock, [this, workerCount]() { return registered_ == workerCount; });
+    }
+    int getMaxNumThreads() const override {
+        return BT_MAX_THREAD_COUNT;
+    }
+    int getNumThreads() const override {
+        return numThreads_;
+    }
+    void setNumThreads(int) override {
+        // Fixed by Start().
+    }
+    void parallelFor(int begin, int end, int grain, const btIParallelForBody& body) override {
+        run(begin, end, grain, [&body](int b, int e) {
+            body.forLoop(b, e);
+            return btScalar(0);
+        });
+    }
+    btScalar parallelSum(int begin, int end, int grain, const btIParallelSumBody& body) override {
+        return run(begin, end, grain, [&body](int b, int e) { return body.sumLoop(b, e); });
+    }
+private:
+    btScalar run(int begin, int end, int grain, const std::function<btScalar(int, int)>& func) {
+        grain = std::max(grain, 1);
+        const bool canWork = btGetCurrentThreadIndex() < static_cast<unsigned int>(numThreads_);
+        if (canWork && (workers_.empty() || end - begin <= grain || working))
+            return func(begin, end);  // Also runs nested loops inline.
+
+        std::unique_lock lock(mutex_);
+        func_ = &func;
+        end_ = end;
+        grain_ = grain;
+        next_.store(begin);
+        sum_ = 0;
+        ++generation_;
+        cv_.notify_all();
+        if (canWork) {
+            ++active_;
+            lock.unlock();
+            const auto sum = work();
+            lock.lock();
+            sum_ += sum;
+            --active_;
+        }
+        doneCv_.wait(lock, [this]() { return next_.load() >= end_ && active_ == 0; });
+        func_ = nullptr;
+        return sum_;
+    }
+    btScalar work() {
+        btScalar sum = 0;
+        working = true;
+        for (;;) {
+            const int b = next_.fetch_add(grain_);
+            if (b >= end_)
+                break;
+            sum += (*func_)(b, std::min(b + grain_, end_));
+        }
+        working = false;
+        return sum;
+    }
+    void workerMain() {
+        {
+            std::lock_guard lock(mutex_);
+            numThreads_ = std::max(numThreads_, static_cast<int>(btGetCurrentThreadIndex()) + 1);
+            ++registered_;
+        }
+        doneCv_.notify_all();
+
+        uint64_t seen = 0;
+        std::unique_lock lock(mutex_);
+        for (;;) {
+            cv_.wait(lock, [this, seen]() { return quit_ || generation_ != seen; });
+            if (quit_)
+                return;
+            seen = generation_;
+            if (!func_)
+                continue;  // Woke up after the loop finished.
+            ++active_;
+            lock.unlock();
+            const auto sum = work();
+            lock.lock();
+            sum_ += sum;
+            if (--active_ == 0)
+                doneCv_.notify_all();
+        }
+    }
+
+    static thread_local bool working;  // Inside a loop body.
+
+    std::vector<std::thread> workers_;
+    int numThreads_;
+    unsigned int registered_;
+    std::mutex mutex_;
+    std::condition_variable cv_;  // Wakes workers.
+    std::condition_variable doneCv_;  // Wakes the caller.
+    const std::function<btScalar(int, int)> *func_;
+    int end_;
+    int grain_;
+    std::atomic<int> next_;
+    uint64_t generation_;
+    uint32_t active_;
+    btScalar sum_;
+    bool quit_;
+};
+
+thread_local bool TaskScheduler::working = false;
+
+// Same as Saba's filter callback, except that the ground is told by its
+// collision object.  Saba keeps the broadphase proxy of the ground, which is
+// replaced when the ground moves to another world.
+class GroundFilterCallback : public btOverlapFilterCallback {
+public:
+    explicit GroundFilterCallback(const btCollisionObject *ground) :
+        ground_(ground)
+    {}
+    bool needBroadphaseCollision(btBroadphaseProxy *proxy0, btBroadphaseProxy *proxy1) const override {
+        if (proxy0->m_clientObject == ground_ || proxy1->m_clientObject == ground_)
+            return true;
+        return (proxy0->m_collisionFilterGroup & proxy1->m_collisionFilterMask) != 0 &&
+            (proxy1->m_collisionFilterGroup & proxy0->m_collisionFilterMask) != 0;
+    }
+private:
+    const btCollisionObject *ground_;
+};
+
+// Moves all bodies and joints, keeping their collision filters.
+void moveWorld(btDiscreteDynamicsWorld& from, btDiscreteDynamicsWorld& to) {
+    to.setGravity(from.getGravity());
+    to.getSolverInfo() = from.getSolverInfo();
+    to.getPairCache()->setOverlapFilterCallback(from.getPairCache()->getOverlapFilterCallback());
+
+    std::vector<btTypedConstraint *> constraints;
+    for (int i = 0; i < from.getNumConstraints(); ++i)
+        constraints.push_back(from.getConstraint(i));
+    for (const auto c : constraints)
+        from.removeConstraint(c);
+
+    struct Entry {
+        btRigidBody *body;
+        int group;
+        int mask;
+    };
+    std::vector<Entry> bodies;
+    const auto& objects = from.getCollisionObjectArray();
+    for (int i = 0; i < objects.size(); ++i) {
+        const auto body = btRigidBody::upcast(objects[i]);
+        if (!body)
+            continue;
+        const auto handle = body->getBroadphaseHandle();
+        bodies.push_back(Entry{
+            .body = body,
+            .group = handle->m_collisionFilterGroup,
+            .mask = handle->m_collisionFilterMask,
+        });
+    }
+    for (const auto& e : bodies)
+        from.removeRigidBody(e.body);
+    for (const auto& e : bodies)
+        to.addRigidBody(e.body, e.group, e.mask);
+    for (const auto c : constraints)
+        to.addConstraint(c);
+}
+
+double secondsNow() {
+    const std::chrono::duration<double> t = std::chrono::steady_clock::now().time_since_epoch();
+    return t.count();
+}
+
+glm::mat4 interpolate(const glm::mat4& a, const glm::mat4& b, float t) {
+    auto m = glm::mat4_cast(glm::slerp(
+                glm::quat_cast(glm::mat3(a)), glm::quat_cast(glm::mat3(b)), t));
+    m[3] = glm::vec4(glm::mix(glm::vec3(a[3]), glm::vec3(b[3]), t), 1.0f);
+    return m;
+}
+
+float shapeVolume(const saba::PMXRigidbody& rb) {
+    constexpr float pi = 3.14159265f;
+    const auto& s = rb.m_shapeSize;
+    switch (rb.m_shape) {
+    case saba::PMXRigidbody::Shape::Sphere:
+        return 4.0f / 3.0f * pi * s.x * s.x * s.x;
+    case saba::PMXRigidbody::Shape::Box:
+        return 8.0f * s.x * s.y * s.z;
+    case saba::PMXRigidbody::Shape::Capsule:
+        return pi * s.x * s.x * s.y + 4.0f / 3.0f * pi * s.x * s.x * s.x;
+    }
+    return 0.0f;
+}
+}
+
+// Holds the transform of a body on the physics thread, where Saba's motion
+// states can't read bones.
+class PhysicsController::FixedMotionState : public btMotionState {
+public:
+    void getWorldTransform(btTransform& transform) const override {
+        transform = this->transform;
+    }
+    void setWorldTransform(const btTransform& transform) override {
+        this->transform = transform;
+    }
+    btTransform transform;
+};
+
+struct PhysicsController::MtWorld {
+    std::unique_ptr<TaskScheduler> scheduler;
+    std::unique_ptr<btDefaultCollisionConfiguration> collisionConfig;
+    std::unique_ptr<btCollisionDispatcherMt> dispatcher;
+    std::unique_ptr<btDbvtBroadphase> broadphase;
+    std::unique_ptr<btConstraintSolverPoolMt> solverPool;
+    std::unique_ptr<btSequentialImpulseConstraintSolverMt> solver;
+    std::unique_ptr<btDiscreteDynamicsWorldMt> world;
+    std::unique_ptr<GroundFilterCallback> filterCallback;  // Used by both worlds.
+    btOverlapFilterCallback *sabaFilterCallback;
+};
+
+PhysicsController::PhysicsController() :
+    enabled_(false), activeBodies_(0), lodSize_(0.0f),
+    viewProjection_(1.0f), viewportSize_(1.0f), budget_(0.0), baseFPS_(30.0f), baseIterations_(10),
+    multithreaded_(false), subSteps_(0), quit_(false), shownCount_(0),
+    calmFrames_(0), asleep_(false), wakes_(0), seenWakes_(0), sleeps_(0),
+    suspendedSeconds_(0.0), totalSeconds_(0.0),
+    tier_(Tier::Full), cost_(0.0), overFrames_(0), underFrames_(0),
+    upFrames_(UpFrames), lastStepUp_(0), frame_(0), tierChanges_(0)
+{}
+
+PhysicsController::~PhysicsController() {
+    StopThread();
+    if (!mtWorld_)
+        return;
+    // Saba removes the bodies from its own world on destruction.
+    UseMultithreadedWorld(false);
+    model_->GetPhysicsManager()->GetMMDPhysics()->GetDynamicsWorld()->getPairCache()
+        ->setOverlapFilterCallback(mtWorld_->sabaFilterCallback);
+    btSetTaskScheduler(btGetSequentialTaskScheduler());
+    mtWorld_.reset();
+}
+
+bool PhysicsController::Create(
+        const saba::PMXFile& pmx, const std::shared_ptr<saba::MMDModel>& model) {
+    model_ = model;
+    auto physicsManager = model->GetPhysicsManager();
+    const auto rigidBodies = physicsManager->GetRigidBodys();
+    if (!physicsManager->GetMMDPhysics() || rigidBodies->size() != pmx.m_rigidbodies.size()) {
+        Err::Log("Rigid body data mismatch.  Fallback to Saba's physics update.");
+        return false;
+    }
+
+    auto nodeManager = model->GetNodeManager();
+    bodies_.clear();
+    for (size_t i = 0; i < pmx.m_rigidbodies.size(); ++i) {
+        const auto& rb = pmx.m_rigidbodies[i];
+        const bool validBone = rb.m_boneIndex >= 0 &&
+            static_cast<size_t>(rb.m_boneIndex) < nodeManager->GetNodeCount();
+        // Nodes and bodies are in the rest pose yet.
+        glm::mat4 offset(1.0f);
+        if (validBone) {
+            glm::mat4 world;
+            (*rigidBodies)[i]->GetRigidBody()->getWorldTransform().getOpenGLMatrix(
+                    glm::value_ptr(world));
+            offset = glm::inverse(nodeManager->GetMMDNode(rb.m_boneIndex)->GetGlobalTransform()) * world;
+        }
+        bodies_.push_back(Body{
+            .body = (*rigidBodies)[i].get(),
+            .node = validBone ? nodeManager->GetMMDNode(rb.m_boneIndex) : nullptr,
+            .name = rb.m_name,
+            .dynamic = rb.m_op != saba::PMXRigidbody::Operation::Static,
+            .lowPriority = false,
+            .disabled = false,
+            .group = rb.m_group,
+            .volume = shapeVolume(rb),
+            .chain = 0,
+            .simulated = true,
+            .wasActive = true,
+            .fade = 0,
+            .lastLocal = glm::mat4(1.0f),
+            .lastGlobal = glm::mat4(1.0f),
+            .sleepGlobal = glm::mat4(1.0f),
+            .offset = offset,
+            .inverseOffset = glm::inverse(offset),
+            .boneMerge = rb.m_op == saba::PMXRigidbody::Operation::DynamicAndBoneMerge,
+        });
+    }
+    SetLowPriorityGroups({});
+
+    // Dynamic bodies connected by joints make a chain, e.g. a strand of
+    // hair, and are switched by LOD together.
+    std::vector<uint32_t> roots(bodies_.size());
+    std::iota(roots.begin(), roots.end(), 0);
+    const auto find = [&roots](uint32_t i) {
+        while (roots[i] != i)
+            i = roots[i] = roots[roots[i]];
+        return i;
+    };
+    for (const auto& joint : pmx.m_joints) {
+        const auto a = joint.m_rigidbodyAIndex;
+        const auto b = joint.m_rigidbodyBIndex;
+        if (a < 0 || b < 0 || static_cast<size_t>(a) >= bodies_.size() ||
+                static_cast<size_t>(b) >= bodies_.size())
+            continue;
+        if (bodies_[a].dynamic && bodies_[b].dynamic)
+            roots[find(a)] = find(b);
+    }
+    chains_.clear();
+    std::vector<uint32_t> chainOf(bodies_.size(), UINT32_MAX);
+    for (uint32_t i = 0; i < bodies_.size(); ++i) {
+        if (!bodies_[i].dynamic)
+            continue;
+        auto& chain = chainOf[find(i)];
+        if (chain == UINT32_MAX) {
+            chain = static_cast<uint32_t>(chains_.size());
+            chains_.push_back(Chain{.bodies = {}, .visible = true});
+        }
+        bodies_[i].chain = chain;
+        chains_[chain].bodies.push_back(i);
+    }
+
+    drivers_.assign(bodies_.size(), glm::mat4(1.0f));
+    baseIterations_ = physicsManager->GetMMDPhysics()->GetDynamicsWorld()->getSolverInfo().m_numIterations;
+    enabled_ = true;
+    return true;
+}
+
+bool PhysicsController::IsEnabled() const {
+    return enabled_;
+}
+
+void PhysicsController::SetFPS(float fps) {
+    baseFPS_ = fps;
+    applyTier();
+}
+
+void PhysicsController::SetBudget(float milliseconds) {
+    budget_ = milliseconds / 1000.0;
+}
+
+void PhysicsController::SetLowPriorityGroups(const std::vector<int>& groups) {
+    // Groups are numbered from 1 as in PMX editors.  Without them, small
+    // dynamic bodies, typically accessories and hair tips, are low
+    // priority.
+    std::vector<float> volumes;
+    for (const auto& b : bodies_) {
+        if (b.dynamic)
+            volumes.push_back(b.volume);
+    }
+    float threshold = 0.0f;
+    if (!volumes.empty()) {
+        std::nth_element(volumes.begin(), volumes.begin() + volumes.size() / 2, volumes.end());
+        threshold = volumes[volumes.size() / 2] * 0.25f;
+    }
+    for (auto& b : bodies_) {
+        if (!groups.empty())
+            b.lowPriority = std::find(groups.cbegin(), groups.cend(), b.group + 1) != groups.cend();
+        else
+            b.lowPriority = b.volume < threshold;
+        b.lowPriority = b.lowPriority && b.dynamic;
+    }
+    applyTier();
+}
+
+void PhysicsController::SetDisabledBodies(
+        const std::vector<int>& groups, const std::vector<std::string>& patterns) {
+    const auto isDisabled = DisabledBodyFilter(groups, patterns);
+    size_t disabled = 0;
+    for (auto& b : bodies_) {
+        b.disabled = b.dynamic && isDisabled(b.group, b.name);
+        if (b.disabled)
+            ++disabled;
+    }
+    if (disabled != 0)
+        Info::Log("Disabled rigid bodies:", disabled, '/', bodies_.size());
+}
+
+std::function<bool(uint8_t, const std::string&)> PhysicsController::DisabledBodyFilter(
+        const std::vector<int>& groups, const std::vector<std::string>& patterns) {
+    std::vector<std::regex> regexes;
+    for (const auto& p : patterns) {
+        try {
+            regexes.emplace_back(p);
+        } catch (const std::regex_error& e) {
+            Err::Log("Invalid rigid body name pattern:", p, e.what());
+        }
+    }
+    return [groups, regexes](uint8_t group, const std::string& name) {
+        return std::find(groups.cbegin(), groups.cend(), group + 1) != groups.cend() ||
+            std::any_of(regexes.cbegin(), regexes.cend(),
+                    [&name](const std::regex& r) { return std::regex_search(name, r); });
+    };
+}
+
+void PhysicsController::SetLodSize(float pixels) {
+    lodSize_ = pixels;
+    for (auto& chain : chains_)
+        chain.visible = true;
+}
+
+void PhysicsController::SetView(const glm::mat4& viewProjection, const glm::vec2& viewportSize) {
+    viewProjection_ = viewProjection;
+    viewportSize_ = viewportSize;
+}
+
+void PhysicsController::SetThreads(unsigned int count) {
+    if (!enabled_ || mtWorld_)
+        return;
+    if (count == 0) {
+        count = bodies_.size() >= MtBodyThreshold ?
+            std::clamp(std::thread::hardware_concurrency(), 1u, MaxAutoThreads) : 1;
+    }
+    if (count <= 1)
+        return;
+    if (btGetCurrentThreadIndex() != 0) {
+        Err::Log("Multithreaded physics must be set up on the main thread.  Fallback to single thread.");
+        return;
+    }
+
+    auto mt = std::make_unique<MtWorld>();
+    mt->scheduler = std::make_unique<TaskScheduler>();
+    btSetTaskScheduler(mt->scheduler.get());
+    mt->scheduler->Start(count - 1);
+    mt->collisionConfig = std::make_unique<btDefaultCollisionConfiguration>();
+    mt->dispatcher = std::make_unique<btCollisionDispatcherMt>(mt->collisionConfig.get());
+    mt->broadphase = std::make_unique<btDbvtBroadphase>();
+    mt->solverPool = std::make_unique<btConstraintSolverPoolMt>(static_cast<int>(count));
+    mt->solver = std::make_unique<btSequentialImpulseConstraintSolverMt>();
+    mt->world = std::make_unique<btDiscreteDynamicsWorldMt>(
+            mt->dispatcher.get(), mt->broadphase.get(), mt->solverPool.get(),
+            mt->solver.get(), mt->collisionConfig.get());
+
+    // The ground is the only body Saba doesn't make from the model.
+    auto saba = model_->GetPhysicsManager()->GetMMDPhysics()->GetDynamicsWorld();
+    const btCollisionObject *ground = nullptr;
+    const auto& objects = saba->getCollisionObjectArray();
+    for (int i = 0; i < objects.size(); ++i) {
+        if (std::none_of(bodies_.cbegin(), bodies_.cend(),
+                    [&](const Body& b) { return b.body->GetRigidBody() == objects[i]; }))
+            ground = objects[i];
+    }
+    mt->filterCallback = std::make_unique<GroundFilterCallback>(ground);
+    mt->sabaFilterCallback = saba->getPairCache()->getOverlapFilterCallback();
+    saba->getPairCache()->setOverlapFilterCallback(mt->filterCallback.get());
+    mtWorld_ = std::move(mt);
+    UseMultithreadedWorld(true);
+    Info::Log("Physics threads:", count);
+}
+
+bool PhysicsController::UseMultithreadedWorld(bool use) {
+    if (!mtWorld_)
+        return false;
+    if (use == multithreaded_)
+        return true;
+    auto saba = model_->GetPhysicsManager()->GetMMDPhysics()->GetDynamicsWorld();
+    if (use)
+        moveWorld(*saba, *mtWorld_->world);
+    else
+        moveWorld(*mtWorld_->world, *saba);
+    multithreaded_ = use;
+    return true;
+}
+
+void PhysicsController::Wake() {
+    ++wakes_;
+}
+
+void PhysicsController::StartThread() {
+    if (!enabled_ || thread_.joinable())
+        return;
+
+    // Kinematic bodies are moved by transforms passed from the render
+    // side, instead of Saba's motion states, which read bones.
+    motionStates_.clear();
+    for (auto& b : bodies_) {
+        auto state = std::make_unique<FixedMotionState>();
+        state->transform = b.body->GetRigidBody()->getWorldTransform();
+        b.body->GetRigidBody()->setMotionState(state.get());
+        motionStates_.push_back(std::move(state));
+    }
+    inputs_.Reset(Inputs{
+        .globals = std::vector<glm::mat4>(bodies_.size(), glm::mat4(1.0f)),
+        .viewProjection = viewProjection_,
+        .viewportSize = viewportSize_,
+        .wakes = wakes_,
+    });
+    outputs_.Reset(Outputs{
+        .globals = std::vector<glm::mat4>(bodies_.size(), glm::mat4(1.0f)),
+        .active = std::vector<uint8_t>(bodies_.size(), 0),
+        .time = 0.0,
+    });
+    shown_[0] = shown_[1] = outputs_.Front();
+    shownCount_ = 0;
+    quit_.store(false);
+    thread_ = std::thread(&PhysicsController::threadMain, this);
+    Info::Log("Physics thread started");
+}
+
+void PhysicsController::StopThread() {
+    if (!thread_.joinable())
+        return;
+    quit_.store(true);
+    thread_.join();
+    for (const auto& b : bodies_)
+        b.body->SetActivation(b.simulated);  // Back to Saba's motion states.
+    motionStates_.clear();
+}
+
+void PhysicsController::Update(double elapsed) {
+    if (thread_.joinable()) {
+        exchangePoses();
+        return;
+    }
+    for (size_t i = 0; i < bodies_.size(); ++i)
+        drivers_[i] = bodies_[i].node ? bodies_[i].node->GetGlobalTransform() : glm::mat4(1.0f);
+    if (tick(elapsed, drivers_, viewProjection_, viewportSize_, wakes_, false))
+        followBodies();
+}
+
+void PhysicsController::Step(double elapsed) {
+    stepWorld(elapsed, nullptr);
+    followBodies();
+}
+
+std::vector<char> PhysicsController::GetSnapshot(uint64_t key) const {
+    if (!enabled_)
+        return {};
+
+    SnapshotHeader header = {
+        .magic = {},
+        .version = SnapshotVersion,
+        .bodyCount = static_cast<uint32_t>(bodies_.size()),
+        .key = key,
+    };
+    std::memcpy(header.magic, SnapshotMagic, sizeof(header.magic));
+    std::vector<SnapshotBody> states(bodies_.size());
+    for (size_t i = 0; i < bodies_.size(); ++i) {
+        const auto rb = bodies_[i].body->GetRigidBody();
+        auto& state = states[i];
+        rb->getWorldTransform().getOpenGLMatrix(state.transform);
+        for (int j = 0; j < 3; ++j) {
+            state.linearVelocity[j] = rb->getLinearVelocity()[j];
+            state.angularVelocity[j] = rb->getAngularVelocity()[j];
+        }
+    }
+
+    std::vector<char> data(sizeof(header) + states.size() * sizeof(SnapshotBody));
+    std::memcpy(data.data(), &header, sizeof(header));
+    std::memcpy(data.data() + sizeof(header), states.data(), states.size() * sizeof(SnapshotBody));
+    return data;
+}
+
+bool PhysicsController::RestoreSnapshot(const std::vector<char>& data, uint64_t key) {
+    if (!enabled_ || thread_.joinable())
+        return false;
+
+    SnapshotHeader header;
+    if (data.size() != sizeof(header) + bodies_.size() * sizeof(SnapshotBody))
+        return false;
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (std::memcmp(header.magic, SnapshotMagic, sizeof(header.magic)) != 0 ||
+            header.version != SnapshotVersion || header.key != key ||
+            header.bodyCount != bodies_.size())
+        return false;
+    std::vector<SnapshotBody> states(bodies_.size());
+    std::memcpy(states.data(), data.data() + sizeof(header), states.size() * sizeof(SnapshotBody));
+
+    for (size_t i = 0; i < bodies_.size(); ++i) {
+        auto& b = bodies_[i];
+        b.simulated = isActive(b);
+        b.body->SetActivation(b.simulated);
+        if (!b.dynamic || !b.simulated)
+            continue;  // Placed by their bones.
+        const auto& state = states[i];
+        btTransform transform;
+        transform.setFromOpenGLMatrix(state.transform);
+        auto rb = b.body->GetRigidBody();
+        rb->setWorldTransform(transform);
+        rb->setInterpolationWorldTransform(transform);
+        rb->setLinearVelocity(btVector3(
+                    state.linearVelocity[0], state.linearVelocity[1], state.linearVelocity[2]));
+        rb->setAngularVelocity(btVector3(
+                    state.angularVelocity[0], state.angularVelocity[1], state.angularVelocity[2]));
+        rb->setInterpolationLinearVelocity(rb->getLinearVelocity());
+        rb->setInterpolationAngularVelocity(rb->getAngularVelocity());
+        // Saba's bones follow the motion state, not the body.
+        if (auto motionState = rb->getMotionState())
+            motionState->setWorldTransform(transform);
+        rb->activate(true);
+    }
+    followBodies();
+    return true;
+}
+
+bool PhysicsController::SaveSnapshot(const std::filesystem::path& file, uint64_t key) const {
+    const auto data = GetSnapshot(key);
+    if (data.empty())
+        return false;
+    if (!Yommd::writeFile(file, data.data(), data.size())) {
+        Err::Log("Failed to write physics snapshot:", file);
+        return false;
+    }
+    return true;
+}
+
+bool PhysicsController::LoadSnapshot(const std::filesystem::path& file, uint64_t key) {
+    if (!enabled_ || thread_.joinable())
+        return false;
+
+    std::ifstream in(file, std::ios::binary);
+    if (!in)
+        return false;
+    const std::vector<char> data{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    return RestoreSnapshot(data, key);
+}
+
+bool PhysicsController::IsAsleep() const {
+    return asleep_;
+}
+
+size_t PhysicsController::GetActiveBodyCount() const {
+    return activeBodies_;
+}
+
+int PhysicsController::GetSubStepCount() const {
+    return subSteps_;
+}
+
+size_t PhysicsController::GetContactCount() const {
+    if (!enabled_)
+        return 0;
+    const auto dispatcher = world()->getDispatcher();
+    size_t contacts = 0;
+    for (int i = 0; i < dispatcher->getNumManifolds(); ++i)
+        contacts += dispatcher->getManifoldByIndexInternal(i)->getNumContacts();
+    return contacts;
+}
+
+PhysicsController::Tier PhysicsController::GetTier() const {
+    return tier_;
+}
+
+void PhysicsController::LogStats() const {
+    if (!enabled_)
+        return;
+    Info::Log("Physics tier:", tierName(tier_), "changed", tierChanges_, "times");
+    Info::Log("Simulated rigid bodies:", activeBodies_, '/', bodies_.size());
+    Info::Log("Physics suspended:", suspendedSeconds_, "s of", totalSeconds_, "s, slept",
+            sleeps_, "times");
+}
+
+btDiscreteDynamicsWorld *PhysicsController::world() const {
+    if (multithreaded_)
+        return mtWorld_->world.get();
+    return model_->GetPhysicsManager()->GetMMDPhysics()->GetDynamicsWorld();
+}
+
+bool PhysicsController::isActive(const Body& body) const {
+    if (!body.dynamic)
+        return true;
+    if (body.disabled || !chains_[body.chain].visible)
+        return false;
+    return !(body.lowPriority && tier_ >= Tier::NoLowPriority);
+}
+
+void PhysicsController::updateLod(const glm::mat4& viewProjection, const glm::vec2& viewportSize) {
+    // Projected size of the bounding sphere of each chain, in pixels.
+    const auto project = [&](const glm::vec3& p) -> std::optional<glm::vec2> {
+        const auto clip = viewProjection * glm::vec4(p, 1.0f);
+        if (clip.w <= 0.0f)
+            return std::nullopt;
+        return glm::vec2(clip) / clip.w * viewportSize * 0.5f;
+    };
+    for (auto& chain : chains_) {
+        glm::vec3 center(0.0f);
+        for (const auto i : chain.bodies) {
+            const auto& origin = bodies_[i].body->GetRigidBody()->getWorldTransform().getOrigin();
+            center += glm::vec3(origin.x(), origin.y(), origin.z());
+        }
+        center /= static_cast<float>(chain.bodies.size());
+        float radius = 0.0f;
+        for (const auto i : chain.bodies) {
+            const auto& origin = bodies_[i].body->GetRigidBody()->getWorldTransform().getOrigin();
+            const float size = std::cbrt(bodies_[i].volume);
+            radius = std::max(radius,
+                    glm::distance(center, glm::vec3(origin.x(), origin.y(), origin.z())) + size);
+        }
+
+        float pixels = 0.0f;
+        const auto c = project(center);
+        const auto x = project(center + glm::vec3(radius, 0.0f, 0.0f));
+        const auto y = project(center + glm::vec3(0.0f, radius, 0.0f));
+        if (c && x && y)
+            pixels = 2.0f * std::max(glm::distance(*c, *x), glm::distance(*c, *y));
+
+        if (chain.visible)
+            chain.visible = pixels >= lodSize_;
+        else
+            chain.visible = pixels >= lodSize_ * LodHysteresis;
+    }
+}
+
+bool PhysicsController::tick(double elapsed, const std::vector<glm::mat4>& drivers,
+        const glm::mat4& viewProjection, const glm::vec2& viewportSize, uint64_t wakes,
+        bool threaded) {
+    ++frame_;
+    totalSeconds_ += elapsed;
+    subSteps_ = 0;
+    if (tier_ == Tier::Frozen) {
+        // Physics bones follow the animation, blended from where their
+        // bodies were.  On the physics thread, exchangePoses() does it.
+        if (!threaded) {
+            for (auto& b : bodies_) {
+                if (b.dynamic)
+                    updateFade(b, false);
+            }
+            fadeOut();
+        }
+        govern(0.0, drivers);
+        return false;
+    }
+
+    const auto begin = std::chrono::steady_clock::now();
+    if (lodSize_ > 0.0f)
+        updateLod(viewProjection, viewportSize);
+    if (updateSleep(elapsed, drivers, wakes)) {
+        // Bodies stay where they are.  Keep their bones there too.
+        suspendedSeconds_ += elapsed;
+        return true;
+    }
+    stepWorld(elapsed, threaded ? &drivers : nullptr);
+    const std::chrono::duration<double> cost = std::chrono::steady_clock::now() - begin;
+    govern(cost.count(), drivers);
+    return true;
+}
+
+void PhysicsController::stepWorld(double elapsed, const std::vector<glm::mat4> *drivers) {
+    auto physics = model_->GetPhysicsManager()->GetMMDPhysics();
+
+    // Same as saba::PMXModel::UpdatePhysicsAnimation(), except that
+    // inactive bodies are left kinematic to follow their bones.
+    activeBodies_ = 0;
+    for (size_t i = 0; i < bodies_.size(); ++i) {
+        auto& b = bodies_[i];
+        b.simulated = isActive(b);
+        if (b.simulated && b.dynamic)
+            ++activeBodies_;
+        if (!drivers) {
+            b.body->SetActivation(b.simulated);
+            continue;
+        }
+        // Same as Saba's kinematic motion state, with the given bone.
+        auto rb = b.body->GetRigidBody();
+        if (b.simulated && b.dynamic) {
+            rb->setCollisionFlags(rb->getCollisionFlags() & ~btCollisionObject::CF_KINEMATIC_OBJECT);
+        } else {
+            rb->setCollisionFlags(rb->getCollisionFlags() | btCollisionObject::CF_KINEMATIC_OBJECT);
+            if (b.node) {
+                const auto transform = (*drivers)[i] * b.offset;
+                motionStates_[i]->transform.setFromOpenGLMatrix(glm::value_ptr(transform));
+            }
+        }
+    }
+    // Same as saba::MMDPhysics::Update(), on the world in use.
+    subSteps_ = world()->stepSimulation(static_cast<btScalar>(elapsed),
+            physics->GetMaxSubStepCount(), static_cast<btScalar>(1.0f / physics->GetFPS()));
+}
+
+void PhysicsController::threadMain() {
+    using Clock = std::chrono::steady_clock;
+    auto physics = model_->GetPhysicsManager()->GetMMDPhysics();
+    auto next = Clock::now();
+    bool hasInputs = false;
+    while (!quit_.load()) {
+        // At the simulation rate, which the governor may lower.
+        const double step = 1.0 / physics->GetFPS();
+        next += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(step));
+        const auto now = Clock::now();
+        if (next + std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(step * MaxThreadLag)) < now)
+            next = now;  // Too far behind.  Drop the steps.
+        std::this_thread::sleep_until(next);
+
+        hasInputs = inputs_.Read() || hasInputs;
+        if (!hasInputs)
+            continue;  // Wait for the first pose.
+        const auto& in = inputs_.Front();
+        const bool follow = tick(step, in.globals, in.viewProjection, in.viewportSize, in.wakes, true);
+
+        auto& out = outputs_.Back();
+        for (size_t i = 0; i < bodies_.size(); ++i) {
+            const auto& b = bodies_[i];
+            out.active[i] = follow && b.simulated && b.dynamic && b.node;
+            if (!out.active[i])
+                continue;
+            // Same as saba::MMDRigidBody::ReflectGlobalTransform().
+            glm::mat4 world;
+            b.body->GetRigidBody()->getWorldTransform().getOpenGLMatrix(glm::value_ptr(world));
+            out.globals[i] = world * b.inverseOffset;
+            if (b.boneMerge)
+                out.globals[i][3] = in.globals[i][3];
+        }
+        out.time = secondsNow();
+        outputs_.Publish();
+    }
+}
+
+void PhysicsController::exchangePoses() {
+    // The animated pose for the next step.
+    auto& in = inputs_.Back();
+    for (size_t i = 0; i < bodies_.size(); ++i)
+        in.globals[i] = bodies_[i].node ? bodies_[i].node->GetGlobalTransform() : glm::mat4(1.0f);
+    in.viewProjection = viewProjection_;
+    in.viewportSize = viewportSize_;
+    in.wakes = wakes_;
+    inputs_.Publish();
+
+    if (outputs_.Read()) {
+        std::swap(shown_[0], shown_[1]);
+        shown_[1] = outputs_.Front();
+        shownCount_ = std::min(shownCount_ + 1, 2u);
+    }
+    if (shownCount_ == 0)
+        return;  // Bones follow the animation until the first step.
+
+    // Show the pose one step behind, between the last two results.
+    const auto& prev = shown_[shownCount_ == 2 ? 0 : 1];
+    const auto& cur = shown_[1];
+    const double span = cur.time - prev.time;
+    const float t = span > 0.0 ?
+        static_cast<float>(std::clamp((secondsNow() - cur.time) / span, 0.0, 1.0)) : 1.0f;
+    for (size_t i = 0; i < bodies_.size(); ++i) {
+        if (!cur.active[i])
+            continue;
+        bodies_[i].node->SetGlobalTransform(prev.active[i] ?
+                interpolate(prev.globals[i], cur.globals[i], t) : cur.globals[i]);
+    }
+    // Same as saba::MMDRigidBody::CalcLocalTransform().
+    for (size_t i = 0; i < bodies_.size(); ++i) {
+        if (!cur.active[i])
+            continue;
+        const auto node = bodies_[i].node;
+        const auto parent = node->GetParent();
+        node->SetLocalTransform(parent ?
+                glm::inverse(parent->GetGlobalTransform()) * node->GetGlobalTransform() :
+                node->GetGlobalTransform());
+    }
+    for (size_t i = 0; i < bodies_.size(); ++i) {
+        if (bodies_[i].dynamic)
+            updateFade(bodies_[i], cur.active[i]);
+    }
+    fadeOut();
+}
+
+bool PhysicsController::updateSleep(
+        double elapsed, const std::vector<glm::mat4>& drivers, uint64_t wakes) {
+    bool calm = wakes == seenWakes_;
+    seenWakes_ = wakes;
+
+    const auto distance = [](const glm::mat4& a, const glm::mat4& b) {
+        return glm::distance(glm::vec3(a[3]), glm::vec3(b[3]));
+    };
+    const auto angle = [](const glm::mat4& a, const glm::mat4& b) {
+        const float cosHalf = std::abs(glm::dot(
+                    glm::quat_cast(glm::mat3(a)), glm::quat_cast(glm::mat3(b))));
+        return 2.0f * std::acos(std::min(cosHalf, 1.0f));
+    };
+
+    // Bones moving kinematic bodies.
+    const float dt = std::max(static_cast<float>(elapsed), 1e-6f);
+    for (size_t i = 0; i < bodies_.size(); ++i) {
+        auto& b = bodies_[i];
+        const bool active = isActive(b);
+        if (active != b.simulated)
+            calm = false;  // LOD, a tier or the settings changed.
+        if ((active && b.dynamic) || !b.node)
+            continue;
+        const auto& global = drivers[i];
+        if (distance(global, b.lastGlobal) / dt > SleepLinearSpeed ||
+                angle(global, b.lastGlobal) / dt > SleepAngularSpeed)
+            calm = false;
+        if (asleep_ && (distance(global, b.sleepGlobal) > SleepLinearDrift ||
+                    angle(global, b.sleepGlobal) > SleepAngularDrift))
+            calm = false;
+        b.lastGlobal = global;
+    }
+    if (!calm) {
+        asleep_ = false;
+        calmFrames_ = 0;
+        return false;
+    }
+    if (asleep_)
+        return true;
+
+    // Simulated bodies, as of the last step.
+    const bool settled = std::all_of(bodies_.cbegin(), bodies_.cend(), [this](const Body& b) {
+        if (!b.dynamic || !isActive(b))
+            return true;
+        const auto rb = b.body->GetRigidBody();
+        return rb->getLinearVelocity().length() <= SleepLinearSpeed &&
+            rb->getAngularVelocity().length() <= SleepAngularSpeed;
+    });
+    calmFrames_ = settled ? calmFrames_ + 1 : 0;
+    if (calmFrames_ >= SleepFrames) {
+        asleep_ = true;
+        ++sleeps_;
+        for (auto& b : bodies_)
+            b.sleepGlobal = b.lastGlobal;
+    }
+    return asleep_;
+}
+
+void PhysicsController::followBodies() {
+    const auto rigidBodies = model_->GetPhysicsManager()->GetRigidBodys();
+    for (auto& rb : *rigidBodies)
+        rb->ReflectGlobalTransform();
+    for (auto& rb : *rigidBodies)
+        rb->CalcLocalTransform();
+    for (auto& b : bodies_) {
+        if (b.dynamic)
+            updateFade(b, b.simulated);
+    }
+    fadeOut();
+}
+
+void PhysicsController::updateFade(Body& body, bool shown) {
+    if (body.wasActive && !shown)
+        body.fade = FadeFrames;
+    body.wasActive = shown;
+}
+
+void PhysicsController::fadeOut() {
+    // Bones of bodies just made kinematic jump from the simulated pose to
+    // the animation.  Blend them over a few frames instead.
+    for (auto& b : bodies_) {
+        if (!b.node)
+            continue;
+        if (b.fade == 0) {
+            if (b.wasActive && b.dynamic)
+                b.lastLocal = b.node->GetLocalTransform();
+            continue;
+        }
+        const float t = 1.0f - static_cast<float>(b.fade) / (FadeFrames + 1);
+        b.node->SetLocalTransform(interpolate(b.lastLocal, b.node->GetLocalTransform(), t));
+        --b.fade;
+    }
+}
+
+void PhysicsController::govern(double cost, const std::vector<glm::mat4>& drivers) {
+    if (budget_ <= 0.0)
+        return;
+
+    cost_ += (cost - cost_) * SmoothingFactor;
+    overFrames_ = cost_ > budget_ ? overFrames_ + 1 : 0;
+    underFrames_ = cost_ < budget_ * Headroom ? underFrames_ + 1 : 0;
+
+    if (overFrames_ >= DownFrames && tier_ != Tier::Frozen) {
+        // Stepping up was premature.  Wait longer next time.
+        if (lastStepUp_ != 0 && frame_ - lastStepUp_ < upFrames_)
+            upFrames_ = std::min(upFrames_ * 2, MaxUpFrames);
+        setTier(static_cast<Tier>(static_cast<int>(tier_) + 1), drivers);
+    } else if (underFrames_ >= upFrames_ && tier_ != Tier::Full) {
+        lastStepUp_ = frame_;
+        setTier(static_cast<Tier>(static_cast<int>(tier_) - 1), drivers);
+        // The cost of the higher tier is unknown yet.
+        cost_ = budget_ * Headroom;
+    } else if (frame_ - lastStepUp_ > MaxUpFrames) {
+        upFrames_ = UpFrames;
+    }
+}
+
+void PhysicsController::setTier(Tier tier, const std::vector<glm::mat4>& drivers) {
+    Info::Log("Physics tier:", tierName(tier_), "->", tierName(tier) + std::string(";"),
+            "cost", cost_ * 1000.0, "ms, budget", budget_ * 1000.0, "ms");
+    if (tier_ == Tier::Frozen) {
+        // Bodies stayed where physics stopped while bones kept moving.
+        // Restart them from the current pose.  Uses the given bones rather
+        // than the nodes, which the main thread owns while physics runs on
+        // its own thread.
+        for (size_t i = 0; i < bodies_.size(); ++i) {
+            const auto& b = bodies_[i];
+            if (!b.dynamic)
+                continue;
+            auto rb = b.body->GetRigidBody();
+            if (b.node) {
+                const auto global = drivers[i] * b.offset;
+                btTransform transform;
+                transform.setFromOpenGLMatrix(glm::value_ptr(global));
+                rb->setWorldTransform(transform);
+                rb->setInterpolationWorldTransform(transform);
+                // Saba's motion state, or ours while on the thread.
+                rb->getMotionState()->setWorldTransform(transform);
+            }
+            rb->setLinearVelocity(btVector3(0, 0, 0));
+            rb->setAngularVelocity(btVector3(0, 0, 0));
+        }
+    }
+    tier_ = tier;
+    overFrames_ = underFrames_ = 0;
+    ++tierChanges_;
+    applyTier();
+}
+
+void PhysicsController::applyTier() {
+    if (!enabled_)
+        return;
+    auto physics = model_->GetPhysicsManager()->GetMMDPhysics();
+    auto& solverInfo = world()->getSolverInfo();
+    solverInfo.m_numIterations = tier_ >= Tier::FewerIterations ?
+        std::max(baseIterations_ / 2, 1) : baseIterations_;
+    physics->SetFPS(tier_ >= Tier::LowerRate ? baseFPS_ * 0.5f : baseFPS_);
+}
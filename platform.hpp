@@ -9,7 +9,12 @@
 #  endif
 #endif
 
-#if !(defined(PLATFORM_MAC) || defined(PLATFORM_WINDOWS))
+// Only headless tools, e.g. yoMMD-physbench, build on Linux.
+#if defined(__linux__)
+#  define PLATFORM_LINUX
+#endif
+
+#if !(defined(PLATFORM_MAC) || defined(PLATFORM_WINDOWS) || defined(PLATFORM_LINUX))
 #  error "Failed to detect platform."
 #endif
 
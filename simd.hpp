@@ -0,0 +1,152 @@
+#ifndef SIMD_HPP_
+#define SIMD_HPP_
+
+// Loops over structure of arrays, processing Simd::Lanes floats at once
+// with NEON, SSE2, or scalar code as a fallback.  Internal to .cpp files.
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#if defined(__ARM_NEON)
+#  include <arm_neon.h>
+#  define SIMD_NEON
+#elif defined(__SSE2__) || defined(_M_X64)
+#  include <emmintrin.h>
+#  define SIMD_SSE2
+#endif
+
+namespace Simd {
+// Lanes processed at once.  Arrays are padded to a multiple of this.
+constexpr size_t Lanes = 4;
+
+inline size_t padded(size_t n) {
+    return (n + Lanes - 1) / Lanes * Lanes;
+}
+
+namespace Detail {
+// Weights are given per element when "PerLane", or one for all.
+template <bool PerLane>
+inline void lerpArray(const float *src, float *dst, size_t count, const float *w) {
+#if defined(SIMD_NEON)
+    for (size_t i = 0; i < count; i += Lanes) {
+        const float32x4_t vw = PerLane ? vld1q_f32(w + i) : vdupq_n_f32(*w);
+        const float32x4_t a = vld1q_f32(src + i);
+        const float32x4_t b = vld1q_f32(dst + i);
+        vst1q_f32(dst + i, vmlaq_f32(a, vsubq_f32(b, a), vw));
+    }
+#elif defined(SIMD_SSE2)
+    for (size_t i = 0; i < count; i += Lanes) {
+        const __m128 vw = PerLane ? _mm_loadu_ps(w + i) : _mm_set1_ps(*w);
+        const __m128 a = _mm_loadu_ps(src + i);
+        const __m128 b = _mm_loadu_ps(dst + i);
+        _mm_storeu_ps(dst + i, _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), vw)));
+    }
+#else
+    for (size_t i = 0; i < count; ++i) {
+        const float wi = PerLane ? w[i] : *w;
+        dst[i] = src[i] + (dst[i] - src[i]) * wi;
+    }
+#endif
+}
+
+template <bool PerLane>
+inline void nlerpArray(const std::array<std::vector<float>, 4>& src,
+        std::array<std::vector<float>, 4>& dst, size_t count, const float *w) {
+#if defined(SIMD_NEON)
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    for (size_t i = 0; i < count; i += Lanes) {
+        const float32x4_t wb = PerLane ? vld1q_f32(w + i) : vdupq_n_f32(*w);
+        const float32x4_t wa = vsubq_f32(one, wb);
+        float32x4_t a[4], b[4];
+        for (int c = 0; c < 4; ++c) {
+            a[c] = vld1q_f32(src[c].data() + i);
+            b[c] = vld1q_f32(dst[c].data() + i);
+        }
+        float32x4_t dot = vmulq_f32(a[0], b[0]);
+        for (int c = 1; c < 4; ++c)
+            dot = vmlaq_f32(dot, a[c], b[c]);
+        const float32x4_t wbs = vbslq_f32(vcltq_f32(dot, zero), vnegq_f32(wb), wb);
+        float32x4_t r[4];
+        float32x4_t len2 = zero;
+        for (int c = 0; c < 4; ++c) {
+            r[c] = vmlaq_f32(vmulq_f32(a[c], wa), b[c], wbs);
+            len2 = vmlaq_f32(len2, r[c], r[c]);
+        }
+        const float32x4_t inv = vdivq_f32(one, vsqrtq_f32(len2));
+        for (int c = 0; c < 4; ++c)
+            vst1q_f32(dst[c].data() + i, vmulq_f32(r[c], inv));
+    }
+#elif defined(SIMD_SSE2)
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 signBit = _mm_set1_ps(-0.0f);
+    const __m128 zero = _mm_setzero_ps();
+    for (size_t i = 0; i < count; i += Lanes) {
+        const __m128 wb = PerLane ? _mm_loadu_ps(w + i) : _mm_set1_ps(*w);
+        const __m128 wa = _mm_sub_ps(one, wb);
+        __m128 a[4], b[4];
+        for (int c = 0; c < 4; ++c) {
+            a[c] = _mm_loadu_ps(src[c].data() + i);
+            b[c] = _mm_loadu_ps(dst[c].data() + i);
+        }
+        __m128 dot = _mm_mul_ps(a[0], b[0]);
+        for (int c = 1; c < 4; ++c)
+            dot = _mm_add_ps(dot, _mm_mul_ps(a[c], b[c]));
+        const __m128 wbs = _mm_xor_ps(wb, _mm_and_ps(_mm_cmplt_ps(dot, zero), signBit));
+        __m128 r[4];
+        __m128 len2 = zero;
+        for (int c = 0; c < 4; ++c) {
+            r[c] = _mm_add_ps(_mm_mul_ps(a[c], wa), _mm_mul_ps(b[c], wbs));
+            len2 = _mm_add_ps(len2, _mm_mul_ps(r[c], r[c]));
+        }
+        const __m128 inv = _mm_div_ps(one, _mm_sqrt_ps(len2));
+        for (int c = 0; c < 4; ++c)
+            _mm_storeu_ps(dst[c].data() + i, _mm_mul_ps(r[c], inv));
+    }
+#else
+    for (size_t i = 0; i < count; ++i) {
+        const float wi = PerLane ? w[i] : *w;
+        float dot = 0.0f;
+        for (int c = 0; c < 4; ++c)
+            dot += src[c][i] * dst[c][i];
+        const float wbs = dot < 0.0f ? -wi : wi;
+        float r[4];
+        float len2 = 0.0f;
+        for (int c = 0; c < 4; ++c) {
+            r[c] = src[c][i] * (1.0f - wi) + dst[c][i] * wbs;
+            len2 += r[c] * r[c];
+        }
+        const float inv = 1.0f / std::sqrt(len2);
+        for (int c = 0; c < 4; ++c)
+            dst[c][i] = r[c] * inv;
+    }
+#endif
+}
+}
+
+// dst = mix(src, dst, w)
+inline void lerpArray(const float *src, float *dst, size_t count, float w) {
+    Detail::lerpArray<false>(src, dst, count, &w);
+}
+
+// Same as above, with a weight per element.
+inline void lerpArray(const float *src, float *dst, size_t count, const float *w) {
+    Detail::lerpArray<true>(src, dst, count, w);
+}
+
+// dst = normalize(src * (1 - w) + dst * w), taking the shorter arc.
+inline void nlerpArray(const std::array<std::vector<float>, 4>& src,
+        std::array<std::vector<float>, 4>& dst, size_t count, float w) {
+    Detail::nlerpArray<false>(src, dst, count, &w);
+}
+
+// Same as above, with a weight per element.
+inline void nlerpArray(const std::array<std::vector<float>, 4>& src,
+        std::array<std::vector<float>, 4>& dst, size_t count, const float *w) {
+    Detail::nlerpArray<true>(src, dst, count, w);
+}
+}
+
+#endif
@@ -0,0 +1,443 @@
+#include <algorithm>
+#include <memory>
+#include <numeric>
+#include <vector>
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDNode.h"
+#include "Saba/Model/MMD/PMXFile.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include "simd.hpp"
+#include "yommd.hpp"
+
+namespace {
+enum AppendFlag : uint8_t {
+    AppendRotate = 1 << 0,
+    AppendTranslate = 1 << 1,
+    AppendLocal = 1 << 2,
+};
+
+bool hasFlag(const saba::PMXBone& bone, saba::PMXBoneFlags flag) {
+    return (static_cast<uint16_t>(bone.m_boneFlag) & static_cast<uint16_t>(flag)) != 0;
+}
+
+// out = a * b.  "out" must not alias "a" or "b".
+void mulMat4(const glm::mat4& a, const glm::mat4& b, glm::mat4& out) {
+#if defined(SIMD_NEON)
+    const float32x4_t a0 = vld1q_f32(&a[0][0]);
+    const float32x4_t a1 = vld1q_f32(&a[1][0]);
+    const float32x4_t a2 = vld1q_f32(&a[2][0]);
+    const float32x4_t a3 = vld1q_f32(&a[3][0]);
+    for (int j = 0; j < 4; ++j) {
+        float32x4_t r = vmulq_n_f32(a0, b[j][0]);
+        r = vmlaq_n_f32(r, a1, b[j][1]);
+        r = vmlaq_n_f32(r, a2, b[j][2]);
+        r = vmlaq_n_f32(r, a3, b[j][3]);
+        vst1q_f32(&out[j][0], r);
+    }
+#elif defined(SIMD_SSE2)
+    const __m128 a0 = _mm_loadu_ps(&a[0][0]);
+    const __m128 a1 = _mm_loadu_ps(&a[1][0]);
+    const __m128 a2 = _mm_loadu_ps(&a[2][0]);
+    const __m128 a3 = _mm_loadu_ps(&a[3][0]);
+    for (int j = 0; j < 4; ++j) {
+        __m128 r = _mm_mul_ps(a0, _mm_set1_ps(b[j][0]));
+        r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_set1_ps(b[j][1])));
+        r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_set1_ps(b[j][2])));
+        r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_set1_ps(b[j][3])));
+        _mm_storeu_ps(&out[j][0], r);
+    }
+#else
+    out = a * b;
+#endif
+}
+}
+
+Skeleton::Skeleton() :
+    enabled_(false), ik_(nullptr)
+{}
+
+bool Skeleton::Create(const saba::PMXFile& pmx, const std::shared_ptr<saba::MMDModel>& model) {
+    auto nodeManager = model->GetNodeManager();
+    const size_t boneCount = pmx.m_bones.size();
+    if (nodeManager->GetNodeCount() != boneCount) {
+        Err::Log("Bone data mismatch.  Fallback to Saba's node update.");
+        return false;
+    }
+
+    const auto isValidBone = [boneCount](int32_t index) {
+        return index >= 0 && static_cast<size_t>(index) < boneCount;
+    };
+
+    // Flatten the hierarchy in depth-first pre-order, so that parents come
+    // before children and every subtree is a contiguous range.
+    std::vector<std::vector<uint32_t>> children(boneCount);
+    std::vector<uint32_t> roots;
+    for (size_t i = 0; i < boneCount; ++i) {
+        const int32_t parent = pmx.m_bones[i].m_parentBoneIndex;
+        if (isValidBone(parent) && static_cast<size_t>(parent) != i)
+            children[parent].push_back(static_cast<uint32_t>(i));
+        else
+            roots.push_back(static_cast<uint32_t>(i));
+    }
+
+    std::vector<uint32_t> order;
+    std::vector<bool> visited(boneCount, false);
+    std::vector<uint32_t> stack;
+    const auto visit = [&](uint32_t root) {
+        stack.push_back(root);
+        while (!stack.empty()) {
+            const uint32_t bone = stack.back();
+            stack.pop_back();
+            if (visited[bone])
+                continue;
+            visited[bone] = true;
+            order.push_back(bone);
+            for (auto itr = children[bone].crbegin(); itr != children[bone].crend(); ++itr)
+                stack.push_back(*itr);
+        }
+    };
+    for (const auto root : roots)
+        visit(root);
+    for (size_t i = 0; i < boneCount; ++i) {
+        // Bones in a parent cycle.  Treat them as roots.
+        if (!visited[i]) {
+            Err::Log("Cyclic bone hierarchy detected:", pmx.m_bones[i].m_name);
+            roots.push_back(static_cast<uint32_t>(i));
+            visit(static_cast<uint32_t>(i));
+        }
+    }
+
+    flatIndices_.resize(boneCount);
+    for (size_t i = 0; i < boneCount; ++i)
+        flatIndices_[order[i]] = static_cast<uint32_t>(i);
+    std::vector<bool> isRoot(boneCount, false);
+    for (const auto root : roots)
+        isRoot[root] = true;
+
+    nodes_.resize(boneCount);
+    parents_.resize(boneCount);
+    appendSources_.assign(boneCount, -1);
+    appendWeights_.assign(boneCount, 0.0f);
+    appendFlags_.assign(boneCount, 0);
+    initialTranslates_.resize(boneCount);
+    inverseInits_.resize(boneCount);
+    for (size_t i = 0; i < boneCount; ++i) {
+        const size_t boneIndex = order[i];
+        const auto& bone = pmx.m_bones[boneIndex];
+        nodes_[i] = nodeManager->GetMMDNode(boneIndex);
+        parents_[i] = isRoot[boneIndex] ? -1 : static_cast<int32_t>(flatIndices_[bone.m_parentBoneIndex]);
+        inverseInits_[i] = nodes_[i]->GetInverseInitTransform();
+
+        auto translate = bone.m_position;
+        if (parents_[i] >= 0)
+            translate -= pmx.m_bones[bone.m_parentBoneIndex].m_position;
+        initialTranslates_[i] = Yommd::toRightHanded(translate);
+
+        if (isValidBone(bone.m_appendBoneIndex)) {
+            uint8_t flags = 0;
+            if (hasFlag(bone, saba::PMXBoneFlags::AppendRotate))
+                flags |= AppendRotate;
+            if (hasFlag(bone, saba::PMXBoneFlags::AppendTranslate))
+                flags |= AppendTranslate;
+            if (flags != 0 && hasFlag(bone, saba::PMXBoneFlags::AppendLocal))
+                flags |= AppendLocal;
+            if (flags != 0) {
+                appendSources_[i] = static_cast<int32_t>(flatIndices_[bone.m_appendBoneIndex]);
+                appendWeights_[i] = bone.m_appendWeight;
+                appendFlags_[i] = flags;
+            }
+        }
+    }
+
+    subtreeEnds_.resize(boneCount);
+    for (size_t i = boneCount; i-- > 0;) {
+        uint32_t end = static_cast<uint32_t>(i + 1);
+        for (const auto child : children[order[i]]) {
+            if (parents_[flatIndices_[child]] == static_cast<int32_t>(i))
+                end = std::max(end, subtreeEnds_[flatIndices_[child]]);
+        }
+        subtreeEnds_[i] = end;
+    }
+
+    // Deform order, the same as saba::PMXModel's: sorted by deform depth, and
+    // split into before/after physics.
+    std::vector<uint32_t> deformOrder(boneCount);
+    std::iota(deformOrder.begin(), deformOrder.end(), 0);
+    std::stable_sort(deformOrder.begin(), deformOrder.end(), [&pmx](uint32_t a, uint32_t b) {
+        return pmx.m_bones[a].m_deformDepth < pmx.m_bones[b].m_deformDepth;
+    });
+    for (auto& o : deformOrders_)
+        o.clear();
+    for (const auto boneIndex : deformOrder) {
+        const bool afterPhysics = hasFlag(pmx.m_bones[boneIndex], saba::PMXBoneFlags::DeformAfterPhysics);
+        deformOrders_[afterPhysics ? 1 : 0].push_back(flatIndices_[boneIndex]);
+    }
+
+    // Bones moved by physics.  Their local transforms are read back from
+    // Saba after the physics update.
+    physicsBones_.clear();
+    for (const auto& rb : pmx.m_rigidbodies) {
+        if (rb.m_op != saba::PMXRigidbody::Operation::Static && isValidBone(rb.m_boneIndex))
+            physicsBones_.push_back(flatIndices_[rb.m_boneIndex]);
+    }
+
+    // Bones that matter regardless of motions: skinned ones, ones with an IK
+    // or physics role, and targets of bone morphs.
+    required_.assign(boneCount, 0);
+    const auto require = [&](int32_t boneIndex) {
+        if (isValidBone(boneIndex))
+            required_[flatIndices_[boneIndex]] = 1;
+    };
+    for (const auto& v : pmx.m_vertices) {
+        const int weightCount = v.m_weightType == saba::PMXVertexWeight::BDEF1 ? 1 :
+            (v.m_weightType == saba::PMXVertexWeight::BDEF2 ||
+             v.m_weightType == saba::PMXVertexWeight::SDEF) ? 2 : 4;
+        for (int k = 0; k < weightCount; ++k) {
+            if (weightCount != 4 || v.m_boneWeights[k] != 0.0f)
+                require(v.m_boneIndices[k]);
+        }
+    }
+    for (size_t i = 0; i < boneCount; ++i) {
+        const auto& bone = pmx.m_bones[i];
+        if (!hasFlag(bone, saba::PMXBoneFlags::IK))
+            continue;
+        require(static_cast<int32_t>(i));
+        require(bone.m_ikTargetBoneIndex);
+        for (const auto& link : bone.m_ikLinks)
+            require(link.m_ikBoneIndex);
+    }
+    for (const auto& rb : pmx.m_rigidbodies)
+        require(rb.m_boneIndex);
+    for (const auto& morph : pmx.m_morphs) {
+        for (const auto& b : morph.m_boneMorph)
+            require(b.m_boneIndex);
+    }
+    live_.assign(boneCount, 1);
+    liveBones_.resize(boneCount);
+    std::iota(liveBones_.begin(), liveBones_.end(), 0);
+    liveDeformOrders_ = deformOrders_;
+
+    ikChains_.assign(boneCount, -1);
+    enableIk_.assign(boneCount, 0);
+    animTranslates_.assign(boneCount, glm::vec3(0.0f));
+    animRotates_.assign(boneCount, glm::quat(1, 0, 0, 0));
+    scales_.assign(boneCount, glm::vec3(1.0f));
+    ikRotates_.assign(boneCount, glm::quat(1, 0, 0, 0));
+    appendRotates_.assign(boneCount, glm::quat(1, 0, 0, 0));
+    appendTranslates_.assign(boneCount, glm::vec3(0.0f));
+    locals_.resize(boneCount);
+    globals_.resize(boneCount);
+    palette_.resize(boneCount);
+    for (size_t i = 0; i < boneCount; ++i) {
+        locals_[i] = nodes_[i]->GetLocalTransform();
+        globals_[i] = nodes_[i]->GetGlobalTransform();
+        palette_[i] = globals_[i] * inverseInits_[i];
+    }
+
+    enabled_ = true;
+    return true;
+}
+
+void Skeleton::SetIkStage(IkStage *ik) {
+    ik_ = ik;
+    std::fill(ikChains_.begin(), ikChains_.end(), -1);
+    std::fill(enableIk_.begin(), enableIk_.end(), 0);
+    if (!ik_)
+        return;
+    for (size_t c = 0; c < ik_->GetChainCount(); ++c) {
+        ikChains_[ik_->GetIkBone(c)] = static_cast<int32_t>(c);
+        for (const auto link : ik_->GetLinkBones(c))
+            enableIk_[link] = 1;
+    }
+}
+
+bool Skeleton::IsEnabled() const {
+    return enabled_;
+}
+
+size_t Skeleton::GetBoneCount() const {
+    return nodes_.size();
+}
+
+uint32_t Skeleton::FindIndex(size_t boneIndex) const {
+    return flatIndices_[boneIndex];
+}
+
+size_t Skeleton::Prune(const std::vector<bool>& animated) {
+    const size_t boneCount = nodes_.size();
+    std::fill(live_.begin(), live_.end(), 0);
+    for (size_t boneIndex = 0; boneIndex < animated.size() && boneIndex < boneCount; ++boneIndex) {
+        if (animated[boneIndex])
+            live_[flatIndices_[boneIndex]] = 1;
+    }
+    for (size_t i = 0; i < boneCount; ++i)
+        live_[i] |= required_[i];
+
+    // A live bone needs its ancestors and its append source.  Ancestors come
+    // first in the flattened order, but append sources may be anywhere.
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = boneCount; i-- > 0;) {
+            if (!live_[i])
+                continue;
+            for (const int32_t dep : {parents_[i], appendSources_[i]}) {
+                if (dep >= 0 && !live_[dep]) {
+                    live_[dep] = 1;
+                    changed |= static_cast<size_t>(dep) > i;
+                }
+            }
+        }
+    }
+
+    liveBones_.clear();
+    for (size_t i = 0; i < boneCount; ++i) {
+        if (live_[i])
+            liveBones_.push_back(static_cast<uint32_t>(i));
+    }
+    for (size_t phase = 0; phase < deformOrders_.size(); ++phase) {
+        liveDeformOrders_[phase].clear();
+        for (const auto i : deformOrders_[phase]) {
+            if (live_[i])
+                liveDeformOrders_[phase].push_back(i);
+        }
+    }
+    return boneCount - liveBones_.size();
+}
+
+void Skeleton::UpdateNodeAnimation(bool afterPhysicsAnim) {
+    const auto& deformOrder = liveDeformOrders_[afterPhysicsAnim ? 1 : 0];
+
+    if (!afterPhysicsAnim) {
+        gatherInputs();
+        std::fill(ikRotates_.begin(), ikRotates_.end(), glm::quat(1, 0, 0, 0));
+        if (ik_)
+            ik_->BeginFrame();
+    } else {
+        for (const auto i : physicsBones_)
+            locals_[i] = nodes_[i]->GetLocalTransform();
+    }
+
+    for (const auto i : deformOrder)
+        UpdateLocalTransform(i);
+    for (const auto i : liveBones_)
+        updateGlobalTransform(i);
+
+    // Append and IK pass, in deform order.
+    for (const auto i : deformOrder) {
+        if (appendFlags_[i] != 0) {
+            updateAppendTransform(i);
+            UpdateLocalTransform(i);
+            UpdateGlobalTransform(i);
+        }
+        if (ikChains_[i] >= 0 && ik_) {
+            ik_->SolveChain(*this, ikChains_[i]);
+            UpdateGlobalTransform(i);
+        }
+    }
+
+    if (afterPhysicsAnim) {
+        for (const auto i : liveBones_)
+            mulMat4(globals_[i], inverseInits_[i], palette_[i]);
+    }
+
+    // Saba's physics and camera still refer nodes.
+    for (const auto i : liveBones_) {
+        nodes_[i]->SetLocalTransform(locals_[i]);
+        nodes_[i]->SetGlobalTransform(globals_[i]);
+    }
+}
+
+const glm::mat4 *Skeleton::GetPalette() const {
+    return palette_.data();
+}
+
+const glm::mat4& Skeleton::GetGlobalTransform(size_t i) const {
+    return globals_[i];
+}
+
+int32_t Skeleton::GetParent(size_t i) const {
+    return parents_[i];
+}
+
+glm::quat Skeleton::GetAnimateRotate(size_t i) const {
+    return animRotates_[i];
+}
+
+glm::quat Skeleton::GetIkRotate(size_t i) const {
+    return ikRotates_[i];
+}
+
+void Skeleton::SetIkRotate(size_t i, const glm::quat& q) {
+    ikRotates_[i] = q;
+}
+
+void Skeleton::UpdateLocalTransform(size_t i) {
+    glm::vec3 t = animTranslates_[i];
+    glm::quat r = animRotates_[i];
+    if (enableIk_[i])
+        r = ikRotates_[i] * r;
+    if (appendFlags_[i] & AppendRotate)
+        r = r * appendRotates_[i];
+    if (appendFlags_[i] & AppendTranslate)
+        t += appendTranslates_[i];
+
+    // translate(t) * mat4_cast(r) * scale(s)
+    const auto& s = scales_[i];
+    auto& m = locals_[i];
+    m = glm::mat4_cast(r);
+    m[0] *= s.x;
+    m[1] *= s.y;
+    m[2] *= s.z;
+    m[3] = glm::vec4(t, 1.0f);
+}
+
+void Skeleton::UpdateGlobalTransform(size_t i) {
+    const size_t end = subtreeEnds_[i];
+    for (size_t j = i; j < end; ++j) {
+        if (live_[j])
+            updateGlobalTransform(j);
+    }
+}
+
+void Skeleton::gatherInputs() {
+    for (const auto i : liveBones_) {
+        const auto node = nodes_[i];
+        animTranslates_[i] = node->AnimateTranslate();
+        animRotates_[i] = node->AnimateRotate();
+        scales_[i] = node->GetScale();
+    }
+}
+
+void Skeleton::updateAppendTransform(size_t i) {
+    const auto flags = appendFlags_[i];
+    const auto src = static_cast<size_t>(appendSources_[i]);
+    const bool srcHasAppend = appendFlags_[src] != 0;
+
+    if (flags & AppendRotate) {
+        glm::quat q;
+        if (!(flags & AppendLocal) && srcHasAppend)
+            q = appendRotates_[src];
+        else
+            q = animRotates_[src];
+        if (enableIk_[src])
+            q = ikRotates_[src] * q;
+        appendRotates_[i] = glm::slerp(glm::quat(1, 0, 0, 0), q, appendWeights_[i]);
+    }
+    if (flags & AppendTranslate) {
+        glm::vec3 t;
+        if (!(flags & AppendLocal) && srcHasAppend)
+            t = appendTranslates_[src];
+        else
+            t = animTranslates_[src] - initialTranslates_[src];
+        appendTranslates_[i] = t * appendWeights_[i];
+    }
+}
+
+void Skeleton::updateGlobalTransform(size_t i) {
+    const int32_t parent = parents_[i];
+    if (parent < 0)
+        globals_[i] = locals_[i];
+    else
+        mulMat4(globals_[parent], locals_[i], globals_[i]);
+}
@@ -0,0 +1,261 @@
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDNode.h"
+#include "Saba/Model/MMD/PMXFile.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include "yommd.hpp"
+
+Skinning::Skinning() :
+    enabled_(false), activeEnd_(0)
+{}
+
+bool Skinning::Create(
+        const saba::PMXFile& pmx,
+        const std::shared_ptr<saba::MMDModel>& model,
+        const Skeleton& skeleton) {
+    using WeightType = saba::PMXVertexWeight;
+
+    const size_t nodeCount = skeleton.GetBoneCount();
+    const size_t vertexCount = pmx.m_vertices.size();
+    if (!skeleton.IsEnabled() || model->GetVertexCount() != vertexCount) {
+        Err::Log("Vertex data mismatch.  Fallback to Saba's skinning.");
+        return false;
+    }
+
+    // Bone indices refer the skeleton's flattened order.
+    const auto boneIndex = [nodeCount, &skeleton](int32_t index) {
+        return static_cast<int>(skeleton.FindIndex(
+                    index >= 0 && static_cast<size_t>(index) < nodeCount ? index : 0));
+    };
+
+    types_.reserve(vertexCount);
+    boneIndices_.reserve(vertexCount);
+    boneWeights_.reserve(vertexCount);
+    sdefIndices_.reserve(vertexCount);
+    basePositions_.reserve(vertexCount);
+    baseNormals_.reserve(vertexCount);
+    baseUVs_.reserve(vertexCount);
+    for (const auto& v : pmx.m_vertices) {
+        basePositions_.push_back(Yommd::toRightHanded(v.m_position));
+        baseNormals_.push_back(Yommd::toRightHanded(v.m_normal));
+        baseUVs_.emplace_back(v.m_uv.x, 1.0f - v.m_uv.y);  // Textures are flipped at load.
+
+        glm::ivec4 indices(0);
+        glm::vec4 weights(0.0f);
+        uint32_t sdefIndex = 0;
+        switch (v.m_weightType) {
+        case WeightType::BDEF1:
+            types_.push_back(Type::BDEF1);
+            indices.x = boneIndex(v.m_boneIndices[0]);
+            weights.x = 1.0f;
+            break;
+        case WeightType::BDEF2:
+            types_.push_back(Type::BDEF2);
+            indices.x = boneIndex(v.m_boneIndices[0]);
+            indices.y = boneIndex(v.m_boneIndices[1]);
+            weights.x = v.m_boneWeights[0];
+            weights.y = 1.0f - v.m_boneWeights[0];
+            break;
+        case WeightType::SDEF: {
+            types_.push_back(Type::SDEF);
+            indices.x = boneIndex(v.m_boneIndices[0]);
+            indices.y = boneIndex(v.m_boneIndices[1]);
+            weights.x = v.m_boneWeights[0];
+            weights.y = 1.0f - v.m_boneWeights[0];
+
+            // Same as what saba::PMXModel does.
+            const auto center = Yommd::toRightHanded(v.m_sdefC);
+            auto r0 = Yommd::toRightHanded(v.m_sdefR0);
+            auto r1 = Yommd::toRightHanded(v.m_sdefR1);
+            const auto rw = r0 * weights.x + r1 * weights.y;
+            r0 = center + r0 - rw;
+            r1 = center + r1 - rw;
+            sdefIndex = static_cast<uint32_t>(sdefParams_.size());
+            sdefParams_.push_back(SdefParam{
+                .center = center,
+                .cr0 = (center + r0) * 0.5f,
+                .cr1 = (center + r1) * 0.5f,
+            });
+            break;
+        }
+        case WeightType::BDEF4:
+        case WeightType::QDEF:  // No dual quaternion skinning yet.  Use BDEF4 instead.
+        default:
+            types_.push_back(Type::BDEF4);
+            for (int i = 0; i < 4; ++i) {
+                indices[i] = boneIndex(v.m_boneIndices[i]);
+                weights[i] = v.m_boneIndices[i] < 0 ? 0.0f : v.m_boneWeights[i];
+            }
+            break;
+        }
+        boneIndices_.push_back(indices);
+        boneWeights_.push_back(weights);
+        sdefIndices_.push_back(sdefIndex);
+    }
+
+    positions_ = basePositions_;
+    normals_ = baseNormals_;
+    uvs_ = baseUVs_;
+
+    // Vertices referred by each material, to skip the ones only hidden
+    // materials use.
+    materialVertices_.clear();
+    size_t faceVertex = 0;
+    for (const auto& material : pmx.m_materials) {
+        std::vector<uint32_t> vertices;
+        const size_t end = std::min(
+                faceVertex + std::max(material.m_numFaceVertices, 0),
+                pmx.m_faces.size() * 3);
+        for (; faceVertex < end; ++faceVertex) {
+            const uint32_t v = pmx.m_faces[faceVertex / 3].m_vertices[faceVertex % 3];
+            if (v < vertexCount)
+                vertices.push_back(v);
+        }
+        std::sort(vertices.begin(), vertices.end());
+        vertices.erase(std::unique(vertices.begin(), vertices.end()), vertices.end());
+        materialVertices_.push_back(std::move(vertices));
+    }
+    visibleMaterials_.clear();
+    activeRanges_ = {{0, static_cast<uint32_t>(vertexCount)}};
+    activeEnd_ = static_cast<uint32_t>(vertexCount);
+
+    enabled_ = true;
+    return true;
+}
+
+void Skinning::Update(
+        const Skeleton& skeleton,
+        const std::vector<glm::vec4>& positionOffsets,
+        const std::vector<glm::vec4>& uvOffsets) {
+    const glm::mat4 *palette = skeleton.GetPalette();
+
+    for (const auto& [begin, end] : activeRanges_) {
+        for (size_t i = begin; i < end; ++i)
+            updateVertex(skeleton, palette, i, positionOffsets[i], uvOffsets[i]);
+    }
+}
+
+void Skinning::Update(
+        const Skeleton& skeleton,
+        const std::vector<glm::vec4>& positionOffsets,
+        const std::vector<glm::vec4>& uvOffsets,
+        size_t begin, size_t end) {
+    const glm::mat4 *palette = skeleton.GetPalette();
+
+    // The first range ending after "begin".
+    auto range = std::upper_bound(activeRanges_.cbegin(), activeRanges_.cend(), begin,
+            [](size_t v, const auto& r) { return v < r.second; });
+    for (; range != activeRanges_.cend() && range->first < end; ++range) {
+        const size_t last = std::min<size_t>(range->second, end);
+        for (size_t i = std::max<size_t>(range->first, begin); i < last; ++i)
+            updateVertex(skeleton, palette, i, positionOffsets[i], uvOffsets[i]);
+    }
+}
+
+void Skinning::UpdateVisibility(const MorphEngine& morph) {
+    // Material morphs change visibility only occasionally, so ranges are
+    // rebuilt only when it changes.
+    const size_t materialCount = materialVertices_.size();
+    bool changed = visibleMaterials_.size() != materialCount;
+    visibleMaterials_.resize(materialCount);
+    for (size_t i = 0; i < materialCount; ++i) {
+        const bool visible = morph.GetMaterial(i).m_alpha != 0.0f;
+        if (visibleMaterials_[i] != visible) {
+            visibleMaterials_[i] = visible;
+            changed = true;
+        }
+    }
+    if (!changed)
+        return;
+
+    std::vector<bool> active(types_.size(), false);
+    for (size_t i = 0; i < materialCount; ++i) {
+        if (visibleMaterials_[i]) {
+            for (const auto v : materialVertices_[i])
+                active[v] = true;
+        }
+    }
+    activeRanges_.clear();
+    activeEnd_ = 0;
+    for (uint32_t i = 0; i < active.size();) {
+        if (!active[i]) {
+            ++i;
+            continue;
+        }
+        const uint32_t begin = i;
+        while (i < active.size() && active[i])
+            ++i;
+        activeRanges_.emplace_back(begin, i);
+        activeEnd_ = i;
+    }
+}
+
+uint32_t Skinning::GetActiveVertexCount() const {
+    return activeEnd_;
+}
+
+void Skinning::updateVertex(
+        const Skeleton& skeleton, const glm::mat4 *palette, size_t i,
+        const glm::vec4& positionOffset, const glm::vec4& uvOffset) {
+    const auto& indices = boneIndices_[i];
+    const auto& weights = boneWeights_[i];
+    const glm::vec3 pos = basePositions_[i] + glm::vec3(positionOffset);
+    const glm::vec3& normal = baseNormals_[i];
+
+    switch (types_[i]) {
+    case Type::BDEF1: {
+        const auto& m = palette[indices.x];
+        positions_[i] = glm::vec3(m * glm::vec4(pos, 1.0f));
+        normals_[i] = glm::normalize(glm::mat3(m) * normal);
+        break;
+    }
+    case Type::BDEF2: {
+        const auto m = palette[indices.x] * weights.x + palette[indices.y] * weights.y;
+        positions_[i] = glm::vec3(m * glm::vec4(pos, 1.0f));
+        normals_[i] = glm::normalize(glm::mat3(m) * normal);
+        break;
+    }
+    case Type::BDEF4: {
+        const auto m =
+            palette[indices.x] * weights.x + palette[indices.y] * weights.y +
+            palette[indices.z] * weights.z + palette[indices.w] * weights.w;
+        positions_[i] = glm::vec3(m * glm::vec4(pos, 1.0f));
+        normals_[i] = glm::normalize(glm::mat3(m) * normal);
+        break;
+    }
+    case Type::SDEF: {
+        const auto& sdef = sdefParams_[sdefIndices_[i]];
+        const auto& m0 = palette[indices.x];
+        const auto& m1 = palette[indices.y];
+        const auto q0 = glm::quat_cast(glm::mat3(skeleton.GetGlobalTransform(indices.x)));
+        const auto q1 = glm::quat_cast(glm::mat3(skeleton.GetGlobalTransform(indices.y)));
+        const auto rot = glm::mat3_cast(glm::slerp(q0, q1, weights.y));
+        positions_[i] = rot * (pos - sdef.center) +
+            glm::vec3(m0 * glm::vec4(sdef.cr0, 1.0f)) * weights.x +
+            glm::vec3(m1 * glm::vec4(sdef.cr1, 1.0f)) * weights.y;
+        normals_[i] = rot * normal;
+        break;
+    }
+    }
+
+    uvs_[i] = baseUVs_[i] + glm::vec2(uvOffset);
+}
+
+bool Skinning::IsEnabled() const {
+    return enabled_;
+}
+
+const glm::vec3 *Skinning::GetPositions() const {
+    return positions_.data();
+}
+
+const glm::vec3 *Skinning::GetNormals() const {
+    return normals_.data();
+}
+
+const glm::vec2 *Skinning::GetUVs() const {
+    return uvs_.data();
+}
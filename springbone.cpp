@@ -0,0 +1,400 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <vector>
+#include "Saba/Model/MMD/MMDModel.h"
+#include "Saba/Model/MMD/MMDNode.h"
+#include "Saba/Model/MMD/MMDPhysics.h"
+#include "Saba/Model/MMD/PMXFile.h"
+#include "btBulletDynamicsCommon.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include "glm/gtc/type_ptr.hpp"
+#include "simd.hpp"
+#include "yommd.hpp"
+
+namespace {
+using Simd::Lanes;
+// Damping and stiffness are given per step at this rate, and converted for
+// the actual frame time.
+constexpr float BaseFPS = 60.0f;
+// Longer frames are simulated as this long, e.g. after a hitch.
+constexpr float MaxStep = 1.0f / 30.0f;
+// Fraction of the distance to the animated pose recovered per base step.
+constexpr float Stiffness = 0.04f;
+constexpr float MinDrag = 0.05f;
+constexpr float MaxDrag = 0.95f;
+// Bodies centered on their bone can't tell its direction.
+constexpr float MinLength = 1e-4f;
+// Joints let particles this much nearer or farther than at rest.
+constexpr float LinkSlack = 0.1f;
+
+// Time corrected verlet:
+//   p' = p + (p - q) * keep * ratio + acc,  q' = p
+void integrate(float *p, float *q, const float *keep, size_t count, float ratio, float acc) {
+#if defined(SIMD_NEON)
+    const float32x4_t vr = vdupq_n_f32(ratio);
+    const float32x4_t va = vdupq_n_f32(acc);
+    for (size_t i = 0; i < count; i += Lanes) {
+        const float32x4_t vp = vld1q_f32(p + i);
+        const float32x4_t vq = vld1q_f32(q + i);
+        const float32x4_t vk = vmulq_f32(vld1q_f32(keep + i), vr);
+        vst1q_f32(p + i, vaddq_f32(vmlaq_f32(vp, vsubq_f32(vp, vq), vk), va));
+        vst1q_f32(q + i, vp);
+    }
+#elif defined(SIMD_SSE2)
+    const __m128 vr = _mm_set1_ps(ratio);
+    const __m128 va = _mm_set1_ps(acc);
+    for (size_t i = 0; i < count; i += Lanes) {
+        const __m128 vp = _mm_loadu_ps(p + i);
+        const __m128 vq = _mm_loadu_ps(q + i);
+        const __m128 vk = _mm_mul_ps(_mm_loadu_ps(keep + i), vr);
+        _mm_storeu_ps(p + i, _mm_add_ps(_mm_add_ps(vp, _mm_mul_ps(_mm_sub_ps(vp, vq), vk)), va));
+        _mm_storeu_ps(q + i, vp);
+    }
+#else
+    for (size_t i = 0; i < count; ++i) {
+        const float next = p[i] + (p[i] - q[i]) * keep[i] * ratio + acc;
+        q[i] = p[i];
+        p[i] = next;
+    }
+#endif
+}
+
+glm::mat4 worldTransform(const btRigidBody *body) {
+    glm::mat4 m;
+    body->getWorldTransform().getOpenGLMatrix(glm::value_ptr(m));
+    return m;
+}
+
+// Rotation taking the direction "from" to "to".
+glm::quat rotationBetween(const glm::vec3& from, const glm::vec3& to) {
+    const float lengths = std::sqrt(glm::dot(from, from) * glm::dot(to, to));
+    if (lengths <= 0.0f)
+        return glm::quat(1, 0, 0, 0);
+    const float w = lengths + glm::dot(from, to);
+    if (w <= lengths * 1e-6f)
+        return glm::quat(1, 0, 0, 0);  // Opposite.  Leave it to the next frame.
+    return glm::normalize(glm::quat(w, glm::cross(from, to)));
+}
+
+glm::mat4 withTranslation(glm::mat4 m, const glm::vec3& t) {
+    m[3] = glm::vec4(t, 1.0f);
+    return m;
+}
+}
+
+SpringBones::SpringBones() :
+    enabled_(false), gravity_(0.0f, -9.8f * 5.0f, 0.0f), lastStep_(0.0f), needsReset_(true)
+{}
+
+bool SpringBones::Create(
+        const saba::PMXFile& pmx, const std::shared_ptr<saba::MMDModel>& model) {
+    auto physicsManager = model->GetPhysicsManager();
+    const auto rigidBodies = physicsManager->GetRigidBodys();
+    if (rigidBodies->size() != pmx.m_rigidbodies.size())
+        return false;
+
+    // Nodes and bodies are in the rest pose until the first update.
+    auto nodeManager = model->GetNodeManager();
+    const auto nodeOf = [&nodeManager](int32_t boneIndex) -> saba::MMDNode * {
+        if (boneIndex < 0 || static_cast<size_t>(boneIndex) >= nodeManager->GetNodeCount())
+            return nullptr;
+        return nodeManager->GetMMDNode(boneIndex);
+    };
+    const auto radiusOf = [](const saba::PMXRigidbody& rb) {
+        const auto& s = rb.m_shapeSize;
+        return rb.m_shape == saba::PMXRigidbody::Shape::Box ? std::min({s.x, s.y, s.z}) : s.x;
+    };
+
+    particles_.clear();
+    links_.clear();
+    colliders_.clear();
+    std::map<const saba::MMDNode *, uint32_t> particleOf;
+    std::vector<const saba::MMDNode *> particleNodes(pmx.m_rigidbodies.size(), nullptr);
+    for (size_t i = 0; i < pmx.m_rigidbodies.size(); ++i) {
+        const auto& rb = pmx.m_rigidbodies[i];
+        const auto node = nodeOf(rb.m_boneIndex);
+        if (!node)
+            continue;
+        const auto body = worldTransform((*rigidBodies)[i]->GetRigidBody());
+        const auto offset = glm::inverse(node->GetGlobalTransform()) * body;
+
+        if (rb.m_op == saba::PMXRigidbody::Operation::Static) {
+            // Boxes become capsules along their longest axis.
+            glm::vec3 s = rb.m_shapeSize;
+            glm::mat4 axes(1.0f);
+            float radius = s.x;
+            float halfLength = 0.0f;
+            if (rb.m_shape == saba::PMXRigidbody::Shape::Capsule) {
+                halfLength = s.y * 0.5f;
+            } else if (rb.m_shape == saba::PMXRigidbody::Shape::Box) {
+                const int longest = s.x >= s.y && s.x >= s.z ? 0 : (s.y >= s.z ? 1 : 2);
+                std::swap(axes[1], axes[longest]);
+                std::swap(s[1], s[longest]);
+                radius = std::max(s.x, s.z);
+                halfLength = std::max(s.y - radius, 0.0f);
+            }
+            colliders_.push_back(Collider{
+                .node = node,
+                .offset = offset * axes,
+                .radius = radius,
+                .halfLength = halfLength,
+                .group = rb.m_group,
+                .mask = rb.m_collisionGroup,
+            });
+            continue;
+        }
+        particleNodes[i] = node;
+        if (particleOf.contains(node))
+            continue;  // One particle per bone.
+
+        const glm::vec3 center(offset[3]);
+        particleOf[node] = static_cast<uint32_t>(particles_.size());
+        particles_.push_back(Particle{
+            .node = node,
+            .parent = -1,
+            .depth = 0,
+            .center = center,
+            .length = glm::length(center),
+            .radius = radiusOf(rb),
+            .drag = std::clamp(rb.m_translateDimmer, MinDrag, MaxDrag),
+            .group = rb.m_group,
+            .mask = rb.m_collisionGroup,
+            .colliders = {},
+            .global = node->GetGlobalTransform(),
+            .name = rb.m_name,
+            .disabled = false,
+        });
+    }
+
+    // Parents first.
+    for (auto& p : particles_) {
+        for (auto n = p.node->GetParent(); n; n = n->GetParent())
+            ++p.depth;
+    }
+    std::stable_sort(particles_.begin(), particles_.end(),
+            [](const Particle& a, const Particle& b) { return a.depth < b.depth; });
+    for (uint32_t i = 0; i < particles_.size(); ++i)
+        particleOf[particles_[i].node] = i;
+    for (auto& p : particles_) {
+        const auto parent = particleOf.find(p.node->GetParent());
+        if (parent != particleOf.end())
+            p.parent = static_cast<int32_t>(parent->second);
+    }
+
+    // Joints along the bone hierarchy are already kept by the distance from
+    // the head.
+    for (const auto& joint : pmx.m_joints) {
+        const auto bodyA = joint.m_rigidbodyAIndex;
+        const auto bodyB = joint.m_rigidbodyBIndex;
+        if (bodyA < 0 || bodyB < 0 || static_cast<size_t>(bodyA) >= particleNodes.size() ||
+                static_cast<size_t>(bodyB) >= particleNodes.size())
+            continue;
+        const auto a = particleOf.find(particleNodes[bodyA]);
+        const auto b = particleOf.find(particleNodes[bodyB]);
+        if (a == particleOf.end() || b == particleOf.end() || a->second == b->second)
+            continue;
+        const auto& pa = particles_[a->second];
+        const auto& pb = particles_[b->second];
+        if (pa.parent == static_cast<int32_t>(b->second) ||
+                pb.parent == static_cast<int32_t>(a->second))
+            continue;
+        const glm::vec3 restA(pa.global * glm::vec4(pa.center, 1.0f));
+        const glm::vec3 restB(pb.global * glm::vec4(pb.center, 1.0f));
+        links_.push_back(Link{
+            .a = a->second,
+            .b = b->second,
+            .length = glm::distance(restA, restB),
+        });
+    }
+
+    // Same filter as Bullet's broadphase with Saba's groups and masks.
+    for (auto& p : particles_) {
+        for (uint32_t c = 0; c < colliders_.size(); ++c) {
+            const auto& col = colliders_[c];
+            if ((p.mask & (1u << col.group)) && (col.mask & (1u << p.group)))
+                p.colliders.push_back(c);
+        }
+    }
+
+    const size_t n = Simd::padded(particles_.size());
+    for (int c = 0; c < 3; ++c) {
+        positions_[c].assign(n, 0.0f);
+        prevPositions_[c].assign(n, 0.0f);
+    }
+    keeps_.assign(n, 0.0f);
+    animLocals_.resize(particles_.size());
+    colliderCenters_.resize(colliders_.size());
+    colliderAxes_.resize(colliders_.size());
+
+    enabled_ = !particles_.empty();
+    needsReset_ = true;
+    return enabled_;
+}
+
+bool SpringBones::IsEnabled() const {
+    return enabled_;
+}
+
+void SpringBones::SetGravity(float gravity) {
+    gravity_ = glm::vec3(0.0f, -gravity * 5.0f, 0.0f);  // Same scale as Saba's world.
+}
+
+void SpringBones::SetDisabledBodies(
+        const std::vector<int>& groups, const std::vector<std::string>& patterns) {
+    const auto isDisabled = PhysicsController::DisabledBodyFilter(groups, patterns);
+    size_t disabled = 0;
+    for (auto& p : particles_) {
+        p.disabled = isDisabled(p.group, p.name);
+        if (p.disabled)
+            ++disabled;
+    }
+    if (disabled != 0)
+        Info::Log("Disabled spring bones:", disabled, '/', particles_.size());
+}
+
+void SpringBones::Reset() {
+    needsReset_ = true;
+}
+
+size_t SpringBones::GetParticleCount() const {
+    return particles_.size();
+}
+
+void SpringBones::Update(double elapsed) {
+    if (!enabled_)
+        return;
+
+    // The animated pose, as left by the update before physics.
+    for (size_t i = 0; i < particles_.size(); ++i)
+        animLocals_[i] = particles_[i].node->GetLocalTransform();
+    for (size_t c = 0; c < colliders_.size(); ++c) {
+        const auto m = colliders_[c].node->GetGlobalTransform() * colliders_[c].offset;
+        colliderCenters_[c] = glm::vec3(m[3]);
+        colliderAxes_[c] = glm::vec3(m[1]) * colliders_[c].halfLength;
+    }
+
+    const float dt = std::min(static_cast<float>(elapsed), MaxStep);
+    if (needsReset_) {
+        solve(0.0f, true);
+        needsReset_ = false;
+        lastStep_ = 0.0f;
+    } else if (dt > 0.0f) {
+        const float frames = dt * BaseFPS;
+        for (size_t i = 0; i < particles_.size(); ++i)
+            keeps_[i] = std::pow(1.0f - particles_[i].drag, frames);
+        const float ratio = lastStep_ > 0.0f ? dt / lastStep_ : 0.0f;
+        const size_t count = Simd::padded(particles_.size());
+        for (int c = 0; c < 3; ++c)
+            integrate(positions_[c].data(), prevPositions_[c].data(), keeps_.data(),
+                    count, ratio, gravity_[c] * dt * dt);
+        solveLinks();
+        solve(1.0f - std::pow(1.0f - Stiffness, frames), false);
+        lastStep_ = dt;
+    } else {
+        solve(0.0f, false);
+    }
+
+    // Same as what saba::MMDRigidBody::CalcLocalTransform() does.
+    for (const auto& p : particles_) {
+        const auto parent = p.node->GetParent();
+        p.node->SetGlobalTransform(p.global);
+        p.node->SetLocalTransform(parent ?
+                glm::inverse(parentGlobal(p)) * p.global : p.global);
+    }
+}
+
+const glm::mat4& SpringBones::parentGlobal(const Particle& p) const {
+    if (p.parent >= 0)
+        return particles_[p.parent].global;
+    return p.node->GetParent()->GetGlobalTransform();
+}
+
+void SpringBones::solveLinks() {
+    const auto positionOf = [this](uint32_t i) {
+        return glm::vec3(positions_[0][i], positions_[1][i], positions_[2][i]);
+    };
+    for (const auto& link : links_) {
+        // Disabled particles are placed by their bones and don't move.
+        const float wa = particles_[link.a].disabled ? 0.0f : 1.0f;
+        const float wb = particles_[link.b].disabled ? 0.0f : 1.0f;
+        if (wa + wb == 0.0f)
+            continue;
+        auto a = positionOf(link.a);
+        auto b = positionOf(link.b);
+        const auto d = b - a;
+        const float dist = glm::length(d);
+        const float target = std::clamp(dist,
+                link.length * (1.0f - LinkSlack), link.length * (1.0f + LinkSlack));
+        if (dist <= 0.0f || dist == target)
+            continue;
+        const auto correction = d * ((dist - target) / dist / (wa + wb));
+        a += correction * wa;
+        b -= correction * wb;
+        for (int c = 0; c < 3; ++c) {
+            positions_[c][link.a] = a[c];
+            positions_[c][link.b] = b[c];
+        }
+    }
+}
+
+void SpringBones::solve(float stiffness, bool reset) {
+    for (size_t i = 0; i < particles_.size(); ++i) {
+        auto& p = particles_[i];
+        // Where the bone would be on the simulated parent.
+        const auto animated = p.node->GetParent() ?
+            parentGlobal(p) * animLocals_[i] : animLocals_[i];
+        const glm::vec3 head(animated[3]);
+        const glm::vec3 target(animated * glm::vec4(p.center, 1.0f));
+        if (p.length < MinLength) {
+            p.global = animated;
+            continue;
+        }
+        if (p.disabled) {
+            for (int c = 0; c < 3; ++c)
+                positions_[c][i] = prevPositions_[c][i] = target[c];
+            p.global = animated;
+            continue;
+        }
+
+        glm::vec3 pos(positions_[0][i], positions_[1][i], positions_[2][i]);
+        if (reset) {
+            pos = target;
+            for (int c = 0; c < 3; ++c)
+                prevPositions_[c][i] = target[c];
+        }
+        pos += (target - pos) * stiffness;
+
+        // Push out of kinematic bodies.
+        for (const auto c : p.colliders) {
+            const auto& a = colliderAxes_[c];
+            const auto base = colliderCenters_[c] - a;
+            const float len2 = glm::dot(a, a) * 4.0f;
+            const float t = len2 > 0.0f ?
+                std::clamp(glm::dot(pos - base, a * 2.0f) / len2, 0.0f, 1.0f) : 0.0f;
+            const auto closest = base + a * 2.0f * t;
+            const auto d = pos - closest;
+            const float r = colliders_[c].radius + p.radius;
+            const float dist2 = glm::dot(d, d);
+            if (dist2 < r * r && dist2 > 0.0f)
+                pos = closest + d * (r / std::sqrt(dist2));
+        }
+
+        // Keep the distance from the head.
+        const auto dir = pos - head;
+        const float dist = glm::length(dir);
+        if (dist > 0.0f)
+            pos = head + dir * (p.length / dist);
+        else
+            pos = target;
+        for (int c = 0; c < 3; ++c)
+            positions_[c][i] = pos[c];
+
+        const auto rotate = rotationBetween(target - head, pos - head);
+        p.global = withTranslation(glm::mat4_cast(rotate) * withTranslation(animated, glm::vec3(0.0f)),
+                head);
+    }
+}
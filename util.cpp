@@ -1,11 +1,23 @@
+#include <cstring>
+#include <fstream>
 #include <string>
 #include <sstream>
+#include <stdexcept>
 #include <vector>
 #include <iostream>
 #include <cstdlib>
+#include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtc/quaternion.hpp"
 #include "yommd.hpp"
 #include "platform.hpp"
 
+#ifndef PLATFORM_WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace {
 std::filesystem::path getHomePath();
 namespace globals {
@@ -15,6 +27,11 @@ Usage: yommd <options>
 options:
     --config <toml>     Specify config file
     --logfile <file>    Output logs to <file>
+    --fixed-step        Advance time exactly 1/FPS per frame (reproducible runs)
+    --seed <number>     Seed for random motion selection
+    --bench-physics <steps>
+                        Compare physics step times of single-threaded and
+                        multithreaded Bullet and spring bones, and exit
     -h|--help           Show this help
 )";
 const std::filesystem::path homePath = getHomePath();
@@ -28,6 +45,8 @@ CmdArgs CmdArgs::Parse(const std::vector<std::string>& args) {
 
     std::filesystem::path executable(args[0]);
     CmdArgs cmdArgs;
+    cmdArgs.fixedStep = false;
+    cmdArgs.benchPhysics = 0;
 
     cmdArgs.cwd = executable.parent_path();
 
@@ -53,6 +72,28 @@ CmdArgs CmdArgs::Parse(const std::vector<std::string>& args) {
                 Err::Log("Multiple log file specified.  Use the last one.");
             }
             cmdArgs.logFile = *itr;
+        } else if (*itr == "--fixed-step") {
+            cmdArgs.fixedStep = true;
+        } else if (*itr == "--seed") {
+            if (++itr == end) {
+                Err::Log("No number specified after \"--seed\"");
+                Err::Exit(globals::usage);
+            }
+            try {
+                cmdArgs.seed = static_cast<uint32_t>(std::stoul(*itr));
+            } catch (const std::exception&) {
+                Err::Exit("Invalid seed:", *itr, '\n', globals::usage);
+            }
+        } else if (*itr == "--bench-physics") {
+            if (++itr == end) {
+                Err::Log("No number specified after \"--bench-physics\"");
+                Err::Exit(globals::usage);
+            }
+            try {
+                cmdArgs.benchPhysics = static_cast<unsigned int>(std::stoul(*itr));
+            } catch (const std::exception&) {
+                Err::Exit("Invalid step count:", *itr, '\n', globals::usage);
+            }
         } else {
             Err::Exit("Unknown option:", *itr, '\n', globals::usage);
         }
@@ -123,6 +164,146 @@ void makeAbsolute(std::filesystem::path& path, const std::filesystem::path& cwd)
         path = cwd / path;
 }
 
+glm::vec3 toRightHanded(const glm::vec3& v) {
+    return v * glm::vec3(1, 1, -1);
+}
+
+glm::quat toRightHanded(const glm::quat& q) {
+    const auto invZ = glm::mat3(glm::scale(glm::mat4(1), glm::vec3(1, 1, -1)));
+    return glm::quat_cast(invZ * glm::mat3_cast(q) * invZ);
+}
+
+std::optional<uint64_t> hashFile(const std::filesystem::path& path) {
+    MappedFile file;
+    if (!file.Open(path))
+        return std::nullopt;
+    return hashBytes(file.Data(), file.Size());
+}
+
+uint64_t hashBytes(const void *data, size_t size, uint64_t hash) {
+    // FNV-1a over 8 bytes at a time, which is several times faster than
+    // byte by byte on large model files.  The shift folds the upper bits
+    // back since multiplication only carries upward.
+    constexpr uint64_t Prime = 0x100000001b3ull;
+    const auto p = static_cast<const uint8_t *>(data);
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, p + i, sizeof(word));
+        hash = (hash ^ word) * Prime;
+        hash ^= hash >> 32;
+    }
+    for (; i < size; ++i) {
+        hash ^= p[i];
+        hash *= Prime;
+    }
+    return hash;
+}
+
+bool writeFile(const std::filesystem::path& path, const void *data, size_t size) {
+    // Write to a temporary file first so that readers never see a partial
+    // file.
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    auto temp = path;
+    temp += ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        out.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+        if (!out) {
+            out.close();
+            std::filesystem::remove(temp, ec);
+            return false;
+        }
+    }
+    std::filesystem::rename(temp, path, ec);
+    if (ec) {
+        std::filesystem::remove(temp, ec);
+        return false;
+    }
+    return true;
+}
+
+std::filesystem::path getCachePath() {
+#ifdef PLATFORM_WINDOWS
+    const wchar_t *wpath = _wgetenv(L"XDG_CACHE_HOME");
+    std::filesystem::path path = wpath ? String::wideToMulti<char8_t>(wpath) : u8"~/.cache";
+#else
+    const char *cpath = std::getenv("XDG_CACHE_HOME");
+    std::filesystem::path path = cpath ? String::tou8(std::string_view(cpath)) : u8"~/.cache";
+#endif
+    makeAbsolute(path, std::filesystem::current_path());
+    return path / "yoMMD";
+}
+}
+
+MappedFile::MappedFile() :
+    data_(nullptr), size_(0)
+{}
+
+MappedFile::~MappedFile() {
+    Close();
+}
+
+bool MappedFile::Open(const std::filesystem::path& path) {
+    Close();
+#ifdef PLATFORM_WINDOWS
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+    // The view keeps the file and the mapping open.
+    HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!mapping)
+        return false;
+    void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!data)
+        return false;
+    size_ = static_cast<size_t>(size.QuadPart);
+#else
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);  // The mapping keeps the file open.
+    if (data == MAP_FAILED)
+        return false;
+    size_ = static_cast<size_t>(st.st_size);
+#endif
+    data_ = static_cast<const uint8_t *>(data);
+    return true;
+}
+
+void MappedFile::Close() {
+    if (!data_)
+        return;
+#ifdef PLATFORM_WINDOWS
+    UnmapViewOfFile(data_);
+#else
+    munmap(const_cast<uint8_t *>(data_), size_);
+#endif
+    data_ = nullptr;
+    size_ = 0;
+}
+
+const uint8_t *MappedFile::Data() const {
+    return data_;
+}
+
+size_t MappedFile::Size() const {
+    return size_;
 }
 
 namespace {
@@ -1,25 +1,25 @@
+#include <algorithm>
+#include <chrono>
 #include <ctime>
 #include <filesystem>
 #include <functional>
+#include <iomanip>
 #include <numeric>
 #include <optional>
 #include <memory>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <random>
+#include <sstream>
 #include "sokol_gfx.h"
 #include "sokol_time.h"
 #include "Saba/Base/Path.h"
 #include "Saba/Model/MMD/MMDCamera.h"
 #include "Saba/Model/MMD/MMDMaterial.h"
 #include "Saba/Model/MMD/MMDModel.h"
-#include "Saba/Model/MMD/MMDPhysics.h"
-#include "Saba/Model/MMD/PMDModel.h"
-#include "Saba/Model/MMD/PMXModel.h"
-#include "Saba/Model/MMD/VMDAnimation.h"
 #include "Saba/Model/MMD/VMDCameraAnimation.h"
 #include "Saba/Model/MMD/VMDFile.h"
-#include "btBulletDynamicsCommon.h"
 #include "yommd.hpp"
 #include "yommd.glsl.h"
 
@@ -36,72 +36,32 @@ const std::filesystem::path getXdgConfigHomePath() {
 #endif
     return "~/.config";
 }
-}
-
-Material::Material(const saba::MMDMaterial& mat) :
-    material(mat),
-    textureHasAlpha(false)
-{}
-
-void MMD::LoadModel(
-        const std::filesystem::path& modelPath,
-        const std::filesystem::path& resourcePath) {
-    const auto ext = std::filesystem::path(modelPath).extension();
-    if (ext == ".pmx") {
-        auto pmx = std::make_unique<saba::PMXModel>();
-        if (!pmx->Load(modelPath.string(), resourcePath.string())) {
-            Err::Exit("Failed to load PMX:", modelPath);
-        }
-        model_ = std::move(pmx);
-    } else if (ext == ".pmd") {
-        auto pmd = std::make_unique<saba::PMDModel>();
-        if (!pmd->Load(modelPath.string(), resourcePath.string())) {
-            Err::Exit("Failed to load PMD:", modelPath);
-        }
-        model_ = std::move(pmd);
-    } else {
-        Err::Exit("Unsupported MMD file:", modelPath);
-    }
-
-    model_->InitializeAnimation();
-}
 
-void MMD::LoadMotion(const std::vector<std::filesystem::path>& paths) {
-    std::unique_ptr<saba::VMDCameraAnimation> cameraAnim(nullptr);
-    auto vmdAnim = std::make_unique<saba::VMDAnimation>();
-    if (!vmdAnim->Create(model_)) {
-        Err::Exit("Failed to create VMDAnimation");
-    }
-
-    for (const auto& p : paths) {
-        saba::VMDFile vmdFile;
-        if (!saba::ReadVMDFile(&vmdFile, p.string().c_str())) {
-            Err::Exit("Failed to read VMD file:", p);
-        }
-        if (!vmdAnim->Add(vmdFile)) {
-            Err::Exit("Failed to add VMDAnimation:", p);
-        }
-
-        if (!vmdFile.m_cameras.empty()) {
-            cameraAnim = std::make_unique<saba::VMDCameraAnimation>();
-            if (!cameraAnim->Create(vmdFile))
-                Err::Log("Failed to create VMDCameraAnimation:", p);
-        }
+// Identifies the settled physics state: the model and the motion posed
+// while settling, given by hashes of their files, and the settings
+// affecting the result.  0 if a hash is unknown.
+uint64_t physicsSnapshotKey(
+        const Config& config, const std::vector<std::optional<uint64_t>>& fileHashes) {
+    uint64_t hash = Yommd::HashSeed;
+    const auto mix = [&hash](const void *data, size_t size) {
+        hash = Yommd::hashBytes(data, size, hash);
+    };
+    for (const auto& fileHash : fileHashes) {
+        if (!fileHash)
+            return 0;
+        mix(&*fileHash, sizeof(*fileHash));
     }
-
-    animations_.push_back(std::make_pair(std::move(vmdAnim), std::move(cameraAnim)));
+    mix(&config.simulationFPS, sizeof(config.simulationFPS));
+    mix(&config.gravity, sizeof(config.gravity));
+    mix(&config.physicsPreroll, sizeof(config.physicsPreroll));
+    // IK poses the bones driving bodies while settling.
+    mix(&config.ikIterationBudget, sizeof(config.ikIterationBudget));
+    for (const auto group : config.physicsDisabledGroups)
+        mix(&group, sizeof(group));
+    for (const auto& pattern : config.physicsDisabledBodies)
+        mix(pattern.data(), pattern.size() + 1);
+    return hash;
 }
-
-bool MMD::IsModelLoaded() const {
-    return static_cast<bool>(model_);
-}
-
-const std::shared_ptr<saba::MMDModel> MMD::GetModel() const {
-    return model_;
-}
-
-const std::vector<MMD::Animation>& MMD::GetAnimations() const {
-    return animations_;
 }
 
 UserViewport::UserViewport() :
@@ -156,11 +116,41 @@ void UserViewport::ResetPosition() {
     translate_ = defaultTranslate_;
 }
 
+Clock::Clock() :
+    frame_(0), origin_(0)
+{}
+
+void Clock::Init(std::optional<double> fixedStep) {
+    step_ = fixedStep;
+    frame_ = 0;
+    origin_ = stm_now();
+}
+
+double Clock::Now() const {
+    if (step_)
+        return static_cast<double>(frame_) * *step_;
+    return stm_sec(stm_since(origin_));
+}
+
+double Clock::Since(double time) const {
+    return Now() - time;
+}
+
+void Clock::Tick() {
+    ++frame_;
+}
+
+bool Clock::IsFixedStep() const {
+    return step_.has_value();
+}
+
 Routine::Routine() :
     passAction_({.colors = {{.load_action = SG_LOADACTION_CLEAR, .clear_value = {0, 0, 0, 0}}}}),
     binds_({}),
-    timeBeginAnimation_(0), timeLastFrame_(0), motionID_(0), needBridgeMotions_(false),
-    rand_(static_cast<int>(std::time(nullptr)))
+    viewMatrix_(1.0f), projectionMatrix_(1.0f),
+    frame_({}), timeBeginAnimation_(0), timeLastFrame_(0), motionID_(0), nextMotionID_(0),
+    timeBeginCrossfade_(0), crossfadeDuration_(0),
+    rand_(static_cast<uint32_t>(std::time(nullptr)))
 {}
 
 Routine::~Routine() {
@@ -169,6 +159,7 @@ Routine::~Routine() {
 
 void Routine::Init(const CmdArgs& args) {
     namespace fs = std::filesystem;
+    const auto initBegin = std::chrono::steady_clock::now();
     fs::path resourcePath = "<embedded-toons>";
     fs::path configFile = args.configFile;
     if (configFile.empty()) {
@@ -192,12 +183,75 @@ void Routine::Init(const CmdArgs& args) {
 
     defaultCamera_.eye = config.defaultCameraPosition;
     defaultCamera_.center = config.defaultGazePosition;
-    mmd_.LoadModel(config.model, resourcePath);
+    mmd_.LoadModel(config.model, resourcePath,
+            config.modelCache ? Yommd::getCachePath() / "models" : fs::path());
+    mmd_.SetIkIterationBudget(config.ikIterationBudget);
 
+    // Motions are only indexed here, and loaded when selected.
     for (const auto& motion : config.motions) {
         if (!motion.disabled) {
-            mmd_.LoadMotion(motion.paths);
+            mmd_.AddMotion(motion.paths);
             motionWeights_.push_back(motion.weight);
+            motionCrossfades_.push_back(motion.crossfade);
+        }
+    }
+    mmd_.GetMotions().SetMemoryLimit(static_cast<size_t>(config.motionMemoryLimit) << 20);
+    mmd_.PruneUnused();
+    crossfade_.Create(mmd_.GetModel());
+
+    if (args.seed)
+        rand_.seed(*args.seed);
+    const auto distSup = std::reduce(motionWeights_.cbegin(), motionWeights_.cend(), 0u);
+    if (!motionWeights_.empty() && distSup == 0)
+        Err::Exit("Sum of motion weights is 0.");
+    randDist_.param(decltype(randDist_)::param_type(0, distSup - 1));
+
+    mmd_.SetupPhysics(config, args.fixedStep);
+
+    if (args.benchPhysics != 0) {
+        if (motionWeights_.empty())
+            Err::Exit("No motion to benchmark physics with.");
+        const auto motion = mmd_.GetMotions().Load(pickNextMotion());
+        mmd_.BenchmarkPhysics(*motion->evaluator, config.physicsPreroll, args.benchPhysics,
+                1.0 / config.simulationFPS, config.physicsThreads);
+        std::exit(0);
+    }
+
+    std::thread preroll;
+    if (!motionWeights_.empty()) {
+        auto& motions = mmd_.GetMotions();
+        motionID_ = pickNextMotion();
+        const auto motion = motions.Load(motionID_);
+        nextMotionID_ = pickNextMotion();
+        motions.SetPlaying(motionID_, nextMotionID_);
+
+        // Let physics settle into the first pose while GPU resources are
+        // created, unless the settled state is cached from a previous launch.
+        if (config.physicsPreroll != 0) {
+            fs::path snapshot;
+            uint64_t key = 0;
+            if (config.physicsCache) {
+                // The files are hashed already, by loading them.
+                std::vector<std::optional<uint64_t>> hashes = {mmd_.GetModelHash()};
+                for (const auto& path : motions.GetPaths(motionID_))
+                    hashes.push_back(motions.GetHash(path));
+                key = physicsSnapshotKey(config, hashes);
+            }
+            if (key != 0) {
+                std::stringstream name;
+                name << std::hex << std::setw(16) << std::setfill('0') << key << ".bin";
+                snapshot = Yommd::getCachePath() / "physics" / name.str();
+            }
+            if (key != 0 && mmd_.LoadPhysicsSnapshot(*motion->evaluator, snapshot, key)) {
+                Info::Log("Physics restored from", snapshot);
+            } else {
+                preroll = std::thread([this, motion, &config, snapshot, key]() {
+                    mmd_.PrerollPhysics(*motion->evaluator, config.physicsPreroll,
+                            1.0 / config.simulationFPS);
+                    if (key != 0)
+                        mmd_.SavePhysicsSnapshot(snapshot, key);
+                });
+            }
         }
     }
 
@@ -209,6 +263,7 @@ void Routine::Init(const CmdArgs& args) {
     };
     sg_setup(&desc);
     stm_setup();
+    clock_.Init(args.fixedStep ? std::make_optional(1.0 / Constant::FPS) : std::nullopt);
 
     const sg_backend backend = sg_query_backend();
     shaderMMD_ = sg_make_shader(mmd_shader_desc(backend));
@@ -216,28 +271,28 @@ void Routine::Init(const CmdArgs& args) {
     initBuffers();
     initTextures();
     initPipeline();
+    if (preroll.joinable())
+        preroll.join();
+    // Physics on its own thread isn't reproducible.
+    if (config.physicsThread && !args.fixedStep)
+        mmd_.StartPhysicsThread();
+    jobs_.Init(config.workerThreads);
+    initJobs();
 
     binds_.index_buffer = ibo_;
     binds_.vertex_buffers[ATTR_mmd_vs_in_Pos] = posVB_;
     binds_.vertex_buffers[ATTR_mmd_vs_in_Nor] = normVB_;
     binds_.vertex_buffers[ATTR_mmd_vs_in_UV] = uvVB_;
 
-    const auto distSup = std::reduce(motionWeights_.cbegin(), motionWeights_.cend(), 0u);
-    if (!motionWeights_.empty() && distSup == 0)
-        Err::Exit("Sum of motion weights is 0.");
-    randDist_.param(decltype(randDist_)::param_type(0, distSup - 1));
-
-    auto physics = mmd_.GetModel()->GetMMDPhysics();
-    physics->GetDynamicsWorld()->setGravity(btVector3(0, -config.gravity * 5.0f, 0));
-    physics->SetMaxSubStepCount(INT_MAX);
-    physics->SetFPS(config.simulationFPS);
-
     userViewport_.SetDefaultTranslation(config.defaultModelPosition);
     userViewport_.SetDefaultScaling(config.defaultScale);
 
-    selectNextMotion();
-    needBridgeMotions_ = false;
-    timeBeginAnimation_ = timeLastFrame_ = stm_now();
+    // Compare with "model-cache" and "physics-cache" disabled.
+    const std::chrono::duration<double, std::milli> initTime =
+        std::chrono::steady_clock::now() - initBegin;
+    Info::Log("Startup:", initTime.count(), "ms");
+
+    timeBeginAnimation_ = timeLastFrame_ = clock_.Now();
     shouldTerminate_ = true;
 }
 
@@ -310,23 +365,19 @@ void Routine::initTextures() {
 
     const auto& model = mmd_.GetModel();
     const size_t subMeshCount = model->GetSubMeshCount();
+    size_t deferred = 0;
     for (size_t i = 0; i < subMeshCount; ++i) {
-        const auto& mmdMaterial = model->GetMaterials()[i];
-        Material material(mmdMaterial);
-        if (!mmdMaterial.m_texture.empty()) {
-            material.texture = getTexture(mmdMaterial.m_texture);
-            if (material.texture) {
-                material.textureHasAlpha = texImages_[mmdMaterial.m_texture].hasAlpha;
-            }
-        }
-        if (!mmdMaterial.m_spTexture.empty()) {
-            material.spTexture = getTexture(mmdMaterial.m_spTexture);
-        }
-        if (!mmdMaterial.m_toonTexture.empty()) {
-            material.toonTexture = getTexture(mmdMaterial.m_toonTexture);
-        }
+        Material material(mmd_.GetMaterial(i));
+        // Hidden materials, e.g. alternative outfits, are loaded when a
+        // material morph makes them visible.
+        if (material.material.m_alpha != 0)
+            loadMaterialTextures(material);
+        else
+            ++deferred;
         materials_.push_back(std::move(material));
     }
+    if (deferred != 0)
+        Info::Log("Deferred textures of hidden materials:", deferred, '/', subMeshCount);
 
     sampler_texture_ = sg_make_sampler(sg_sampler_desc{
         .min_filter = SG_FILTER_LINEAR,
@@ -344,6 +395,23 @@ void Routine::initTextures() {
     });
 }
 
+void Routine::loadMaterialTextures(Material& material) {
+    const auto& mmdMaterial = material.material;
+    if (!mmdMaterial.m_texture.empty()) {
+        material.texture = getTexture(mmdMaterial.m_texture);
+        if (material.texture) {
+            material.textureHasAlpha = texImages_[mmdMaterial.m_texture].hasAlpha;
+        }
+    }
+    if (!mmdMaterial.m_spTexture.empty()) {
+        material.spTexture = getTexture(mmdMaterial.m_spTexture);
+    }
+    if (!mmdMaterial.m_toonTexture.empty()) {
+        material.toonTexture = getTexture(mmdMaterial.m_toonTexture);
+    }
+    material.texturesLoaded = true;
+}
+
 void Routine::initPipeline() {
     sg_vertex_layout_state layout_desc;
     layout_desc.attrs[ATTR_mmd_vs_in_Pos] = {
@@ -392,106 +460,176 @@ void Routine::initPipeline() {
     pipeline_bothface_ = sg_make_pipeline(&pipeline_desc);
 }
 
-void Routine::selectNextMotion() {
-    // Select next MMD motion by weighted rate.
-    if (motionWeights_.empty())
+void Routine::initJobs() {
+    // Per-frame work.  Camera and motions are independent, and morph
+    // offsets needn't wait for bones and physics.
+    const auto animate = [this](auto func) {
+        return [this, func]() {
+            if (frame_.motion)
+                func();
+        };
+    };
+    jobs_.Add("camera", [this]() { updateCamera(); });
+    const auto motion = jobs_.Add("motion", [this]() { updateMotion(); });
+    const auto morph = jobs_.Add("morph", animate([this]() {
+        mmd_.UpdateMorphAnimation();
+    }), {motion});
+    const auto morphOffsets = jobs_.Add("morph offsets", animate([this]() {
+        mmd_.UpdateMorphOffsets();
+    }), {morph});
+    const auto node = jobs_.Add("node", animate([this]() {
+        mmd_.UpdateNodeAnimation(false);
+    }), {morph});
+    const auto physics = jobs_.Add("physics", animate([this]() {
+        mmd_.UpdatePhysicsAnimation(frame_.elapsedTime);
+    }), {node});
+    const auto nodeAfterPhysics = jobs_.Add("node after physics", animate([this]() {
+        mmd_.UpdateNodeAnimation(true);
+        mmd_.EndAnimation();
+    }), {physics});
+    if (mmd_.CanUpdateVerticesInParallel()) {
+        jobs_.ParallelFor("skinning", mmd_.GetModel()->GetVertexCount(), 4096,
+                [this](size_t begin, size_t end) { mmd_.UpdateVertices(begin, end); },
+                {morphOffsets, nodeAfterPhysics});
+    } else {
+        jobs_.Add("skinning", [this]() { mmd_.UpdateVertices(); },
+                {morphOffsets, nodeAfterPhysics});
+    }
+}
+
+void Routine::updateCamera() {
+    if (!frame_.motion)
         return;
 
+    const auto& size = frame_.windowSize;
+    const auto& cameraAnim = frame_.motion->camera;
+    if (cameraAnim) {
+        cameraAnim->Evaluate(frame_.vmdFrame);
+        const auto& mmdCamera = cameraAnim->GetCamera();
+        saba::MMDLookAtCamera lookAtCamera(mmdCamera);
+        viewMatrix_ = glm::lookAt(
+                lookAtCamera.m_eye,
+                lookAtCamera.m_center,
+                lookAtCamera.m_up);
+        projectionMatrix_ = glm::perspectiveFovRH(
+                mmdCamera.m_fov,
+                static_cast<float>(size.x),
+                static_cast<float>(size.y),
+                1.0f,
+                10000.0f);
+    } else {
+        viewMatrix_ = glm::lookAt(
+                defaultCamera_.eye,
+                defaultCamera_.center,
+                glm::vec3(0, 1, 0));
+        projectionMatrix_ = glm::perspectiveFovRH(
+                glm::radians(30.0f),
+                static_cast<float>(size.x),
+                static_cast<float>(size.y),
+                1.0f,
+                10000.0f);
+    }
+}
+
+void Routine::updateMotion() {
+    if (!frame_.motion)
+        return;
+
+    const auto& vmdAnim = frame_.motion->evaluator;
+    mmd_.BeginAnimation();
+    if (crossfade_.IsActive()) {
+        // The blend overwrote constant channels in the last frame.
+        vmdAnim->Reset();
+        vmdAnim->Evaluate(frame_.vmdFrame);
+        crossfade_.Apply(static_cast<float>(
+                    clock_.Since(timeBeginCrossfade_) / crossfadeDuration_));
+    } else {
+        vmdAnim->Evaluate(frame_.vmdFrame);
+    }
+}
+
+size_t Routine::pickNextMotion() {
+    // Select next MMD motion by weighted rate.
     unsigned int rnd = randDist_(rand_);
     unsigned int sum = 0;
     const auto motionCount = motionWeights_.size();
-    motionID_ = motionCount - 1;
     for (size_t i = 0; i < motionCount; ++i) {
         sum += motionWeights_[i];
-        if (sum >= rnd) {
-            motionID_ = i;
-            break;
-        }
+        if (sum >= rnd)
+            return i;
     }
-    if (motionID_ >= motionCount)
-        Err::Exit("Internal error: unreachable:", __FILE__ ":", __LINE__, ':', __func__);
+    Err::Exit("Internal error: unreachable:", __FILE__ ":", __LINE__, ':', __func__);
 }
 
 void Routine::Update() {
-    const auto size{Context::getWindowSize()};
-    const auto model = mmd_.GetModel();
-    const size_t vertCount = model->GetVertexCount();
-    const double vmdFrame = stm_sec(stm_since(timeBeginAnimation_)) * Constant::VmdFPS;
-    const double elapsedTime = stm_sec(stm_since(timeLastFrame_));
-
-    auto& animations = mmd_.GetAnimations();
-
-    if (!animations.empty()) {
-        // Update camera animation.
-        auto& [vmdAnim, cameraAnim] = animations[motionID_];
-        if (cameraAnim) {
-            cameraAnim->Evaluate(vmdFrame);
-            const auto& mmdCamera = cameraAnim->GetCamera();
-            saba::MMDLookAtCamera lookAtCamera(mmdCamera);
-            viewMatrix_ = glm::lookAt(
-                    lookAtCamera.m_eye,
-                    lookAtCamera.m_center,
-                    lookAtCamera.m_up);
-            projectionMatrix_ = glm::perspectiveFovRH(
-                    mmdCamera.m_fov,
-                    static_cast<float>(size.x),
-                    static_cast<float>(size.y),
-                    1.0f,
-                    10000.0f);
-        } else {
-            viewMatrix_ = glm::lookAt(
-                    defaultCamera_.eye,
-                    defaultCamera_.center,
-                    glm::vec3(0, 1, 0));
-            projectionMatrix_ = glm::perspectiveFovRH(
-                    glm::radians(30.0f),
-                    static_cast<float>(size.x),
-                    static_cast<float>(size.y),
-                    1.0f,
-                    10000.0f);
-        }
-
-        model->BeginAnimation();
-        if (needBridgeMotions_) {
-            vmdAnim->Evaluate(0.0f, stm_sec(stm_since(timeBeginAnimation_)));
-            model->UpdateMorphAnimation();
-            model->UpdateNodeAnimation(false);
-            model->UpdatePhysicsAnimation(elapsedTime);
-            model->UpdateNodeAnimation(true);
-            if (vmdFrame >= Constant::VmdFPS) {
-                needBridgeMotions_ = false;
-                timeBeginAnimation_ = stm_now();
-            }
-        } else {
-            model->UpdateAllAnimation(vmdAnim.get(), vmdFrame, elapsedTime);
+    auto& motions = mmd_.GetMotions();
+    const auto motion = motionWeights_.empty() ? nullptr : motions.Get(motionID_);
+    frame_ = FrameState{
+        .motion = motion,
+        .vmdFrame = clock_.Since(timeBeginAnimation_) * Constant::VmdFPS,
+        .elapsedTime = clock_.Since(timeLastFrame_),
+        .windowSize = Context::getWindowSize(),
+    };
+    // The camera of this frame is updated in parallel with physics.  Use
+    // the last one for physics LOD.
+    mmd_.SetPhysicsView(userViewport_.GetMatrix() * projectionMatrix_ * viewMatrix_,
+            Context::getDrawableSize());
+    jobs_.Run();
+
+    if (motion) {
+        // Load textures of materials that have just become visible.
+        for (auto& material : materials_) {
+            if (!material.texturesLoaded && material.material.m_alpha != 0)
+                loadMaterialTextures(material);
         }
-        model->EndAnimation();
     }
-    model->Update();
 
-    sg_update_buffer(posVB_, sg_range{
-                .ptr = model->GetUpdatePositions(),
-                .size = vertCount * sizeof(glm::vec3),
-            });
-    sg_update_buffer(normVB_, sg_range{
-                .ptr = model->GetUpdateNormals(),
-                .size = vertCount * sizeof(glm::vec3),
-            });
-    sg_update_buffer(uvVB_, sg_range{
-                .ptr = model->GetUpdateUVs(),
-                .size = vertCount * sizeof(glm::vec2),
-            });
+    // Vertices after this are used only by hidden materials, and aren't
+    // drawn.
+    const size_t vertCount = mmd_.GetUpdateVertexCount();
+    if (vertCount != 0) {
+        sg_update_buffer(posVB_, sg_range{
+                    .ptr = mmd_.GetUpdatePositions(),
+                    .size = vertCount * sizeof(glm::vec3),
+                });
+        sg_update_buffer(normVB_, sg_range{
+                    .ptr = mmd_.GetUpdateNormals(),
+                    .size = vertCount * sizeof(glm::vec3),
+                });
+        sg_update_buffer(uvVB_, sg_range{
+                    .ptr = mmd_.GetUpdateUVs(),
+                    .size = vertCount * sizeof(glm::vec2),
+                });
+    }
 
-    if (!animations.empty()) {
-        auto& vmdAnim = animations[motionID_].first;
-        timeLastFrame_ = stm_now();
-        if (vmdFrame > vmdAnim->GetMaxKeyTime()) {
-            model->SaveBaseAnimation();
+    if (motion) {
+        timeLastFrame_ = clock_.Now();
+        if (frame_.vmdFrame > motion->evaluator->GetMaxKeyTime()) {
             timeBeginAnimation_ = timeLastFrame_;
-            selectNextMotion();
-            needBridgeMotions_ = true;
+            // Never wait for loading.  If the next motion isn't ready yet,
+            // play the current one again.  In fixed-step mode, wait so that
+            // the sequence doesn't depend on the loading speed.
+            auto nextMotion = motion;
+            const auto next = clock_.IsFixedStep() ?
+                motions.Load(nextMotionID_) : motions.Get(nextMotionID_);
+            if (next) {
+                nextMotion = next;
+                motionID_ = nextMotionID_;
+                nextMotionID_ = pickNextMotion();
+                motions.SetPlaying(motionID_, nextMotionID_);
+            }
+            nextMotion->evaluator->Reset();
+
+            // The next motion starts playing immediately, blended from the
+            // last pose of the previous one.
+            crossfadeDuration_ = motionCrossfades_[motionID_];
+            if (crossfadeDuration_ > 0.0f) {
+                crossfade_.Begin();
+                timeBeginCrossfade_ = timeLastFrame_;
+            }
         }
     }
+    clock_.Tick();
 }
 
 void Routine::Draw() {
@@ -614,8 +752,13 @@ void Routine::Terminate() {
     if (!shouldTerminate_)
         return;
 
-    motionID_ = 0;
+    mmd_.StopPhysicsThread();
+    mmd_.LogStats();
+    jobs_.LogStats();
+
+    motionID_ = nextMotionID_ = 0;
     motionWeights_.clear();
+    motionCrossfades_.clear();
     induces_.clear();
     texImages_.clear();
     textures_.clear();
@@ -643,10 +786,12 @@ void Routine::OnMouseDown() {
 
 void Routine::OnMouseDragged() {
     userViewport_.OnMouseDragged();
+    mmd_.WakePhysics();
 }
 
 void Routine::OnWheelScrolled(float delta) {
     userViewport_.OnWheelScrolled(delta);
+    mmd_.WakePhysics();
 }
 
 void Routine::ResetModelPosition() {
@@ -1,6 +1,7 @@
 #ifndef YOMMD_HPP_
 #define YOMMD_HPP_
 
+#include <array>
 #include <optional>
 #include <memory>
 #include <random>
@@ -11,15 +12,26 @@
 #include <sstream>
 #include <string_view>
 #include <map>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <new>
 #include <filesystem>
 #include <utility>
 #include "Saba/Model/MMD/MMDMaterial.h"
 #include "Saba/Model/MMD/MMDModel.h"
-#include "Saba/Model/MMD/VMDAnimation.h"
+#include "Saba/Model/MMD/PMXFile.h"
 #include "Saba/Model/MMD/VMDCameraAnimation.h"
+#include "Saba/Model/MMD/VMDFile.h"
 #include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
 #include "sokol_gfx.h"
 
+class btDiscreteDynamicsWorld;
+
 #include "platform.hpp"
 
 #ifdef PLATFORM_WINDOWS
@@ -39,6 +51,64 @@ struct NonCopyable {
     NonCopyable &operator=(const NonCopyable &) = delete;
 };
 
+// Allocator for std::vector whose storage is aligned to "Alignment" bytes,
+// e.g. to a cache line.
+template <typename T, size_t Alignment> struct AlignedAllocator {
+    using value_type = T;
+    template <typename U> struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+    AlignedAllocator() = default;
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+    T *allocate(size_t n) {
+        return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+    void deallocate(T *p, size_t) {
+        ::operator delete(p, std::align_val_t(Alignment));
+    }
+    template <typename U> bool operator==(const AlignedAllocator<U, Alignment>&) const {
+        return true;
+    }
+    template <typename U> bool operator!=(const AlignedAllocator<U, Alignment>&) const {
+        return false;
+    }
+};
+
+// Passes the latest value from one thread to another without locks.  The
+// writer fills one slot while the reader holds another, and the third one
+// carries the newest published value between them.
+template <typename T> class TripleBuffer : private NonCopyable {
+public:
+    void Reset(const T& value) {  // Not thread safe.
+        slots_.fill(value);
+        back_ = 0;
+        middle_.store(1);
+        front_ = 2;
+    }
+    T& Back() {  // Writer only.
+        return slots_[back_];
+    }
+    void Publish() {  // Writer only.
+        back_ = middle_.exchange(back_ | Fresh) & Index;
+    }
+    bool Read() {  // Reader only.  Returns true if Front() is updated.
+        if (!(middle_.load() & Fresh))
+            return false;
+        front_ = middle_.exchange(front_) & Index;
+        return true;
+    }
+    const T& Front() const {  // Reader only.
+        return slots_[front_];
+    }
+private:
+    static constexpr uint8_t Index = 3;
+    static constexpr uint8_t Fresh = 4;
+    std::array<T, 3> slots_;
+    uint8_t back_ = 0;
+    std::atomic<uint8_t> middle_{1};
+    uint8_t front_ = 2;
+};
+
 namespace _internal {
 template <typename T> void _log(std::ostream& os, T&& car) {
     os << car << std::endl;
@@ -104,6 +174,9 @@ struct CmdArgs {
     Path cwd;
     Path configFile;
     Path logFile;
+    bool fixedStep;
+    std::optional<uint32_t> seed;
+    unsigned int benchPhysics;  // Steps to benchmark physics for.  0 runs normally.
 
     static CmdArgs Parse(const std::vector<std::string>& args);
 };
@@ -112,8 +185,37 @@ namespace Yommd {
 void slogFunc(const char *tag, uint32_t logLevel, uint32_t logItem,
         const char *message, uint32_t linenr, const char *filename, void *user_data);
 void makeAbsolute(std::filesystem::path& path, const std::filesystem::path& cwd);
+// Convert coordinates in MMD files (left handed) into Saba's (right handed).
+glm::vec3 toRightHanded(const glm::vec3& v);
+glm::quat toRightHanded(const glm::quat& q);
+// 64-bit hash of the file content, FNV-1a over 8-byte words.  Fails on
+// empty files too.
+std::optional<uint64_t> hashFile(const std::filesystem::path& path);
+// Same as hashFile(), of the bytes.  Pass a previous result as "hash" to
+// hash more bytes after them; the result equals hashing both at once when
+// the former bytes are a multiple of 8 long.
+constexpr uint64_t HashSeed = 0xcbf29ce484222325ull;
+uint64_t hashBytes(const void *data, size_t size, uint64_t hash = HashSeed);
+// Replaces the file at once, creating directories as necessary.
+bool writeFile(const std::filesystem::path& path, const void *data, size_t size);
+// $XDG_CACHE_HOME/yoMMD, or ~/.cache/yoMMD.
+std::filesystem::path getCachePath();
 }
 
+// Read-only view of a whole file mapped into memory.
+class MappedFile : private NonCopyable {
+public:
+    MappedFile();
+    ~MappedFile();
+    bool Open(const std::filesystem::path& path);  // Fails on empty files.
+    void Close();
+    const uint8_t *Data() const;
+    size_t Size() const;
+private:
+    const uint8_t *data_;
+    size_t size_;
+};
+
 // config.cpp
 struct Config {
     using Path = std::filesystem::path;
@@ -121,8 +223,13 @@ struct Config {
     struct Motion {
         bool disabled;
         unsigned int weight;
+        float crossfade;  // Seconds to blend from the previous motion.
         std::vector<Path> paths;
     };
+    enum class PhysicsSolver : uint8_t {
+        Bullet,
+        SpringBone,  // Verlet chains.  Cheaper, and less accurate.
+    };
     Config();
 
     Path model;
@@ -133,6 +240,21 @@ struct Config {
     float defaultScale;
     glm::vec3 defaultCameraPosition;
     glm::vec3 defaultGazePosition;
+    unsigned int ikIterationBudget;
+    unsigned int motionMemoryLimit;  // In MiB.  0 means unlimited.
+    unsigned int workerThreads;  // 0 means auto, 1 runs the frame serially.
+    float physicsBudget;  // In milliseconds per frame.  0 means unlimited.
+    std::vector<int> physicsLowPriorityGroups;  // 1 to 16.  Empty means auto.
+    std::vector<int> physicsDisabledGroups;  // 1 to 16.
+    std::vector<std::string> physicsDisabledBodies;  // Regular expressions of names.
+    float physicsLodSize;  // In pixels.  0 disables LOD.
+    unsigned int physicsPreroll;  // Steps to settle physics before showing the model.
+    // 0 means auto, 1 keeps Saba's single-threaded world.
+    unsigned int physicsThreads;
+    bool physicsThread;  // Step physics on its own thread.  Ignored with --fixed-step.
+    PhysicsSolver physicsSolver;
+    bool physicsCache;  // Reuse settled physics states across launches.
+    bool modelCache;  // Reuse parsed model data across launches.
 
     static Config Parse(const std::filesystem::path& configFile);
 };
@@ -175,7 +297,849 @@ public:
 private:
 };
 
-// viewer.cpp
+// motion.cpp
+// Deduplicated table of VMD interpolation curves.  Each curve is sampled into
+// a fixed size lookup table, so evaluating a curve is an index and a lerp.
+class BezierTable {
+public:
+    using Param = std::array<uint8_t, 4>;  // (x1, y1, x2, y2) in 0-127.
+    static constexpr size_t LinearCurve = 0;
+
+    BezierTable();
+    uint16_t Intern(const Param& param);
+    float Eval(uint16_t curve, float x) const;
+    size_t GetCurveCount() const;
+private:
+    static constexpr size_t SampleCount = 64;
+    std::map<Param, uint16_t> indices_;
+    std::vector<std::array<float, SampleCount + 1>> samples_;
+};
+
+// Names and the duration of a VMD file, read without loading keyframes.
+struct VmdSummary {
+    int32_t maxFrame;
+    std::vector<std::string> boneNames;
+    std::vector<std::string> morphNames;
+    std::vector<std::string> ikNames;
+    bool hasCamera;
+
+    static std::optional<VmdSummary> Scan(const std::filesystem::path& path);
+};
+
+// Reads VMD files in place of saba::ReadVMDFile().  The file is mapped into
+// memory, and keys are copied from it straight into arrays sized up front
+// instead of through streams record by record.  Light and shadow keys are
+// skipped since nothing uses them.
+struct VmdReader {
+    static bool Read(saba::VMDFile& vmd, const std::filesystem::path& path);
+    static bool Read(saba::VMDFile& vmd, const MappedFile& file);  // For callers hashing it too.
+};
+
+// Keyframes of one VMD file bound to a model, stored in flat per-channel
+// arrays.  Clips are immutable after Create() and shared among every
+// MotionEvaluator using the same file; per-instance playback state lives in
+// State.  Keyframe searches start from a per-channel cursor since playback
+// time mostly advances monotonically.  Channels keyed with a single value
+// are applied once instead of every frame.  Keys are stored compressed and
+// decompressed on evaluation: 16-bit frame deltas, rotations as 48-bit
+// smallest-three quaternions, translations and morph weights as 16-bit
+// values in the bounds of their channel, and a 16-bit index to the set of
+// interpolation curves.
+class MotionClip : private NonCopyable {
+public:
+    struct KeyCursor {
+        uint32_t index;  // The first key whose time is greater than the frame.
+        int32_t time;  // Time of the key at "index".
+    };
+    using PackedQuat = std::array<uint16_t, 3>;
+    struct MemoryUsage {
+        size_t raw;  // Size of keys with full precision.
+        size_t compressed;
+    };
+    struct State {
+        std::vector<KeyCursor> boneCursors;
+        std::vector<KeyCursor> morphCursors;
+        std::vector<KeyCursor> ikCursors;
+        bool constantsApplied;
+
+        // Per-frame scratch buffers.  Bone keys are decoded into structure
+        // of arrays padded to Simd::Lanes, and interpolated into the latter
+        // keys.
+        std::vector<uint32_t> key0;
+        std::vector<uint32_t> key1;
+        std::vector<float> progress;
+        std::array<std::vector<float>, 3> translates0;  // X, Y and Z.
+        std::array<std::vector<float>, 3> translates1;
+        std::array<std::vector<float>, 4> rotates0;  // Quaternion components.
+        std::array<std::vector<float>, 4> rotates1;
+        std::array<std::vector<float>, 4> curveValues;  // For X, Y, Z and rotation.
+        std::vector<uint32_t> slerpChannels;  // Rotating too far for nlerp.
+    };
+
+    MotionClip();
+    bool Create(const std::shared_ptr<saba::MMDModel>& model, const saba::VMDFile& vmd);
+    State CreateState() const;
+    void Evaluate(State& state, float frame) const;
+    int32_t GetMaxKeyTime() const;
+    std::vector<saba::MMDNode *> GetBoneTargets() const;
+    std::vector<saba::MMDMorph *> GetMorphTargets() const;
+    MemoryUsage GetMemoryUsage() const;
+private:
+    using QuantizedVec3 = std::array<uint16_t, 3>;
+    using CurveSet = std::array<uint16_t, 4>;  // Indices into "curves_" for X, Y, Z and rotation.
+
+    struct BoneChannels {
+        std::vector<saba::MMDNode *> nodes;
+        std::vector<uint32_t> keyBegin;  // Channel i owns keys [keyBegin[i], keyBegin[i+1]).
+        std::vector<int32_t> startTimes;
+        std::vector<int32_t> endTimes;
+        std::vector<glm::vec3> translateMins;
+        std::vector<glm::vec3> translateRanges;
+
+        // Per-key data.
+        std::vector<uint16_t> frameDeltas;  // From the previous key of the channel.
+        std::vector<std::pair<uint32_t, int32_t>> longDeltas;  // Key index and delta of long gaps.
+        std::vector<QuantizedVec3> translates;
+        std::vector<PackedQuat> rotates;
+        std::vector<uint16_t> curveSets;  // Curves ending at each key.
+    };
+    struct MorphChannels {
+        std::vector<saba::MMDMorph *> morphs;
+        std::vector<uint32_t> keyBegin;
+        std::vector<int32_t> startTimes;
+        std::vector<int32_t> endTimes;
+        std::vector<float> weightMins;
+        std::vector<float> weightRanges;
+        std::vector<uint16_t> frameDeltas;
+        std::vector<std::pair<uint32_t, int32_t>> longDeltas;
+        std::vector<uint16_t> weights;
+    };
+    struct IkChannels {
+        std::vector<saba::MMDIkSolver *> solvers;
+        std::vector<uint32_t> keyBegin;
+        std::vector<int32_t> startTimes;
+        std::vector<int32_t> endTimes;
+        std::vector<uint16_t> frameDeltas;
+        std::vector<std::pair<uint32_t, int32_t>> longDeltas;
+        std::vector<uint8_t> enables;
+    };
+    struct ConstantChannels {
+        std::vector<saba::MMDNode *> nodes;
+        std::vector<glm::vec3> translates;
+        std::vector<glm::quat> rotates;
+        std::vector<saba::MMDMorph *> morphs;
+        std::vector<float> weights;
+        std::vector<saba::MMDIkSolver *> solvers;
+        std::vector<uint8_t> enables;
+    };
+
+    void applyConstants(State& state) const;
+    void evaluateBones(State& state, float frame) const;
+    void evaluateMorphs(State& state, float frame) const;
+    void evaluateIks(State& state, float frame) const;
+
+    BezierTable curves_;
+    std::vector<CurveSet> curveSets_;
+    BoneChannels bones_;
+    MorphChannels morphs_;
+    IkChannels iks_;
+    ConstantChannels constants_;
+    int32_t maxKeyTime_;
+    size_t rawKeyBytes_;
+};
+
+// Plays a set of clips, e.g. body and facial motions, together.  Clips are
+// evaluated in order, so a later clip wins for channels keyed by several.
+// MotionLibrary merges such files into one clip beforehand.
+class MotionEvaluator : private NonCopyable {
+public:
+    MotionEvaluator();
+    bool Create(const std::vector<std::shared_ptr<const MotionClip>>& clips);
+    void Evaluate(float frame);
+    void Reset();  // Call when constant channels may have been overwritten.
+    int32_t GetMaxKeyTime() const;
+    std::vector<saba::MMDNode *> GetBoneTargets() const;
+    std::vector<saba::MMDMorph *> GetMorphTargets() const;
+private:
+    std::vector<std::pair<std::shared_ptr<const MotionClip>, MotionClip::State>> clips_;
+    int32_t maxKeyTime_;
+};
+
+// morph.cpp
+// Applies PMX morphs in place of saba::PMXModel::UpdateMorphAnimation().
+// Group morphs are flattened at load, only morphs with non-zero weight are
+// visited, and vertex offsets are rebuilt only when the weights change.
+class MorphEngine : private NonCopyable {
+public:
+    MorphEngine();
+    bool Create(const saba::PMXFile& pmx, const std::shared_ptr<saba::MMDModel>& model);
+    // Drops morphs never driven by motions, or with no effect, from the
+    // per-frame update.  Returns the number of pruned morphs.
+    size_t Prune(const std::vector<bool>& animated);
+    void Update();
+    // Update() in two steps.  UpdateWeights() also applies bone morphs, so
+    // must precede bone updates.  UpdateOffsets() may run in parallel with
+    // bone updates.
+    void UpdateWeights();
+    void UpdateOffsets();
+    bool IsEnabled() const;
+    const std::vector<glm::vec4>& GetPositionOffsets() const;
+    const std::vector<glm::vec4>& GetUVOffsets() const;
+    const saba::MMDMaterial& GetMaterial(size_t index) const;
+private:
+    // Sparse (index, delta) stream.  Deltas are vec4 so that they can be
+    // applied with 4-wide SIMD instructions.
+    struct VertexStream {
+        std::vector<uint32_t> indices;
+        std::vector<glm::vec4> deltas;
+    };
+    struct BoneOffset {
+        saba::MMDNode *node;
+        glm::vec3 translate;
+        glm::quat rotate;
+    };
+    struct MaterialOffset {
+        int32_t materialIndex;  // -1 means all materials.
+        bool multiply;
+        glm::vec4 diffuse;  // rgb: diffuse, a: alpha
+        glm::vec3 specular;
+        float specularPower;
+        glm::vec3 ambient;
+        glm::vec4 textureFactor;
+        glm::vec4 sphereTextureFactor;
+        glm::vec4 toonTextureFactor;
+    };
+    struct Leaf {
+        VertexStream positions;
+        VertexStream uvs;
+        std::vector<BoneOffset> bones;
+        std::vector<MaterialOffset> materials;
+    };
+    using ActiveList = std::vector<std::pair<uint32_t, float>>;  // (leaf, weight)
+
+    void flatten(const saba::PMXFile& pmx, size_t morph, float factor,
+            size_t depth, std::vector<float>& out) const;
+    void updateVertexOffsets();
+    void updateMaterials();
+
+    bool enabled_;
+    std::vector<saba::MMDMorph *> morphs_;
+    std::vector<uint32_t> liveMorphs_;
+    std::vector<Leaf> leaves_;  // Indexed by morph index.  Empty for group morphs.
+    std::vector<ActiveList> expansions_;  // Flattened leaf contributions of each morph.
+    std::vector<float> leafWeights_;
+    ActiveList active_;
+    ActiveList lastVertexActive_;
+    ActiveList lastMaterialActive_;
+    std::vector<glm::vec4> positionOffsets_;
+    std::vector<glm::vec4> uvOffsets_;
+    std::vector<saba::MMDMaterial> initialMaterials_;
+    std::vector<saba::MMDMaterial> materials_;
+};
+
+// skeleton.cpp
+class IkStage;
+
+// Bone hierarchy of PMX models flattened into arrays, used in place of
+// saba::PMXModel::UpdateNodeAnimation().  Bones are stored in depth-first
+// order, so parents always come before their children and every subtree is
+// a contiguous range.  Global transforms are then computed by one linear
+// pass, and local transforms, append bones and IK are updated in deform
+// order.  Results are written back to Saba's nodes for physics.
+class Skeleton : private NonCopyable {
+public:
+    Skeleton();
+    bool Create(const saba::PMXFile& pmx, const std::shared_ptr<saba::MMDModel>& model);
+    void SetIkStage(IkStage *ik);
+    bool IsEnabled() const;
+    size_t GetBoneCount() const;
+    uint32_t FindIndex(size_t boneIndex) const;  // PMX bone index to flattened index.
+    // Drops bones which affect nothing from the per-frame update.  "animated"
+    // is indexed by PMX bone index.  Returns the number of pruned bones.
+    size_t Prune(const std::vector<bool>& animated);
+    void UpdateNodeAnimation(bool afterPhysicsAnim);
+    const glm::mat4 *GetPalette() const;  // Skinning matrices, in flattened order.
+
+    // Functions below take flattened indices.
+    const glm::mat4& GetGlobalTransform(size_t i) const;
+    int32_t GetParent(size_t i) const;
+    glm::quat GetAnimateRotate(size_t i) const;
+    glm::quat GetIkRotate(size_t i) const;
+    void SetIkRotate(size_t i, const glm::quat& q);
+    void UpdateLocalTransform(size_t i);
+    void UpdateGlobalTransform(size_t i);  // Updates the bone and its descendants.
+private:
+    template <typename T> using AlignedVector = std::vector<T, AlignedAllocator<T, 64>>;
+
+    void gatherInputs();
+    void updateAppendTransform(size_t i);
+    void updateGlobalTransform(size_t i);
+
+    bool enabled_;
+    IkStage *ik_;
+    std::vector<saba::MMDNode *> nodes_;
+    std::vector<uint32_t> flatIndices_;  // Indexed by PMX bone index.
+    std::vector<int32_t> parents_;
+    std::vector<uint32_t> subtreeEnds_;
+    std::array<std::vector<uint32_t>, 2> deformOrders_;  // Before/after physics.
+    std::vector<uint8_t> required_;
+    std::vector<uint8_t> live_;
+    std::vector<uint32_t> liveBones_;
+    std::array<std::vector<uint32_t>, 2> liveDeformOrders_;
+    std::vector<uint32_t> physicsBones_;
+    std::vector<int32_t> appendSources_;
+    std::vector<float> appendWeights_;
+    std::vector<uint8_t> appendFlags_;
+    std::vector<int32_t> ikChains_;
+    std::vector<uint8_t> enableIk_;
+    std::vector<glm::vec3> initialTranslates_;
+
+    std::vector<glm::vec3> animTranslates_;
+    std::vector<glm::quat> animRotates_;
+    std::vector<glm::vec3> scales_;
+    std::vector<glm::quat> ikRotates_;
+    std::vector<glm::quat> appendRotates_;
+    std::vector<glm::vec3> appendTranslates_;
+    AlignedVector<glm::mat4> locals_;
+    AlignedVector<glm::mat4> globals_;
+    AlignedVector<glm::mat4> inverseInits_;
+    AlignedVector<glm::mat4> palette_;
+};
+
+// skinning.cpp
+// CPU skinning for PMX models, used in place of saba::PMXModel::Update() so
+// that vertex offsets come from MorphEngine.  Vertices used only by hidden
+// (alpha 0) materials are left as is while they stay hidden.
+class Skinning : private NonCopyable {
+public:
+    Skinning();
+    bool Create(const saba::PMXFile& pmx, const std::shared_ptr<saba::MMDModel>& model,
+            const Skeleton& skeleton);
+    void Update(const Skeleton& skeleton,
+            const std::vector<glm::vec4>& positionOffsets,
+            const std::vector<glm::vec4>& uvOffsets);
+    // Updates active vertices in [begin, end).  Chunks may run in parallel.
+    void Update(const Skeleton& skeleton,
+            const std::vector<glm::vec4>& positionOffsets,
+            const std::vector<glm::vec4>& uvOffsets,
+            size_t begin, size_t end);
+    void UpdateVisibility(const MorphEngine& morph);
+    uint32_t GetActiveVertexCount() const;  // Vertices after this are all inactive.
+    bool IsEnabled() const;
+    const glm::vec3 *GetPositions() const;
+    const glm::vec3 *GetNormals() const;
+    const glm::vec2 *GetUVs() const;
+private:
+    enum class Type : uint8_t { BDEF1, BDEF2, BDEF4, SDEF };
+    struct SdefParam {
+        glm::vec3 center;
+        glm::vec3 cr0;
+        glm::vec3 cr1;
+    };
+
+    void updateVertex(const Skeleton& skeleton, const glm::mat4 *palette, size_t i,
+            const glm::vec4& positionOffset, const glm::vec4& uvOffset);
+
+    bool enabled_;
+    std::vector<Type> types_;
+    std::vector<glm::ivec4> boneIndices_;  // Flattened indices of Skeleton.
+    std::vector<glm::vec4> boneWeights_;
+    std::vector<uint32_t> sdefIndices_;  // Index into sdefParams_, valid only for SDEF vertices.
+    std::vector<SdefParam> sdefParams_;
+    std::vector<glm::vec3> basePositions_;
+    std::vector<glm::vec3> baseNormals_;
+    std::vector<glm::vec2> baseUVs_;
+
+    std::vector<glm::vec3> positions_;
+    std::vector<glm::vec3> normals_;
+    std::vector<glm::vec2> uvs_;
+
+    std::vector<std::vector<uint32_t>> materialVertices_;
+    std::vector<bool> visibleMaterials_;
+    std::vector<std::pair<uint32_t, uint32_t>> activeRanges_;  // [begin, end) of vertices to update.
+    uint32_t activeEnd_;
+};
+
+// ik.cpp
+// CCD IK solver used in place of Saba's one for PMX models.  Chains are
+// solved by Skeleton in deform order.  Each chain starts from the previous
+// frame's solution, stops when converged, and is skipped while its inputs
+// don't move.  The total iterations per frame can be limited by
+// SetIterationBudget().
+class IkStage : private NonCopyable {
+public:
+    struct ChainStats {
+        std::string name;
+        uint32_t lastIterations = 0;
+        uint32_t maxIterations = 0;
+        uint64_t totalIterations = 0;
+        uint64_t skippedFrames = 0;
+        uint64_t frames = 0;
+    };
+
+    IkStage();
+    bool Create(const saba::PMXFile& pmx, const std::shared_ptr<saba::MMDModel>& model,
+            const Skeleton& skeleton);
+    void SetIterationBudget(uint32_t budget);  // 0 means unlimited.
+    bool IsEnabled() const;
+    size_t GetChainCount() const;
+    uint32_t GetIkBone(size_t chain) const;
+    std::vector<uint32_t> GetLinkBones(size_t chain) const;
+    void BeginFrame();
+    void SolveChain(Skeleton& skeleton, size_t chain);
+    const std::vector<ChainStats>& GetStats() const;
+    void LogStats() const;
+private:
+    struct Link {
+        uint32_t bone;
+        bool enableLimit;
+        int singleAxis;  // The only rotatable axis, or -1.
+        glm::vec3 limitMin;
+        glm::vec3 limitMax;
+        glm::quat ikRotate;  // Solution of the last frame.
+        glm::quat bestIkRotate;  // Closest iteration so far in solveChain().
+        glm::quat lastAnimateRotate;
+    };
+    struct Chain {
+        std::string name;
+        saba::MMDIkSolver *solver;
+        uint32_t ikBone;
+        uint32_t targetBone;
+        int32_t rootParent;
+        uint32_t maxIterations;
+        float limitAngle;
+        std::vector<Link> links;
+        glm::vec3 lastIkPosition;
+        glm::mat4 lastRootTransform;
+        bool solved;
+    };
+
+    bool hasMoved(const Skeleton& skeleton, const Chain& chain) const;
+    void saveInputs(const Skeleton& skeleton, Chain& chain) const;
+    uint32_t solveChain(Skeleton& skeleton, Chain& chain, uint32_t maxIterations);
+
+    bool enabled_;
+    uint32_t iterationBudget_;
+    uint32_t remaining_;
+    std::vector<Chain> chains_;
+    std::vector<ChainStats> stats_;
+};
+
+// crossfade.cpp
+// Blends the pose of the previous motion into the next one in pose space.
+// The outgoing pose is snapshotted once at the transition, and each frame
+// the freshly evaluated pose is blended with it in place, so the model is
+// updated only once per frame.  Poses are stored as structure of arrays
+// and blended 4 bones at a time.
+class Crossfade : private NonCopyable {
+public:
+    Crossfade();
+    void Create(const std::shared_ptr<saba::MMDModel>& model);
+    void Begin();  // Snapshots the current pose as the outgoing one.
+    bool IsActive() const;
+    void Apply(float weight);  // weight: 0 for the outgoing pose, 1 for the incoming.
+private:
+    struct Pose {
+        std::array<std::vector<float>, 3> translates;  // X, Y and Z.
+        std::array<std::vector<float>, 4> rotates;  // X, Y, Z and W.
+        std::vector<float> weights;
+        void Resize(size_t nodeCount, size_t morphCount);
+    };
+
+    void capture(Pose& pose) const;
+    void restore(const Pose& pose);
+
+    std::vector<saba::MMDNode *> nodes_;
+    std::vector<saba::MMDMorph *> morphs_;
+    Pose from_;
+    Pose to_;
+    bool active_;
+};
+
+// modelcache.cpp
+// Keeps the parts of PMX files that yoMMD reads in versioned binary files,
+// keyed by the content hash and size, so that later launches skip parsing.
+namespace ModelCache {
+// Reads "file" from the cache in "cacheDir" if valid, or parses it and
+// writes the cache.  "hash" is Yommd::hashFile() of "file".  Empty
+// "cacheDir" or no hash disables the cache.
+bool ReadPMXFile(saba::PMXFile& pmx, const std::filesystem::path& file,
+        std::optional<uint64_t> hash, const std::filesystem::path& cacheDir);
+}
+
+// physics.cpp
+// Steps Saba's physics in place of saba::PMXModel::UpdatePhysicsAnimation(),
+// and trades fidelity for time when the physics cost exceeds a budget.  The
+// cost is smoothed over frames, and tiers change only after it stays over
+// the budget, or well under it, for a while.
+// Stepping is suspended while bodies and the bones driving them stay calm,
+// e.g. in idle motions.
+// Physics may also run on its own thread at the simulation rate.  Poses go
+// back and forth through triple buffers, and the render side shows the
+// newest results interpolated.
+// With more than one thread, Saba's bodies and joints are moved into a
+// multithreaded Bullet world whose parallel loops run on yoMMD's threads.
+class PhysicsController : private NonCopyable {
+public:
+    enum class Tier : uint8_t {
+        Full,
+        FewerIterations,  // Half the solver iterations.
+        LowerRate,  // Also half the simulation rate.
+        NoLowPriority,  // Also low priority bodies follow their bones.
+        Frozen,  // All physics bones follow the animation.
+    };
+
+    PhysicsController();
+    ~PhysicsController();
+    bool Create(const saba::PMXFile& pmx, const std::shared_ptr<saba::MMDModel>& model);
+    bool IsEnabled() const;
+    void SetFPS(float fps);
+    void SetBudget(float milliseconds);  // 0 disables the governor.
+    void SetLowPriorityGroups(const std::vector<int>& groups);  // Empty means auto.
+    // Bodies in the groups (1 to 16), or whose names match any of the
+    // regular expressions, follow their bones instead of being simulated.
+    void SetDisabledBodies(const std::vector<int>& groups,
+            const std::vector<std::string>& patterns);
+    // Tells whether SetDisabledBodies() disables a body by its group (0 to
+    // 15) and name.  Also used by spring bones.
+    static std::function<bool(uint8_t group, const std::string& name)> DisabledBodyFilter(
+            const std::vector<int>& groups, const std::vector<std::string>& patterns);
+    // Chains of bodies smaller than this on screen follow their bones.
+    void SetLodSize(float pixels);  // 0 disables LOD.
+    void SetView(const glm::mat4& viewProjection, const glm::vec2& viewportSize);
+    // Including the calling thread.  0 means auto, 1 keeps Saba's world.
+    // Call after Saba's world is set up, from the main thread.
+    void SetThreads(unsigned int count);
+    // Switches between Saba's world and the multithreaded one, if created.
+    bool UseMultithreadedWorld(bool use);
+    void Wake();  // Resumes stepping, e.g. when the user moves the model.
+    // After this, Update() only exchanges poses with the physics thread.
+    // Call after all setup and Step() calls.
+    void StartThread();
+    void StopThread();
+    void Update(double elapsed);
+    void Step(double elapsed);  // Update() without LOD, sleeping and the governor.
+    // States of bodies, e.g. after settling, tagged with "key" to tell
+    // whether they still match the model and settings.  Call while bones
+    // are in the pose the states were saved in.
+    std::vector<char> GetSnapshot(uint64_t key) const;  // Empty when disabled.
+    bool RestoreSnapshot(const std::vector<char>& data, uint64_t key);
+    bool SaveSnapshot(const std::filesystem::path& file, uint64_t key) const;
+    bool LoadSnapshot(const std::filesystem::path& file, uint64_t key);
+    bool IsAsleep() const;
+    Tier GetTier() const;
+    size_t GetActiveBodyCount() const;
+    // Not while physics runs on its own thread.
+    int GetSubStepCount() const;  // In the last Update() or Step().
+    size_t GetContactCount() const;  // Contact points in the world.
+    void LogStats() const;
+private:
+    struct Body {
+        saba::MMDRigidBody *body;
+        saba::MMDNode *node;
+        std::string name;
+        bool dynamic;
+        bool lowPriority;
+        bool disabled;
+        uint8_t group;
+        float volume;
+        uint32_t chain;  // Valid only for dynamic bodies.
+        bool simulated;  // As of the last step.
+        bool wasActive;  // The bone followed the body in the last frame.
+        int fade;  // Remaining frames of blending into the animation.
+        glm::mat4 lastLocal;  // Local transform of the bone when last simulated.
+        glm::mat4 lastGlobal;  // Global transform of the bone driving the body.
+        glm::mat4 sleepGlobal;  // Same, when physics fell asleep.
+        glm::mat4 offset;  // Of the body from its bone.
+        glm::mat4 inverseOffset;
+        bool boneMerge;  // The bone keeps its animated position.
+    };
+    struct Inputs {
+        std::vector<glm::mat4> globals;  // Of the bones of bodies.
+        glm::mat4 viewProjection;
+        glm::vec2 viewportSize;
+        uint64_t wakes;
+    };
+    struct Outputs {
+        std::vector<glm::mat4> globals;  // Of the bones of bodies.
+        std::vector<uint8_t> active;  // Whether the bone follows the body.
+        double time;  // When stepped, in seconds.
+    };
+    class FixedMotionState;
+    struct Chain {
+        std::vector<uint32_t> bodies;
+        bool visible;  // Large enough on screen to simulate.
+    };
+    struct MtWorld;
+
+    btDiscreteDynamicsWorld *world() const;  // The one being stepped.
+    bool isActive(const Body& body) const;
+    // Physics side of Update().  Returns whether bones should follow bodies.
+    bool tick(double elapsed, const std::vector<glm::mat4>& drivers,
+            const glm::mat4& viewProjection, const glm::vec2& viewportSize, uint64_t wakes,
+            bool threaded);
+    // Kinematic bodies follow "drivers" if given, or their bones.
+    void stepWorld(double elapsed, const std::vector<glm::mat4> *drivers);
+    void threadMain();
+    void exchangePoses();
+    void updateLod(const glm::mat4& viewProjection, const glm::vec2& viewportSize);
+    // Returns true while asleep.
+    bool updateSleep(double elapsed, const std::vector<glm::mat4>& drivers, uint64_t wakes);
+    void followBodies();  // Moves bones to their bodies.
+    void updateFade(Body& body, bool shown);
+    void fadeOut();
+    void govern(double cost, const std::vector<glm::mat4>& drivers);
+    void setTier(Tier tier, const std::vector<glm::mat4>& drivers);
+    void applyTier();
+
+    bool enabled_;
+    std::shared_ptr<saba::MMDModel> model_;
+    std::vector<Body> bodies_;  // Same order as Saba's.
+    std::vector<Chain> chains_;
+    size_t activeBodies_;
+    float lodSize_;
+    glm::mat4 viewProjection_;
+    glm::vec2 viewportSize_;
+    double budget_;  // In seconds.
+    float baseFPS_;
+    int baseIterations_;
+    std::unique_ptr<MtWorld> mtWorld_;
+    bool multithreaded_;
+    int subSteps_;
+
+    std::vector<glm::mat4> drivers_;  // Global transforms of the bones of bodies.
+    std::thread thread_;
+    std::atomic<bool> quit_;
+    std::vector<std::unique_ptr<FixedMotionState>> motionStates_;
+    TripleBuffer<Inputs> inputs_;
+    TripleBuffer<Outputs> outputs_;
+    std::array<Outputs, 2> shown_;  // The last two results.
+    uint32_t shownCount_;
+
+    uint32_t calmFrames_;
+    bool asleep_;
+    uint64_t wakes_;  // Counted on the render side.
+    uint64_t seenWakes_;
+    uint32_t sleeps_;
+    double suspendedSeconds_;
+    double totalSeconds_;
+
+    Tier tier_;
+    double cost_;  // Smoothed, in seconds.
+    uint32_t overFrames_;
+    uint32_t underFrames_;
+    uint32_t upFrames_;
+    uint64_t lastStepUp_;
+    uint64_t frame_;
+    uint32_t tierChanges_;
+};
+
+// springbone.cpp
+// Cheap alternative to Bullet for secondary motion such as hair and skirts.
+// Each dynamic rigid body becomes a verlet particle at its center, hanging
+// from the head of its bone.  Particles are pulled back to the animated
+// pose, kept at their distance from the head, and pushed out of kinematic
+// bodies approximated with spheres and capsules.  Joints between particles
+// other than a bone and its parent keep them near their rest distance;
+// their rotation and translation limits are ignored.  Bones are then
+// rotated to point to their particles.  Positions are stored as structure
+// of arrays and integrated 4 particles at a time.
+class SpringBones : private NonCopyable {
+public:
+    SpringBones();
+    bool Create(const saba::PMXFile& pmx, const std::shared_ptr<saba::MMDModel>& model);
+    bool IsEnabled() const;
+    void SetGravity(float gravity);  // Same as Config::gravity.
+    // Same as PhysicsController::SetDisabledBodies().
+    void SetDisabledBodies(const std::vector<int>& groups,
+            const std::vector<std::string>& patterns);
+    void Reset();  // Puts particles at the animated pose on the next update.
+    void Update(double elapsed);  // In place of the physics update.
+    size_t GetParticleCount() const;
+private:
+    struct Particle {
+        saba::MMDNode *node;
+        int32_t parent;  // Particle of the parent bone, or -1.
+        uint32_t depth;  // In the bone hierarchy.
+        glm::vec3 center;  // Of the body, in the bone space.
+        float length;  // From the head of the bone.
+        float radius;
+        float drag;  // Per step at 60 FPS.
+        uint8_t group;
+        uint16_t mask;
+        std::vector<uint32_t> colliders;
+        glm::mat4 global;  // Simulated transform of the bone.
+        std::string name;  // Of the rigid body.
+        bool disabled;  // Follows the animation.
+    };
+    struct Link {  // From a joint.
+        uint32_t a;
+        uint32_t b;
+        float length;  // At rest.
+    };
+    struct Collider {
+        saba::MMDNode *node;
+        glm::mat4 offset;  // From the bone.  Y is the capsule axis.
+        float radius;
+        float halfLength;  // Of the capsule segment.  0 for spheres.
+        uint8_t group;
+        uint16_t mask;
+    };
+
+    const glm::mat4& parentGlobal(const Particle& p) const;
+    void solveLinks();
+    void solve(float stiffness, bool reset);
+
+    bool enabled_;
+    std::vector<Particle> particles_;  // Parents first.
+    std::vector<Link> links_;
+    std::vector<Collider> colliders_;
+    std::array<std::vector<float>, 3> positions_;  // X, Y and Z.
+    std::array<std::vector<float>, 3> prevPositions_;
+    std::vector<float> keeps_;  // 1 - drag for this frame.
+    std::vector<glm::mat4> animLocals_;
+    std::vector<glm::vec3> colliderCenters_;
+    std::vector<glm::vec3> colliderAxes_;  // Half the segment.
+    glm::vec3 gravity_;
+    float lastStep_;
+    bool needsReset_;
+};
+
+// jobs.cpp
+// Runs a fixed graph of tasks once per Run() on a small pool of threads.
+// Each thread has its own queue, and idle threads steal from the others.
+// With a single thread, tasks run in insertion order on the caller.
+class JobSystem : private NonCopyable {
+public:
+    using TaskID = uint32_t;
+    JobSystem();
+    ~JobSystem();
+    void Init(unsigned int threadCount);  // Including the calling thread.  0 means auto.
+    // Dependencies must be added before.
+    TaskID Add(const std::string& name, std::function<void()> func,
+            const std::vector<TaskID>& deps = {});
+    // Splits [0, count) into chunks.  The returned task finishes after all.
+    TaskID ParallelFor(const std::string& name, size_t count, size_t grain,
+            std::function<void(size_t, size_t)> func, const std::vector<TaskID>& deps = {});
+    void Run();  // Blocks until all tasks finish.
+    void LogStats() const;
+private:
+    struct Task {
+        std::function<void()> func;
+        std::vector<TaskID> successors;
+        uint32_t depCount;
+        uint32_t statIndex;
+    };
+    struct Stat {
+        std::string name;
+        double seconds;  // Total.
+    };
+    struct Queue {
+        std::mutex mutex;
+        std::deque<TaskID> tasks;
+    };
+
+    void workerMain(size_t index);
+    bool runOne(size_t index);
+    void runTask(TaskID id);
+
+    std::vector<Task> tasks_;
+    std::vector<TaskID> roots_;
+    std::unique_ptr<std::atomic<uint32_t>[]> pending_;  // Unfinished dependencies.
+    std::vector<double> taskSeconds_;
+    std::vector<Stat> stats_;
+    std::vector<std::unique_ptr<Queue>> queues_;  // queues_[0] is the caller's.
+    std::vector<std::thread> workers_;
+    std::atomic<uint32_t> remaining_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    uint64_t generation_;  // Incremented on each Run() to wake workers.
+    bool quit_;
+    uint64_t runs_;
+};
+
+// library.cpp
+// Index of configured motions.  Motions are loaded on demand: the playing
+// one is loaded synchronously at startup, and the next one is loaded by a
+// background thread while the current one plays.  When loaded motions
+// exceed the memory limit, the least recently played ones are dropped.
+// VMD files shared by several motions are parsed once while in use.
+class MotionLibrary : private NonCopyable {
+public:
+    using Path = std::filesystem::path;
+    struct Motion {
+        std::unique_ptr<MotionEvaluator> evaluator;
+        std::shared_ptr<saba::VMDCameraAnimation> camera;
+    };
+
+    MotionLibrary();
+    ~MotionLibrary();
+    void Init(const std::shared_ptr<saba::MMDModel>& model);
+    void SetMemoryLimit(size_t bytes);  // 0 means unlimited.
+    void AddMotion(const std::vector<Path>& paths);
+    size_t GetMotionCount() const;
+    int32_t GetDuration(size_t index) const;
+    const std::vector<std::string>& GetBoneNames(size_t index) const;
+    const std::vector<std::string>& GetMorphNames(size_t index) const;
+    const std::vector<Path>& GetPaths(size_t index) const;
+    // Content hash of a VMD file, known once a motion using it is loaded.
+    std::optional<uint64_t> GetHash(const Path& path) const;
+    const Motion *Load(size_t index);  // Blocks until loaded.
+    const Motion *Get(size_t index);  // Returns nullptr if not loaded yet.
+    void SetPlaying(size_t current, size_t next);  // Starts prefetching "next".
+    size_t GetResidentBytes() const;
+private:
+    static constexpr size_t NoMotion = SIZE_MAX;
+    enum class State { Unloaded, Loading, Loaded };
+    struct Entry {
+        std::vector<Path> paths;
+        int32_t duration;
+        std::vector<std::string> boneNames;
+        std::vector<std::string> morphNames;
+        bool mergeFiles;  // The files key the same channels, so they're played as one clip.
+        State state;
+        std::unique_ptr<Motion> motion;
+        size_t bytes;
+        uint64_t lastUsed;
+    };
+    struct CachedVmd {
+        std::shared_ptr<const MotionClip> clip;
+        std::shared_ptr<saba::VMDCameraAnimation> camera;
+        size_t bytes;
+    };
+    struct WeakCachedVmd {
+        std::weak_ptr<const MotionClip> clip;
+        std::weak_ptr<saba::VMDCameraAnimation> camera;
+        size_t bytes;
+    };
+
+    void workerMain();
+    std::unique_ptr<Motion> loadMotion(const std::vector<Path>& paths, bool mergeFiles, size_t& bytes);
+    uint64_t hashVmd(const Path& path, const MappedFile& file);  // Hashed once per path.
+    CachedVmd loadVmd(const Path& path);
+    // One clip of all the files, for files keying the same channels.
+    CachedVmd loadMergedVmd(const std::vector<Path>& paths);
+    void evict();
+
+    std::shared_ptr<saba::MMDModel> model_;
+    size_t memoryLimit_;
+    std::vector<Entry> entries_;
+    size_t current_;
+    size_t next_;
+    uint64_t useCount_;
+    std::map<Path, uint64_t> hashes_;
+    std::map<uint64_t, WeakCachedVmd> cache_;  // Keyed by content hash.
+    std::map<std::vector<uint64_t>, WeakCachedVmd> mergedCache_;  // By hashes of the files.
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<size_t> queue_;
+    std::thread worker_;
+    bool quit_;
+};
+
+// mmd.cpp
 class Material {
 public:
     explicit Material(const saba::MMDMaterial& mat);
@@ -184,24 +1148,72 @@ public:
     std::optional<sg_image> spTexture;
     std::optional<sg_image> toonTexture;
     bool textureHasAlpha;
+    bool texturesLoaded;  // Deferred while the material is hidden.
 };
 
 class MMD : private NonCopyable {
 public:
     using Path = std::filesystem::path;
-    using Animation = std::pair<
-        std::unique_ptr<saba::VMDAnimation>,
-        std::unique_ptr<saba::VMDCameraAnimation>>;
-    void LoadModel(const Path& modelPath, const Path& resourcePath);
-    void LoadMotion(const std::vector<Path>& paths);
+    // Empty "cacheDir" disables the model cache.
+    void LoadModel(const Path& modelPath, const Path& resourcePath, const Path& cacheDir);
+    void AddMotion(const std::vector<Path>& paths);
     bool IsModelLoaded() const;
     const std::shared_ptr<saba::MMDModel> GetModel() const;
-    const std::vector<Animation>& GetAnimations() const;
+    std::optional<uint64_t> GetModelHash() const;  // Of the model file.
+    MotionLibrary& GetMotions();
+    const saba::MMDMaterial& GetMaterial(size_t index) const;
+    void BeginAnimation();
+    void UpdateMorphAnimation();
+    void UpdateMorphOffsets();  // Needn't wait for UpdateNodeAnimation().
+    void UpdateNodeAnimation(bool afterPhysicsAnim);
+    void UpdatePhysicsAnimation(double elapsed);
+    void EndAnimation();
+    void UpdateVertices();
+    bool CanUpdateVerticesInParallel() const;
+    void UpdateVertices(size_t begin, size_t end);  // Requires CanUpdateVerticesInParallel().
+    const glm::vec3 *GetUpdatePositions() const;
+    const glm::vec3 *GetUpdateNormals() const;
+    const glm::vec2 *GetUpdateUVs() const;
+    size_t GetUpdateVertexCount() const;  // Vertices to upload.
+    void SetIkIterationBudget(uint32_t budget);
+    // With "reproducible", physics doesn't adapt to wall-clock time or
+    // threads, e.g. for fixed step runs.
+    void SetupPhysics(const Config& config, bool reproducible);
+    void SetPhysicsView(const glm::mat4& viewProjection, const glm::vec2& viewportSize);
+    void WakePhysics();
+    void StartPhysicsThread();
+    void StopPhysicsThread();
+    // Steps physics holding the first pose of the motion so that it starts
+    // settled.  Doesn't touch morphs and materials, so it may run in
+    // parallel with texture loading.
+    void PrerollPhysics(MotionEvaluator& evaluator, unsigned int steps, double step);
+    // Saves or restores the physics state settled by PrerollPhysics(), in
+    // the first pose of the motion.  Bullet only.
+    bool SavePhysicsSnapshot(const Path& file, uint64_t key) const;
+    bool LoadPhysicsSnapshot(MotionEvaluator& evaluator, const Path& file, uint64_t key);
+    // Logs step times of Saba's world, the multithreaded one and spring
+    // bones, playing the motion from the start.  Each run starts from the
+    // state settled by "preroll" steps in the first pose.
+    void BenchmarkPhysics(MotionEvaluator& evaluator, unsigned int preroll, unsigned int steps,
+            double step, unsigned int threads);
+    void PruneUnused();
+    void LogStats() const;
+    // nullptr unless yoMMD steps Bullet for this model.
+    const PhysicsController *GetPhysics() const;
 private:
     std::shared_ptr<saba::MMDModel> model_;
-    std::vector<Animation> animations_;
+    MotionLibrary motions_;
+    MorphEngine morph_;
+    Skeleton skeleton_;
+    Skinning skinning_;
+    IkStage ik_;
+    PhysicsController physics_;
+    SpringBones springBones_;
+    bool useSpringBones_ = false;
+    std::optional<uint64_t> modelHash_;
 };
 
+// viewer.cpp
 class UserViewport {
 public:
     UserViewport();
@@ -226,6 +1238,23 @@ private:
     DragHelper dragHelper_;
 };
 
+// Source of time for animation.  Follows the wall clock by default.  In
+// fixed-step mode, time advances exactly "step" seconds per frame so that
+// runs are reproducible regardless of the machine's speed.
+class Clock {
+public:
+    Clock();
+    void Init(std::optional<double> fixedStep);  // Call after stm_setup().
+    double Now() const;  // In seconds.
+    double Since(double time) const;
+    void Tick();  // Call once per frame.
+    bool IsFixedStep() const;
+private:
+    std::optional<double> step_;
+    uint64_t frame_;
+    uint64_t origin_;
+};
+
 class Routine : private NonCopyable {
 public:
     Routine();
@@ -240,10 +1269,21 @@ public:
     void ResetModelPosition();
 private:
     using ImageMap = std::map<std::string, Image>;
+    // Inputs of the frame task graph, set before running it.
+    struct FrameState {
+        const MotionLibrary::Motion *motion;
+        double vmdFrame;
+        double elapsedTime;
+        glm::vec2 windowSize;
+    };
     void initBuffers();
+    void initJobs();
+    void updateCamera();
+    void updateMotion();
     void initTextures();
+    void loadMaterialTextures(Material& material);
     void initPipeline();
-    void selectNextMotion();
+    size_t pickNextMotion();
     std::optional<ImageMap::const_iterator> loadImage(const std::string& path);
     std::optional<sg_image> getTexture(const std::string& path);
 private:
@@ -282,12 +1322,20 @@ private:
     Camera defaultCamera_;
 
     // Timers for animation.
-    uint64_t timeBeginAnimation_;
-    uint64_t timeLastFrame_;
+    Clock clock_;
+    JobSystem jobs_;
+    FrameState frame_;
+    double timeBeginAnimation_;
+    double timeLastFrame_;
 
     size_t motionID_;
-    bool needBridgeMotions_;
+    size_t nextMotionID_;
     std::vector<unsigned int> motionWeights_;
+    std::vector<float> motionCrossfades_;
+
+    Crossfade crossfade_;
+    double timeBeginCrossfade_;
+    float crossfadeDuration_;
 
     std::mt19937 rand_;
     std::uniform_int_distribution<size_t> randDist_;